@@ -1,33 +1,37 @@
 
 #include "common_code.hpp"
+#include "fsiv_parallel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core/hal/intrin.hpp>
 
-void 
-find_min_max_in_channel(const cv::Mat& img,
+/**
+ * @brief Update the running extremes of one channel with the row extremes.
+ *
+ * The row is only rescanned when it strictly improves the running value, so
+ * the location kept is always the first one in rows/cols scanning order.
+ */
+static void
+update_extremes_with_row(const cv::uint8_t* row_ptr, int cn, int c,
+    int row, cv::uint8_t row_min, cv::uint8_t row_max,
     cv::uint8_t& min_v, cv::uint8_t& max_v,
     cv::Point& min_loc, cv::Point& max_loc)
 {
-    CV_Assert( !img.empty() );
-    CV_Assert( img.type() == CV_8UC1 );
-    
-    min_v = img.at<cv::uint8_t>(0, 0);
-    max_v = img.at<cv::uint8_t>(0, 0);
-    min_loc = cv::Point(0,0);
-    max_loc = cv::Point(0,0);
-    
-    for (int row=0; row<img.rows; ++row)
-    {
-        for (int col=0; col<img.cols; ++col)
-        {
-            cv::uint8_t pixel_v = img.at<cv::uint8_t>(row, col);
-            if(pixel_v > max_v){
-                max_v = pixel_v;
-                max_loc = cv::Point(col, row);
-            }
-            else if(pixel_v < min_v){
-                min_v = pixel_v;
-                min_loc = cv::Point(col, row);
-            }
-        }
+    if (row_min < min_v)
+    {
+        int col = 0;
+        while (row_ptr[col*cn + c] != row_min)
+            ++col;
+        min_v = row_min;
+        min_loc = cv::Point(col, row);
+    }
+    if (row_max > max_v)
+    {
+        int col = 0;
+        while (row_ptr[col*cn + c] != row_max)
+            ++col;
+        max_v = row_max;
+        max_loc = cv::Point(col, row);
     }
 }
 
@@ -40,23 +44,108 @@ fsiv_find_min_max_loc_1(cv::Mat const& input,
 
     CV_Assert( !input.empty() );
 
-    std::vector<cv::Mat> channels;
-    cv::split(input, channels);
+    const int cn = input.channels();
+    CV_Assert( cn <= 4 );
+
+    // Start from the "worst" values so the first row always sets them.
+    // When the image is constant the location stays at (0,0), which is the
+    // first occurrence too.
+    min_v.assign(cn, 255);
+    max_v.assign(cn, 0);
+    min_loc.assign(cn, cv::Point(0,0));
+    max_loc.assign(cn, cv::Point(0,0));
 
-    for(size_t c = 0; c<channels.size(); ++c)
+    cv::uint8_t row_min[4];
+    cv::uint8_t row_max[4];
+
+    for (int row=0; row<input.rows; ++row)
     {
-        cv::uint8_t aux_min_v;
-        cv::uint8_t aux_max_v;
-        cv::Point aux_min_loc;
-        cv::Point aux_max_loc;
+        const cv::uint8_t* ptr = input.ptr<cv::uint8_t>(row);
+        int col = 0;
+
+        for (int c=0; c<cn; ++c)
+        {
+            row_min[c] = 255;
+            row_max[c] = 0;
+        }
+
+#if CV_SIMD
+        // Process the packed (interleaved) row directly, without split().
+        const int VL = cv::v_uint8::nlanes;
+        if (cn == 1)
+        {
+            cv::v_uint8 vmin = cv::vx_setall_u8(255), vmax = cv::vx_setzero_u8();
+            for (; col <= input.cols - VL; col += VL)
+            {
+                cv::v_uint8 v = cv::vx_load(ptr + col);
+                vmin = cv::v_min(vmin, v);
+                vmax = cv::v_max(vmax, v);
+            }
+            row_min[0] = cv::v_reduce_min(vmin);
+            row_max[0] = cv::v_reduce_max(vmax);
+        }
+        else if (cn == 3)
+        {
+            cv::v_uint8 vmin[3], vmax[3], v[3];
+            for (int c=0; c<3; ++c)
+            {
+                vmin[c] = cv::vx_setall_u8(255);
+                vmax[c] = cv::vx_setzero_u8();
+            }
+            for (; col <= input.cols - VL; col += VL)
+            {
+                cv::v_load_deinterleave(ptr + 3*col, v[0], v[1], v[2]);
+                for (int c=0; c<3; ++c)
+                {
+                    vmin[c] = cv::v_min(vmin[c], v[c]);
+                    vmax[c] = cv::v_max(vmax[c], v[c]);
+                }
+            }
+            for (int c=0; c<3; ++c)
+            {
+                row_min[c] = cv::v_reduce_min(vmin[c]);
+                row_max[c] = cv::v_reduce_max(vmax[c]);
+            }
+        }
+        else if (cn == 4)
+        {
+            cv::v_uint8 vmin[4], vmax[4], v[4];
+            for (int c=0; c<4; ++c)
+            {
+                vmin[c] = cv::vx_setall_u8(255);
+                vmax[c] = cv::vx_setzero_u8();
+            }
+            for (; col <= input.cols - VL; col += VL)
+            {
+                cv::v_load_deinterleave(ptr + 4*col, v[0], v[1], v[2], v[3]);
+                for (int c=0; c<4; ++c)
+                {
+                    vmin[c] = cv::v_min(vmin[c], v[c]);
+                    vmax[c] = cv::v_max(vmax[c], v[c]);
+                }
+            }
+            for (int c=0; c<4; ++c)
+            {
+                row_min[c] = cv::v_reduce_min(vmin[c]);
+                row_max[c] = cv::v_reduce_max(vmax[c]);
+            }
+        }
+#endif
+        // Scalar tail (or the whole row when there is no SIMD support).
+        for (; col<input.cols; ++col)
+        {
+            for (int c=0; c<cn; ++c)
+            {
+                const cv::uint8_t pixel_v = ptr[col*cn + c];
+                row_min[c] = std::min(row_min[c], pixel_v);
+                row_max[c] = std::max(row_max[c], pixel_v);
+            }
+        }
 
-        find_min_max_in_channel(channels[c], aux_min_v, aux_max_v, aux_min_loc, aux_max_loc);
-              
-        min_v.push_back(aux_min_v);
-        max_v.push_back(aux_max_v);
-        min_loc.push_back(aux_min_loc);
-        max_loc.push_back(aux_max_loc);
- 
+        for (int c=0; c<cn; ++c)
+            update_extremes_with_row(ptr, cn, c, row,
+                row_min[c], row_max[c], min_v[c], max_v[c],
+                min_loc[c], max_loc[c]);
     }
 
     CV_Assert(input.channels()==min_v.size());
@@ -73,24 +162,36 @@ fsiv_find_min_max_loc_2(cv::Mat const& input,
 
     CV_Assert( !input.empty() );
 
-    std::vector<cv::Mat> channels;
-    cv::split(input, channels);
+    const int cn = input.channels();
+    fsiv_min_max_loc_partial init;
+    init.min_v.assign(cn, 0.0);
+    init.max_v.assign(cn, 0.0);
+    init.min_loc.assign(cn, cv::Point(-1,-1));
+    init.max_loc.assign(cn, cv::Point(-1,-1));
 
-    for(size_t c = 0; c<channels.size(); ++c)
-    {
-        double aux_min_v;
-        double aux_max_v;
-        cv::Point aux_min_loc;
-        cv::Point aux_max_loc;
+    fsiv_min_max_loc_partial result = fsiv_parallel_row_reduce(input, init,
+        [cn](cv::Mat const& tile, int row0, fsiv_min_max_loc_partial& p)
+        {
+            cv::Mat channel;
+            for (int c = 0; c<cn; ++c)
+            {
+                if (cn == 1)
+                    channel = tile;
+                else
+                    cv::extractChannel(tile, channel, c);
 
-        cv::minMaxLoc(channels[c], &aux_min_v, &aux_max_v, &aux_min_loc, &aux_max_loc);
-              
-        min_v.push_back(aux_min_v);
-        max_v.push_back(aux_max_v);
-        min_loc.push_back(aux_min_loc);
-        max_loc.push_back(aux_max_loc);
- 
-    }
+                cv::minMaxLoc(channel, &p.min_v[c], &p.max_v[c],
+                              &p.min_loc[c], &p.max_loc[c]);
+                p.min_loc[c].y += row0;
+                p.max_loc[c].y += row0;
+            }
+        },
+        fsiv_merge_min_max_loc);
+
+    min_v = result.min_v;
+    max_v = result.max_v;
+    min_loc = result.min_loc;
+    max_loc = result.max_loc;
 
     CV_Assert(input.channels()==min_v.size());
     CV_Assert(input.channels()==max_v.size());
@@ -99,3 +200,595 @@ fsiv_find_min_max_loc_2(cv::Mat const& input,
 
 }
 
+void
+fsiv_merge_min_max_loc(fsiv_min_max_loc_partial& acc,
+    fsiv_min_max_loc_partial const& p)
+{
+    CV_Assert(acc.min_v.size() == p.min_v.size());
+    for (size_t c = 0; c<acc.min_v.size(); ++c)
+    {
+        // Strict comparisons: on ties the earlier tile wins.
+        if (p.min_v[c] < acc.min_v[c])
+        {
+            acc.min_v[c] = p.min_v[c];
+            acc.min_loc[c] = p.min_loc[c];
+        }
+        if (p.max_v[c] > acc.max_v[c])
+        {
+            acc.max_v[c] = p.max_v[c];
+            acc.max_loc[c] = p.max_loc[c];
+        }
+    }
+}
+
+fsiv_moments_partial
+fsiv_compute_moments_parallel(cv::Mat const& img)
+{
+    CV_Assert( !img.empty() );
+    CV_Assert( img.channels() <= 4 );
+
+    return fsiv_parallel_row_reduce(img, fsiv_moments_partial(),
+        [](cv::Mat const& tile, int, fsiv_moments_partial& p)
+        {
+            p.sum = cv::sum(tile);
+            if (tile.channels() == 1)
+                p.sum2[0] = cv::norm(tile, cv::NORM_L2SQR);
+            else
+            {
+                cv::Mat channel;
+                for (int c = 0; c<tile.channels(); ++c)
+                {
+                    cv::extractChannel(tile, channel, c);
+                    p.sum2[c] = cv::norm(channel, cv::NORM_L2SQR);
+                }
+            }
+            p.count = static_cast<double>(tile.total());
+        },
+        [](fsiv_moments_partial& acc, fsiv_moments_partial const& p)
+        {
+            acc.sum += p.sum;
+            acc.sum2 += p.sum2;
+            acc.count += p.count;
+        });
+}
+
+void
+fsiv_compute_stats_parallel(cv::Mat const& img, float& media, float& dev)
+{
+    CV_Assert( !img.empty() );
+    CV_Assert( img.channels() == 1 );
+
+    const fsiv_moments_partial m = fsiv_compute_moments_parallel(img);
+    const double mean = m.sum[0] / m.count;
+    const double var = m.sum2[0] / m.count - mean*mean;
+
+    media = static_cast<float>(mean);
+    dev = static_cast<float>(std::sqrt(std::max(0.0, var)));
+}
+
+cv::Mat
+fsiv_compute_histogram_parallel(cv::Mat const& img)
+{
+    CV_Assert( img.type() == CV_8UC1 );
+
+    const std::vector<double> hist = fsiv_parallel_row_reduce(img,
+        std::vector<double>(256, 0.0),
+        [](cv::Mat const& tile, int, std::vector<double>& p)
+        {
+            int counts[256] = {0};
+            for (int row = 0; row < tile.rows; ++row)
+            {
+                const cv::uint8_t* ptr = tile.ptr<cv::uint8_t>(row);
+                for (int col = 0; col < tile.cols; ++col)
+                    ++counts[ptr[col]];
+            }
+            for (int i = 0; i < 256; ++i)
+                p[i] = counts[i];
+        },
+        [](std::vector<double>& acc, std::vector<double> const& p)
+        {
+            for (int i = 0; i < 256; ++i)
+                acc[i] += p[i];
+        });
+
+    cv::Mat ret_v(256, 1, CV_32FC1);
+    for (int i = 0; i < 256; ++i)
+        ret_v.at<float>(i) = static_cast<float>(hist[i]);
+
+    CV_Assert( ret_v.type() == CV_32FC1 );
+    CV_Assert( ret_v.rows == 256 && ret_v.cols == 1 );
+    return ret_v;
+}
+
+// Rows are split in blocks of this size, so the SIMD integer accumulators
+// never overflow.
+static const int STATS_BLOCK = 1024;
+
+/**
+ * @brief Sum and sum of squares of a block of bytes (exact).
+ */
+static void
+block_sums(const uchar* p, int n, double& s, double& s2)
+{
+    uint64 is = 0, is2 = 0;
+    int i = 0;
+#if CV_SIMD
+    const int VL = cv::v_uint8::nlanes;
+    cv::v_uint32 vs = cv::vx_setzero_u32(), vs2 = cv::vx_setzero_u32();
+    for (; i <= n - VL; i += VL)
+    {
+        cv::v_uint16 lo, hi;
+        cv::v_expand(cv::vx_load(p + i), lo, hi);
+        cv::v_int16 slo = cv::v_reinterpret_as_s16(lo);
+        cv::v_int16 shi = cv::v_reinterpret_as_s16(hi);
+        vs2 += cv::v_reinterpret_as_u32(cv::v_dotprod(slo, slo) +
+                                        cv::v_dotprod(shi, shi));
+        cv::v_uint32 a, b;
+        cv::v_expand(lo + hi, a, b);
+        vs += a + b;
+    }
+    is = cv::v_reduce_sum(vs);
+    is2 = cv::v_reduce_sum(vs2);
+#endif
+    for (; i < n; ++i)
+    {
+        is += p[i];
+        is2 += p[i]*p[i];
+    }
+    s = static_cast<double>(is);
+    s2 = static_cast<double>(is2);
+}
+
+/**
+ * @brief Sum and sum of squares of a block of 16 bit words (exact).
+ */
+static void
+block_sums(const ushort* p, int n, double& s, double& s2)
+{
+    uint64 is = 0, is2 = 0;
+    int i = 0;
+#if CV_SIMD
+    const int VL = cv::v_uint16::nlanes;
+    cv::v_uint32 vs = cv::vx_setzero_u32();
+    cv::v_uint64 vs2 = cv::vx_setzero_u64();
+    for (; i <= n - VL; i += VL)
+    {
+        cv::v_uint16 v = cv::vx_load(p + i);
+        cv::v_uint32 a, b;
+        cv::v_expand(v, a, b);
+        vs += a + b;
+        cv::v_mul_expand(v, v, a, b);
+        cv::v_uint64 a0, a1, b0, b1;
+        cv::v_expand(a, a0, a1);
+        cv::v_expand(b, b0, b1);
+        vs2 += (a0 + a1) + (b0 + b1);
+    }
+    is = cv::v_reduce_sum(vs);
+    uint64 buf[cv::v_uint64::nlanes];
+    cv::v_store(buf, vs2);
+    for (int j = 0; j < cv::v_uint64::nlanes; ++j)
+        is2 += buf[j];
+#endif
+    for (; i < n; ++i)
+    {
+        is += p[i];
+        is2 += uint64(p[i])*p[i];
+    }
+    s = static_cast<double>(is);
+    s2 = static_cast<double>(is2);
+}
+
+/**
+ * @brief Sum and sum of squares of a block of floats centered on c.
+ */
+static void
+block_sums(const float* p, int n, double c, double& s, double& s2)
+{
+    s = 0.0;
+    s2 = 0.0;
+    int i = 0;
+#if CV_SIMD_64F
+    const int VL = cv::v_float32::nlanes;
+    const cv::v_float64 vc = cv::vx_setall_f64(c);
+    cv::v_float64 vs = cv::vx_setzero_f64(), vs2 = cv::vx_setzero_f64();
+    for (; i <= n - VL; i += VL)
+    {
+        cv::v_float32 v = cv::vx_load(p + i);
+        cv::v_float64 lo = cv::v_cvt_f64(v) - vc;
+        cv::v_float64 hi = cv::v_cvt_f64_high(v) - vc;
+        vs += lo + hi;
+        vs2 = cv::v_fma(lo, lo, vs2);
+        vs2 = cv::v_fma(hi, hi, vs2);
+    }
+    s = cv::v_reduce_sum(vs);
+    s2 = cv::v_reduce_sum(vs2);
+#endif
+    for (; i < n; ++i)
+    {
+        const double d = p[i] - c;
+        s += d;
+        s2 += d*d;
+    }
+}
+
+fsiv_stats_accumulator::fsiv_stats_accumulator(Mode mode)
+    : mode_(mode)
+{
+    reset();
+}
+
+void
+fsiv_stats_accumulator::reset()
+{
+    n_ = 0.0;
+    mean_ = m2_ = 0.0;
+    center_ = 0.0;
+    sum_ = sum_c_ = 0.0;
+    sum2_ = sum2_c_ = 0.0;
+    partials_.clear();
+}
+
+fsiv_stats_accumulator::Mode
+fsiv_stats_accumulator::mode() const
+{
+    return mode_;
+}
+
+double
+fsiv_stats_accumulator::count() const
+{
+    return n_;
+}
+
+double
+fsiv_stats_accumulator::mean() const
+{
+    if (n_ == 0.0)
+        return 0.0;
+    if (mode_ == WELFORD)
+        return mean_;
+    if (mode_ == PAIRWISE)
+        return collapse().mean;
+    return center_ + sum_ / n_;
+}
+
+double
+fsiv_stats_accumulator::variance() const
+{
+    if (n_ == 0.0)
+        return 0.0;
+    if (mode_ == WELFORD)
+        return m2_ / n_;
+    if (mode_ == PAIRWISE)
+        return collapse().m2 / n_;
+    const double m = sum_ / n_;
+    return std::max(0.0, sum2_ / n_ - m*m);
+}
+
+double
+fsiv_stats_accumulator::stddev() const
+{
+    return std::sqrt(variance());
+}
+
+/**
+ * @brief Kahan compensated addition.
+ */
+static inline void
+kahan_add(double& sum, double& comp, double v)
+{
+    const double y = v - comp;
+    const double t = sum + y;
+    comp = (t - sum) - y;
+    sum = t;
+}
+
+/**
+ * @brief Chan merge of the moments of two sets of values.
+ */
+static inline void
+chan_merge(double& n, double& mean, double& m2,
+           double nb, double meanb, double m2b)
+{
+    const double total = n + nb;
+    const double delta = meanb - mean;
+    mean += delta * (nb / total);
+    m2 += m2b + delta*delta * (n * nb / total);
+    n = total;
+}
+
+void
+fsiv_stats_accumulator::push_partial(Partial p)
+{
+    while (!partials_.empty() && partials_.back().blocks <= p.blocks)
+    {
+        Partial top = partials_.back();
+        partials_.pop_back();
+        chan_merge(top.n, top.mean, top.m2, p.n, p.mean, p.m2);
+        top.blocks += p.blocks;
+        p = top;
+    }
+    partials_.push_back(p);
+}
+
+fsiv_stats_accumulator::Partial
+fsiv_stats_accumulator::collapse() const
+{
+    Partial r = {0.0, 0.0, 0.0, 0.0};
+    for (size_t i = partials_.size(); i-- > 0; )
+    {
+        Partial p = partials_[i];
+        chan_merge(p.n, p.mean, p.m2, r.n, r.mean, r.m2);
+        p.blocks += r.blocks;
+        r = p;
+    }
+    return r;
+}
+
+void
+fsiv_stats_accumulator::add_moments(double n, double m, double m2)
+{
+    if (n == 0.0)
+        return;
+    if (mode_ == PAIRWISE)
+    {
+        const Partial p = {1.0, n, m, m2};
+        push_partial(p);
+        n_ += n;
+    }
+    else if (mode_ == WELFORD)
+        chan_merge(n_, mean_, m2_, n, m, m2);
+    else
+    {
+        if (n_ == 0.0)
+            center_ = m;
+        const double d = m - center_;
+        kahan_add(sum_, sum_c_, n*d);
+        kahan_add(sum2_, sum2_c_, m2 + n*d*d);
+        n_ += n;
+    }
+}
+
+void
+fsiv_stats_accumulator::add(cv::Mat const& tile)
+{
+    CV_Assert( tile.channels() == 1 );
+    CV_Assert( tile.depth() == CV_8U || tile.depth() == CV_16U ||
+               tile.depth() == CV_32F );
+
+    for (int row = 0; row < tile.rows; ++row)
+    {
+        for (int col = 0; col < tile.cols; col += STATS_BLOCK)
+        {
+            const int n = std::min(STATS_BLOCK, tile.cols - col);
+            double s = 0.0, s2 = 0.0, c = 0.0;
+            switch (tile.depth())
+            {
+            case CV_8U:
+                block_sums(tile.ptr<uchar>(row) + col, n, s, s2);
+                break;
+            case CV_16U:
+                block_sums(tile.ptr<ushort>(row) + col, n, s, s2);
+                break;
+            default:
+                c = tile.ptr<float>(row)[col];
+                block_sums(tile.ptr<float>(row) + col, n, c, s, s2);
+                break;
+            }
+            // The block moments are exact for integer data and centered on
+            // c for floats, so there is no cancellation here.
+            const double bm = s / n;
+            add_moments(n, c + bm, std::max(0.0, s2 - s*bm));
+        }
+    }
+}
+
+void
+fsiv_stats_accumulator::merge(fsiv_stats_accumulator const& other)
+{
+    if (mode_ == PAIRWISE && other.mode_ == PAIRWISE)
+    {
+        // Keep the tree shape: the other partials go in, bigger first.
+        const std::vector<Partial> others = other.partials_;
+        for (size_t i = 0; i < others.size(); ++i)
+            push_partial(others[i]);
+        n_ += other.n_;
+    }
+    else
+        add_moments(other.count(), other.mean(), other.variance() * other.count());
+}
+
+double
+fsiv_percentile(std::vector<double> values, double p)
+{
+    CV_Assert( 0.0 <= p && p <= 1.0 );
+    if (values.empty())
+        return 0.0;
+    const size_t rank = std::min(values.size() - 1,
+        static_cast<size_t>(std::ceil(p * values.size())) - (p > 0.0 ? 1 : 0));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+void
+fsiv_integral_parallel(cv::Mat const& img, cv::Mat& sum, cv::Mat& sqsum)
+{
+    CV_Assert( !img.empty() );
+    const int cn = img.channels();
+    const std::vector<cv::Range> bands = fsiv_make_row_tiles(img.rows,
+        img.cols*cn);
+    std::vector<cv::Mat> band_sum(bands.size()), band_sqsum(bands.size());
+
+    sum.create(img.rows + 1, img.cols + 1, CV_64FC(cn));
+    sqsum.create(img.rows + 1, img.cols + 1, CV_64FC(cn));
+    sum.row(0).setTo(cv::Scalar::all(0));
+    sqsum.row(0).setTo(cv::Scalar::all(0));
+
+    // Integrate each band on its own.
+    cv::parallel_for_(cv::Range(0, static_cast<int>(bands.size())),
+        [&](const cv::Range& r)
+        {
+            for (int b = r.start; b < r.end; ++b)
+                cv::integral(img.rowRange(bands[b]), band_sum[b],
+                             band_sqsum[b], CV_64F, CV_64F);
+        });
+
+    // The offset of a band is the sum of the bottom rows of the previous ones.
+    std::vector<cv::Mat> offset_sum(bands.size()), offset_sqsum(bands.size());
+    offset_sum[0] = cv::Mat::zeros(1, img.cols + 1, CV_64FC(cn));
+    offset_sqsum[0] = cv::Mat::zeros(1, img.cols + 1, CV_64FC(cn));
+    for (size_t b = 1; b < bands.size(); ++b)
+    {
+        offset_sum[b] = offset_sum[b-1] + band_sum[b-1].row(band_sum[b-1].rows-1);
+        offset_sqsum[b] = offset_sqsum[b-1] +
+            band_sqsum[b-1].row(band_sqsum[b-1].rows-1);
+    }
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(bands.size())),
+        [&](const cv::Range& r)
+        {
+            for (int b = r.start; b < r.end; ++b)
+            {
+                const int row0 = bands[b].start;
+                for (int i = 1; i < band_sum[b].rows; ++i)
+                {
+                    cv::Mat dst_sum = sum.row(row0 + i);
+                    cv::Mat dst_sqsum = sqsum.row(row0 + i);
+                    cv::add(band_sum[b].row(i), offset_sum[b], dst_sum);
+                    cv::add(band_sqsum[b].row(i), offset_sqsum[b], dst_sqsum);
+                }
+            }
+        });
+}
+
+fsiv_roi_stats_engine::fsiv_roi_stats_engine(int block)
+    : block_(block)
+{
+    CV_Assert( block > 0 );
+}
+
+void
+fsiv_roi_stats_engine::update(cv::Mat const& frame)
+{
+    CV_Assert( frame.depth() == CV_8U && frame.channels() <= 4 );
+    frame_ = frame;
+    fsiv_integral_parallel(frame_, sum_, sqsum_);
+
+    const int cn = frame_.channels();
+    const int brows = (frame_.rows + block_ - 1) / block_;
+    const int bcols = (frame_.cols + block_ - 1) / block_;
+    block_min_.create(brows, bcols, CV_8UC(cn));
+    block_max_.create(brows, bcols, CV_8UC(cn));
+
+    cv::parallel_for_(cv::Range(0, brows), [&](const cv::Range& r)
+    {
+        for (int by = r.start; by < r.end; ++by)
+        {
+            uchar* bmin = block_min_.ptr<uchar>(by);
+            uchar* bmax = block_max_.ptr<uchar>(by);
+            std::fill(bmin, bmin + bcols*cn, uchar(255));
+            std::fill(bmax, bmax + bcols*cn, uchar(0));
+            const int y1 = std::min(frame_.rows, (by + 1)*block_);
+            for (int y = by*block_; y < y1; ++y)
+            {
+                const uchar* p = frame_.ptr<uchar>(y);
+                for (int x = 0; x < frame_.cols; ++x)
+                {
+                    const int b = (x / block_)*cn;
+                    for (int c = 0; c < cn; ++c)
+                    {
+                        bmin[b + c] = std::min(bmin[b + c], p[x*cn + c]);
+                        bmax[b + c] = std::max(bmax[b + c], p[x*cn + c]);
+                    }
+                }
+            }
+        }
+    });
+}
+
+/**
+ * @brief Update a min/max scalar with the pixels of a row segment.
+ */
+static void
+scan_min_max(const uchar* p, int x0, int x1, int cn,
+    cv::Scalar& min_v, cv::Scalar& max_v)
+{
+    for (int x = x0; x < x1; ++x)
+        for (int c = 0; c < cn; ++c)
+        {
+            min_v[c] = std::min(min_v[c], double(p[x*cn + c]));
+            max_v[c] = std::max(max_v[c], double(p[x*cn + c]));
+        }
+}
+
+fsiv_roi_stats
+fsiv_roi_stats_engine::query(cv::Rect roi) const
+{
+    CV_Assert( !frame_.empty() );
+    fsiv_roi_stats stats;
+    stats.roi = roi & cv::Rect(0, 0, frame_.cols, frame_.rows);
+    const cv::Rect& r = stats.roi;
+    if (r.area() <= 0)
+        return stats;
+
+    const int cn = frame_.channels();
+    const double area = r.area();
+    const int x0 = r.x, y0 = r.y, x1 = r.x + r.width, y1 = r.y + r.height;
+    for (int c = 0; c < cn; ++c)
+    {
+        const double s = sum_.ptr<double>(y1)[x1*cn + c]
+                       - sum_.ptr<double>(y0)[x1*cn + c]
+                       - sum_.ptr<double>(y1)[x0*cn + c]
+                       + sum_.ptr<double>(y0)[x0*cn + c];
+        const double s2 = sqsum_.ptr<double>(y1)[x1*cn + c]
+                        - sqsum_.ptr<double>(y0)[x1*cn + c]
+                        - sqsum_.ptr<double>(y1)[x0*cn + c]
+                        + sqsum_.ptr<double>(y0)[x0*cn + c];
+        stats.mean[c] = s / area;
+        stats.stddev[c] = std::sqrt(std::max(0.0,
+            s2 / area - stats.mean[c]*stats.mean[c]));
+        stats.min_v[c] = 255.0;
+        stats.max_v[c] = 0.0;
+    }
+
+    // Blocks fully inside the region (a partial block on the image border
+    // is inside when the region reaches that border).
+    const int bx0 = (x0 + block_ - 1) / block_;
+    const int by0 = (y0 + block_ - 1) / block_;
+    const int bx1 = (x1 == frame_.cols) ? block_min_.cols : x1 / block_;
+    const int by1 = (y1 == frame_.rows) ? block_min_.rows : y1 / block_;
+
+    int ix0 = x1, ix1 = x1, iy0 = y1, iy1 = y1; // inner pixels (none).
+    if (bx0 < bx1 && by0 < by1)
+    {
+        ix0 = bx0*block_;
+        ix1 = std::min(bx1*block_, frame_.cols);
+        iy0 = by0*block_;
+        iy1 = std::min(by1*block_, frame_.rows);
+        for (int by = by0; by < by1; ++by)
+        {
+            const uchar* bmin = block_min_.ptr<uchar>(by);
+            const uchar* bmax = block_max_.ptr<uchar>(by);
+            for (int bx = bx0; bx < bx1; ++bx)
+                for (int c = 0; c < cn; ++c)
+                {
+                    stats.min_v[c] = std::min(stats.min_v[c], double(bmin[bx*cn + c]));
+                    stats.max_v[c] = std::max(stats.max_v[c], double(bmax[bx*cn + c]));
+                }
+        }
+    }
+
+    // Pixels outside the inner blocks.
+    for (int y = y0; y < y1; ++y)
+    {
+        const uchar* p = frame_.ptr<uchar>(y);
+        if (y >= iy0 && y < iy1)
+        {
+            scan_min_max(p, x0, ix0, cn, stats.min_v, stats.max_v);
+            scan_min_max(p, ix1, x1, cn, stats.min_v, stats.max_v);
+        }
+        else
+            scan_min_max(p, x0, x1, cn, stats.min_v, stats.max_v);
+    }
+    return stats;
+}
@@ -7,12 +7,15 @@
  * @brief Find the first max/min values and their locations.
  * 
  * The implementation must do a rows/cols scanning of the image.
+ * The packed (interleaved) rows are scanned in one pass using SIMD
+ * universal intrinsics, without splitting the image into channel planes.
  * 
  * @param input is the input image.
  * @param max_v maximum values per channel.
  * @param min_v minimum values per channel.
  * @param max_loc maximum locations per channel.
  * @param min_loc minimum values per channel.
+ * @pre input.depth()==CV_8U && input.channels()<=4
  * @post max_v.size()==input.channels()
  * @post min_v.size()==input.channels()
  * @post max_loc.size()==input.channels()
@@ -26,6 +29,7 @@ void fsiv_find_min_max_loc_1(cv::Mat const& input,
  * @brief Find the first max/min values and their locations.
  * 
  * The implementation must use the cv::minMaxLoc opencv function to vectorize the code.
+ * The image is reduced in parallel by row tiles (see fsiv_parallel_row_reduce).
  * 
  * @param input is the input image.
  * @param max_v maximum values per channel.
@@ -41,3 +45,233 @@ void fsiv_find_min_max_loc_2(cv::Mat const& input,
     std::vector<double>& min_v, std::vector<double>& max_v,
     std::vector<cv::Point>& min_loc, std::vector<cv::Point>& max_loc);
 
+/**
+ * @brief Partial result of a min/max/location reduction.
+ */
+struct fsiv_min_max_loc_partial
+{
+    std::vector<double> min_v;
+    std::vector<double> max_v;
+    std::vector<cv::Point> min_loc;
+    std::vector<cv::Point> max_loc;
+};
+
+/**
+ * @brief Merge two min/max partial results keeping the first occurrence.
+ * @param acc is the accumulated result (the earlier tiles).
+ * @param p is the partial result of a later tile.
+ */
+void fsiv_merge_min_max_loc(fsiv_min_max_loc_partial& acc,
+    fsiv_min_max_loc_partial const& p);
+
+/**
+ * @brief Partial result of a moments (sum and sum of squares) reduction.
+ */
+struct fsiv_moments_partial
+{
+    cv::Scalar sum;
+    cv::Scalar sum2;
+    double count = 0.0;
+};
+
+/**
+ * @brief Compute the per channel sum and sum of squares in parallel.
+ * @param img is the input image.
+ * @return the moments.
+ * @pre !img.empty()
+ * @pre img.channels()<=4
+ */
+fsiv_moments_partial fsiv_compute_moments_parallel(cv::Mat const& img);
+
+/**
+ * @brief Compute the mean and the standard deviation of a one channel image
+ * in parallel by row tiles.
+ * @param img is the input image (any depth).
+ * @param media is the mean.
+ * @param dev is the standard deviation.
+ * @pre !img.empty()
+ * @pre img.channels()==1
+ */
+void fsiv_compute_stats_parallel(cv::Mat const& img, float& media, float& dev);
+
+/**
+ * @brief Compute the histogram of a byte image in parallel by row tiles.
+ * @param img is the input image.
+ * @return the histogram (as cv::calcHist would do).
+ * @pre img.type()==CV_8UC1
+ * @post ret_v.type()==CV_32FC1
+ * @post ret_v.rows==256 && ret_v.cols==1
+ */
+cv::Mat fsiv_compute_histogram_parallel(cv::Mat const& img);
+
+/**
+ * @brief Streaming accumulator for the mean and the standard deviation.
+ *
+ * The image can be consumed row by row or tile by tile (see add()), so it is
+ * not needed to have the whole image in memory, and partial accumulators
+ * computed by parallel workers can be merged (see merge()).
+ *
+ * Each row is processed in blocks. The block sums are computed with SIMD code
+ * (exact integer arithmetic for CV_8U/CV_16U, double precision for CV_32F
+ * centered on the first block value) and then accumulated using:
+ * - WELFORD: Welford/Chan update of the mean and the centered sum of squares.
+ * - KAHAN: Kahan compensated sums, centered on the first block mean.
+ * - PAIRWISE: the block moments are merged in a balanced binary tree (a
+ *   stack of partial results, as a binary counter), so the rounding error
+ *   grows with the logarithm of the number of blocks.
+ * In all the modes the variance is never negative.
+ */
+class fsiv_stats_accumulator
+{
+public:
+    enum Mode
+    {
+        WELFORD = 0,
+        KAHAN = 1,
+        PAIRWISE = 2
+    };
+
+    /**
+     * @brief Create an empty accumulator.
+     * @param mode is the accumulation mode.
+     */
+    explicit fsiv_stats_accumulator(Mode mode = WELFORD);
+
+    /**
+     * @brief Reset to the empty state.
+     */
+    void reset();
+
+    /**
+     * @brief Accumulate the values of an image (or some rows of it).
+     * @param tile are the values to accumulate.
+     * @pre tile.channels()==1
+     * @pre tile.depth() is CV_8U, CV_16U or CV_32F.
+     */
+    void add(cv::Mat const& tile);
+
+    /**
+     * @brief Merge the state of other accumulator.
+     * @param other is the accumulator to merge.
+     */
+    void merge(fsiv_stats_accumulator const& other);
+
+    /** @brief Number of accumulated values. */
+    double count() const;
+
+    /** @brief Mean of the accumulated values. */
+    double mean() const;
+
+    /** @brief (Population) variance of the accumulated values. */
+    double variance() const;
+
+    /** @brief (Population) standard deviation of the accumulated values. */
+    double stddev() const;
+
+    /** @brief The accumulation mode. */
+    Mode mode() const;
+
+private:
+    /** @brief Accumulate n values with mean m and centered sum of squares m2. */
+    void add_moments(double n, double m, double m2);
+
+    Mode mode_;
+    double n_;
+    // WELFORD mode.
+    double mean_;
+    double m2_;
+    // KAHAN mode: sums of (x-center_) and (x-center_)^2 with compensations.
+    double center_;
+    double sum_, sum_c_;
+    double sum2_, sum2_c_;
+    // PAIRWISE mode: partial results, the older ones merge more blocks.
+    struct Partial
+    {
+        double blocks;
+        double n;
+        double mean;
+        double m2;
+    };
+    /** @brief Push a partial, merging the top ones that are not bigger. */
+    void push_partial(Partial p);
+    /** @brief Merge the partials (from the smallest one). */
+    Partial collapse() const;
+    std::vector<Partial> partials_;
+};
+
+/**
+ * @brief Compute a percentile (nearest rank) of some values.
+ * @param values are the values (they are not modified).
+ * @param p is the percentile in [0, 1].
+ * @return the percentile value (0 if there are no values).
+ * @pre 0<=p && p<=1
+ */
+double fsiv_percentile(std::vector<double> values, double p);
+
+/**
+ * @brief Compute the integral and the squared integral images in parallel.
+ *
+ * The image is split in row bands. Each band is integrated (cv::integral)
+ * in parallel, and then the bands are offset by the accumulated bottom rows
+ * of the previous ones, also in parallel.
+ *
+ * @param img is the input image.
+ * @param sum is the integral image (CV_64F, (rows+1)x(cols+1)).
+ * @param sqsum is the squared integral image (CV_64F, (rows+1)x(cols+1)).
+ * @pre !img.empty()
+ */
+void fsiv_integral_parallel(cv::Mat const& img, cv::Mat& sum, cv::Mat& sqsum);
+
+/**
+ * @brief Statistics of a region of interest.
+ */
+struct fsiv_roi_stats
+{
+    cv::Rect roi;       // the region (clipped to the image).
+    cv::Scalar mean;    // per channel mean.
+    cv::Scalar stddev;  // per channel standard deviation.
+    cv::Scalar min_v;   // per channel minimum.
+    cv::Scalar max_v;   // per channel maximum.
+};
+
+/**
+ * @brief Region of interest statistics engine.
+ *
+ * update() builds the integral and squared integral images of a frame once,
+ * so the mean and the standard deviation of any rectangle are computed in
+ * O(1) by query(). It also builds per block min/max maps, so the min/max of
+ * a rectangle only needs to scan the pixels of the partial blocks on the
+ * rectangle border.
+ */
+class fsiv_roi_stats_engine
+{
+public:
+    /**
+     * @brief Create the engine.
+     * @param block is the block size of the min/max maps.
+     * @pre block>0
+     */
+    explicit fsiv_roi_stats_engine(int block = 16);
+
+    /**
+     * @brief Build the integral images of a new frame.
+     * @param frame is the frame (it is not copied).
+     * @pre frame.depth()==CV_8U && frame.channels()<=4
+     */
+    void update(cv::Mat const& frame);
+
+    /**
+     * @brief Compute the statistics of a region.
+     * @param roi is the region. It is clipped to the frame.
+     * @return the statistics (zeros if the clipped region is empty).
+     */
+    fsiv_roi_stats query(cv::Rect roi) const;
+
+private:
+    int block_;
+    cv::Mat frame_;
+    cv::Mat sum_;
+    cv::Mat sqsum_;
+    cv::Mat block_min_;
+    cv::Mat block_max_;
+};
@@ -20,8 +20,12 @@
 #include <opencv2/imgproc/imgproc.hpp>
 //#include <opencv2/calib3d/calib3d.hpp>
 
+#include "common_code.hpp"
+#include "fsiv_parallel.hpp"
+
 const cv::String keys =
     "{help h usage ? |      | print this message.   }"
+    "{b bench        |      | compara también el acumulador de estadísticos (Welford/Kahan/Pairwise).}"
     "{@image         |<none>| input image.          }"            
     ;
 
@@ -191,6 +195,7 @@ main (int argc, char* const* argv)
           return 0;
       }
       cv::String img_name = parser.get<cv::String>("@image");
+      const bool bench = parser.has("b");
 
       if (!parser.check())
       {
@@ -203,7 +208,8 @@ main (int argc, char* const* argv)
       //En funcion de como se compilo opencv podra
       //cargar mas o menos formatos graficos.
       //Lee la documentacion de imread para ver mas detalles.
-      cv::Mat img = cv::imread(img_name, cv::IMREAD_ANYCOLOR);
+      //Con IMREAD_ANYDEPTH las imágenes de 16 bits no se reducen a 8 bits.
+      cv::Mat img = cv::imread(img_name, cv::IMREAD_ANYCOLOR | cv::IMREAD_ANYDEPTH);
       //cv::Mat img = cv::imread(img_name, cv::IMREAD_GRAYSCALE);
       //cv::Mat img = cv::imread(img_name, cv::IMREAD_COLOR);
       
@@ -262,20 +268,24 @@ main (int argc, char* const* argv)
           cv::Mat aux_img;
           cv::TickMeter tick_meter;
 
-          tick_meter.reset();
-          tick_meter.start();
-          compute_stats1(canales[c], media, dev);
-          tick_meter.stop();
-          std::cerr << "Usando método 1: " << " media: " << media
-                    << " desviación: " << dev << " , "
-                    << tick_meter.getTimeMilli() << " ms." << std::endl;
-          tick_meter.reset();
-          tick_meter.start();
-          compute_stats2(canales[c], media, dev);
-          tick_meter.stop();
-          std::cerr << "Usando método 2: " << " media: " << media
-                    << " desviación: " << dev << " , "
-                    << tick_meter.getTimeMilli() << " ms." << std::endl;
+          //Los métodos 1 y 2 sólo admiten imágenes de tipo byte.
+          if (canales[c].depth() == CV_8U)
+          {
+              tick_meter.reset();
+              tick_meter.start();
+              compute_stats1(canales[c], media, dev);
+              tick_meter.stop();
+              std::cerr << "Usando método 1: " << " media: " << media
+                        << " desviación: " << dev << " , "
+                        << tick_meter.getTimeMilli() << " ms." << std::endl;
+              tick_meter.reset();
+              tick_meter.start();
+              compute_stats2(canales[c], media, dev);
+              tick_meter.stop();
+              std::cerr << "Usando método 2: " << " media: " << media
+                        << " desviación: " << dev << " , "
+                        << tick_meter.getTimeMilli() << " ms." << std::endl;
+          }
 
           canales[c].convertTo(aux_img, CV_32F);
 
@@ -294,6 +304,61 @@ main (int argc, char* const* argv)
           std::cerr << "Usando método 4: " << " media: " << media
                     << " desviación: " << dev << " , "
                     << tick_meter.getTimeMilli() << " ms." << std::endl;
+
+          //Reducción paralela por bandas de filas (ver common_code.hpp).
+          tick_meter.reset();
+          tick_meter.start();
+          fsiv_compute_stats_parallel(canales[c], media, dev);
+          tick_meter.stop();
+          std::cerr << "Usando método 5: " << " media: " << media
+                    << " desviación: " << dev << " , "
+                    << tick_meter.getTimeMilli() << " ms." << std::endl;
+
+          if (bench)
+          {
+              //Acumulador incremental (ver common_code.hpp). Se consume la
+              //imagen fila a fila como si no cupiera en memoria.
+              const char* mode_names[] = {"Welford", "Kahan", "Pairwise"};
+              const fsiv_stats_accumulator::Mode modes[] = {
+                  fsiv_stats_accumulator::WELFORD,
+                  fsiv_stats_accumulator::KAHAN,
+                  fsiv_stats_accumulator::PAIRWISE};
+              cv::Mat acc_img = canales[c];
+              if (acc_img.depth() != CV_8U && acc_img.depth() != CV_16U)
+                  acc_img = aux_img;
+
+              for (int m = 0; m < 3; ++m)
+              {
+                  fsiv_stats_accumulator acc(modes[m]);
+                  tick_meter.reset();
+                  tick_meter.start();
+                  for (int row = 0; row < acc_img.rows; ++row)
+                      acc.add(acc_img.row(row));
+                  tick_meter.stop();
+                  std::cerr << "Usando acumulador " << mode_names[m] << ": "
+                            << " media: " << acc.mean()
+                            << " desviación: " << acc.stddev() << " , "
+                            << tick_meter.getTimeMilli() << " ms." << std::endl;
+
+                  tick_meter.reset();
+                  tick_meter.start();
+                  acc = fsiv_parallel_row_reduce(acc_img,
+                      fsiv_stats_accumulator(modes[m]),
+                      [](cv::Mat const& tile, int, fsiv_stats_accumulator& p)
+                      {
+                          p.add(tile);
+                      },
+                      [](fsiv_stats_accumulator& a, fsiv_stats_accumulator const& p)
+                      {
+                          a.merge(p);
+                      });
+                  tick_meter.stop();
+                  std::cerr << "Usando acumulador " << mode_names[m]
+                            << " paralelo: " << " media: " << acc.mean()
+                            << " desviación: " << acc.stddev() << " , "
+                            << tick_meter.getTimeMilli() << " ms." << std::endl;
+              }
+          }
       }
   }
   catch (std::exception& e)
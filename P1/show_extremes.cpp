@@ -1,5 +1,14 @@
 #include <iostream>
 #include <exception>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 //OpenCV includes
 #include <opencv2/core.hpp>
@@ -10,12 +19,21 @@
 
 
 #include "common_code.hpp"
+#include "fsiv_memory.hpp"
+#include "fsiv_parallel.hpp"
 
 const char * keys =
     "{help h usage ? |      | print this message}"
     "{w              |20    | Wait time (miliseconds) between frames.}"
     "{v              |      | the input is a video file.}"
     "{c              |      | the input is a camera index.}"    
+    "{p pipeline     |      | run capture, process and display on separate threads.}"
+    "{q queue        |4     | capacity of the ring buffers between pipeline stages.}"
+    "{d drop         |      | pipeline drops the oldest frame when a buffer is full (default: block).}"
+    "{b batch        |      | headless mode: process the whole input as fast as possible without windows. Without -v/-c the input is a glob of images.}"
+    "{j jobs         |0     | batch mode worker threads. Value 0 means the number of cores.}"
+    "{o output       |      | batch mode output file. Default stdout.}"
+    "{f format       |csv   | batch mode output format: csv or json (JSON lines).}"
     "{@input         |<none>| input <fname|int>}"
     ;
 
@@ -39,6 +57,263 @@ void process_frame(cv::Mat &frame) {
     }
 }
 
+/**
+ * @brief A frame (or an image file to be decoded) to be processed in batch mode.
+ */
+struct BatchTask
+{
+    long index = -1;
+    std::string source;
+    cv::Mat frame;
+};
+
+/**
+ * @brief The extremes found in a frame in batch mode.
+ */
+struct BatchResult
+{
+    long index = -1;
+    std::string source;
+    bool ok = false;
+    std::vector<double> min_v, max_v;
+    std::vector<cv::Point> min_loc, max_loc;
+    double latency_ms = 0.0;
+};
+
+void find_extremes(BatchTask &task, BatchResult &result)
+{
+    const int64 t0 = cv::getTickCount();
+    result.index = task.index;
+    result.source = task.source;
+    if (task.frame.empty())
+        task.frame = cv::imread(task.source, cv::IMREAD_UNCHANGED);
+    result.ok = !task.frame.empty();
+    if (result.ok && task.frame.depth() == CV_8U && task.frame.channels() <= 4) {
+        // One thread per frame: use the single pass SIMD kernel.
+        std::vector<cv::uint8_t> min_v, max_v;
+        fsiv_find_min_max_loc_1(task.frame, min_v, max_v,
+                                result.min_loc, result.max_loc);
+        result.min_v.assign(min_v.begin(), min_v.end());
+        result.max_v.assign(max_v.begin(), max_v.end());
+    } else if (result.ok) {
+        fsiv_find_min_max_loc_2(task.frame, result.min_v, result.max_v,
+                                result.min_loc, result.max_loc);
+    }
+    task.frame.release();
+    result.latency_ms = 1000.0 * (cv::getTickCount() - t0) / cv::getTickFrequency();
+}
+
+/**
+ * @brief Escape a string to be written as a JSON string value.
+ * The quotes, backslashes and control characters are escaped.
+ */
+std::string json_escape(std::string const &s) {
+    std::string ret;
+    ret.reserve(s.size());
+    for (size_t i = 0; i < s.size(); ++i) {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        switch (c) {
+        case '"': ret += "\\\""; break;
+        case '\\': ret += "\\\\"; break;
+        case '\b': ret += "\\b"; break;
+        case '\f': ret += "\\f"; break;
+        case '\n': ret += "\\n"; break;
+        case '\r': ret += "\\r"; break;
+        case '\t': ret += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                ret += buf;
+            } else
+                ret += static_cast<char>(c);
+        }
+    }
+    return ret;
+}
+
+/**
+ * @brief Quote a string to be written as a CSV field.
+ * The field is enclosed in quotes and its quotes are doubled, so commas,
+ * quotes and line breaks in it do not break the record.
+ */
+std::string csv_quote(std::string const &s) {
+    std::string ret = "\"";
+    ret.reserve(s.size() + 2);
+    for (size_t i = 0; i < s.size(); ++i) {
+        if (s[i] == '"')
+            ret += '"';
+        ret += s[i];
+    }
+    ret += '"';
+    return ret;
+}
+
+void write_result(std::ostream &out, BatchResult const &r, bool json) {
+    if (json) {
+        out << "{\"index\":" << r.index << ",\"source\":\"" << json_escape(r.source)
+            << "\",\"ok\":" << (r.ok ? "true" : "false") << ",\"min\":[";
+        for (size_t c = 0; c < r.min_v.size(); ++c)
+            out << (c ? "," : "") << r.min_v[c];
+        out << "],\"max\":[";
+        for (size_t c = 0; c < r.max_v.size(); ++c)
+            out << (c ? "," : "") << r.max_v[c];
+        out << "],\"min_loc\":[";
+        for (size_t c = 0; c < r.min_loc.size(); ++c)
+            out << (c ? "," : "") << '[' << r.min_loc[c].x << ',' << r.min_loc[c].y << ']';
+        out << "],\"max_loc\":[";
+        for (size_t c = 0; c < r.max_loc.size(); ++c)
+            out << (c ? "," : "") << '[' << r.max_loc[c].x << ',' << r.max_loc[c].y << ']';
+        out << "]}\n";
+    } else {
+        const std::string source = csv_quote(r.source);
+        if (!r.ok)
+            out << r.index << ',' << source << ",-1,,,,,,\n";
+        for (size_t c = 0; c < r.min_v.size(); ++c)
+            out << r.index << ',' << source << ',' << c << ','
+                << r.min_v[c] << ',' << r.max_v[c] << ','
+                << r.min_loc[c].x << ',' << r.min_loc[c].y << ','
+                << r.max_loc[c].x << ',' << r.max_loc[c].y << '\n';
+    }
+}
+
+/**
+ * @brief Headless batch mode.
+ *
+ * A reader thread feeds a bounded ring buffer with frames (or file names, so
+ * image decoding is done by the workers), N workers find the extremes and the
+ * caller thread writes the results in input order. A frame that can not be
+ * processed is reported with ok=false. If the output can not be written the
+ * reader and the workers are cancelled.
+ */
+int run_batch(cv::VideoCapture &cap, std::vector<cv::String> const &files,
+              int jobs, std::ostream &out, bool json) {
+    if (jobs <= 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    // Each worker runs on its own frame, do not nest OpenCV threads.
+    const int old_threads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    fsiv_ring_buffer<BatchTask> tasks(2 * jobs);
+    fsiv_ring_buffer<BatchResult> results(2 * jobs);
+    std::atomic<bool> stop(false), reader_done(false), workers_done(false);
+    std::atomic<int> active_workers(jobs);
+    std::mutex log_mutex;
+
+    const int64 t_start = cv::getTickCount();
+    std::thread reader([&]() {
+        long index = 0;
+        if (files.empty()) {
+            BatchTask task;
+            while (cap.read(task.frame) && !task.frame.empty()) {
+                task.index = index++;
+                task.source = "frame";
+                if (!tasks.push(task, false, stop))
+                    break;
+                task.frame = cv::Mat();
+            }
+        } else {
+            for (size_t i = 0; i < files.size(); ++i) {
+                BatchTask task;
+                task.index = index++;
+                task.source = files[i];
+                if (!tasks.push(task, false, stop))
+                    break;
+            }
+        }
+        reader_done.store(true);
+    });
+
+    std::vector<std::thread> workers;
+    for (int w = 0; w < jobs; ++w)
+        workers.push_back(std::thread([&]() {
+            BatchTask task;
+            while (tasks.pop(task, reader_done)) {
+                BatchResult result;
+                // A frame that makes OpenCV throw fails alone, the batch goes on.
+                try {
+                    find_extremes(task, result);
+                } catch (std::exception &e) {
+                    result = BatchResult();
+                    result.index = task.index;
+                    result.source = task.source;
+                    task.frame.release();
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "Error: could not process '" << task.source
+                              << "' (index " << task.index << "): " << e.what() << std::endl;
+                }
+                if (!results.push(result, false, stop))
+                    break;
+            }
+            if (--active_workers == 0)
+                workers_done.store(true);
+        }));
+
+    if (!json)
+        out << "index,source,channel,min,max,min_x,min_y,max_x,max_y\n";
+
+    // Reorder the results to write them in input order.
+    std::map<long, BatchResult> pending;
+    std::vector<double> latencies;
+    long next = 0, failed = 0;
+    BatchResult result;
+    while (out && results.pop(result, workers_done)) {
+        latencies.push_back(result.latency_ms);
+        if (!result.ok)
+            ++failed;
+        pending[result.index] = result;
+        for (auto it = pending.find(next); out && it != pending.end();
+             it = pending.find(next)) {
+            write_result(out, it->second, json);
+            pending.erase(it);
+            ++next;
+        }
+    }
+    for (auto it = pending.begin(); out && it != pending.end(); ++it)
+        write_result(out, it->second, json);
+    out.flush();
+    if (!out) {
+        // Cancel the reader and the workers blocked on a full buffer.
+        stop.store(true);
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::cerr << "Error: could not write the results." << std::endl;
+    }
+
+    reader.join();
+    for (size_t w = 0; w < workers.size(); ++w)
+        workers[w].join();
+    cv::setNumThreads(old_threads);
+
+    const double wall_s = (cv::getTickCount() - t_start) / cv::getTickFrequency();
+    std::cerr << "Frames         : " << latencies.size() << std::endl;
+    std::cerr << "Failed         : " << failed << std::endl;
+    std::cerr << "Workers        : " << jobs << std::endl;
+    std::cerr << "Throughput     : " << (wall_s > 0.0 ? latencies.size() / wall_s : 0.0)
+              << " frames/s" << std::endl;
+    std::cerr << "Latency p50    : " << fsiv_percentile(latencies, 0.5) << " ms" << std::endl;
+    std::cerr << "Latency p99    : " << fsiv_percentile(latencies, 0.99) << " ms" << std::endl;
+    std::cerr << "Latency histogram (ms):" << std::endl;
+    double lower = 0.0;
+    for (double upper = 1.0; lower < 1.0e9; upper *= 2.0) {
+        const bool last = upper > 1000.0;
+        const size_t n = std::count_if(latencies.begin(), latencies.end(),
+            [lower, upper, last](double l) { return l >= lower && (last || l < upper); });
+        if (n > 0) {
+            std::cerr << "  [" << lower << ", ";
+            if (last)
+                std::cerr << "inf";
+            else
+                std::cerr << upper;
+            std::cerr << "): " << n << std::endl;
+        }
+        if (last)
+            break;
+        lower = upper;
+    }
+    std::cerr << "Peak RSS       : " << fsiv_peak_rss_mb() << " MiB" << std::endl;
+    return out ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int
 main (int argc, char* const* argv)
 {
@@ -56,6 +331,14 @@ main (int argc, char* const* argv)
       bool is_video = parser.has("v");
       bool is_camera = parser.has("c");
       int wait = parser.get<int>("w");
+      bool use_pipeline = parser.has("p");
+      int queue_size = parser.get<int>("q");
+      fsiv_pipeline_options pipeline_opts;
+      pipeline_opts.drop_oldest = parser.has("d");
+      bool batch = parser.has("b");
+      int jobs = parser.get<int>("j");
+      cv::String output = parser.get<cv::String>("o");
+      cv::String format = parser.get<cv::String>("f");
       cv::String input = parser.get<cv::String>("@input");
       if (!parser.check())
       {
@@ -63,8 +346,26 @@ main (int argc, char* const* argv)
           return 0;
       }
 
+      if (queue_size <= 0) {
+          std::cerr << "Error: the queue size must be > 0." << std::endl;
+          return EXIT_FAILURE;
+      }
+      pipeline_opts.queue_size = queue_size;
+
+      if (format != "csv" && format != "json") {
+          std::cerr << "Error: unknown output format '" << format << "'." << std::endl;
+          return EXIT_FAILURE;
+      }
+
       cv::VideoCapture cap;
-      if (is_camera) {
+      std::vector<cv::String> files;
+      if (batch && !is_camera && !is_video) {
+          cv::glob(input, files);
+          if (files.empty()) {
+              std::cerr << "Error: no image matches '" << input << "'." << std::endl;
+              return EXIT_FAILURE;
+          }
+      } else if (is_camera) {
           int camera_index = std::stoi(input);
           if (!cap.open(camera_index)) {
               std::cerr << "Error: Could not open the camera." << std::endl;
@@ -77,8 +378,33 @@ main (int argc, char* const* argv)
           }
       }
   
+      if (batch) {
+          std::ofstream out_file;
+          if (output != "") {
+              out_file.open(output);
+              if (!out_file) {
+                  std::cerr << "Error: could not open the output file." << std::endl;
+                  return EXIT_FAILURE;
+              }
+          }
+          return run_batch(cap, files, jobs,
+                           output != "" ? out_file : std::cout,
+                           format == "json");
+      }
+
       cv::Mat frame;
-      if (is_camera || is_video) {
+      if ((is_camera || is_video) && use_pipeline) {
+          fsiv_pipeline_stats stats = fsiv_run_pipeline(
+              [&cap](cv::Mat& f) { return cap.read(f); },
+              process_frame,
+              [wait](cv::Mat& f) {
+                  cv::imshow("Extremes", f);
+                  char key = cv::waitKey(wait);
+                  return !(key == 'q' || key == 27);
+              },
+              pipeline_opts);
+          fsiv_print_pipeline_stats(std::cout, stats);
+      } else if (is_camera || is_video) {
           while (cap.read(frame)) {
               if (frame.empty()) {
                   std::cerr << "Error: Empty frame received." << std::endl;
@@ -89,7 +415,7 @@ main (int argc, char* const* argv)
   
               cv::imshow("Extremes", frame);
   
-              char key = cv::waitKey(30);
+              char key = cv::waitKey(wait);
               if (key == 'q' || key == 27)
                   break;
           }
@@ -10,6 +10,11 @@
 
 #include <iostream>
 #include <exception>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <vector>
 
 //Includes para OpenCV, Descomentar según los módulo utilizados.
 #include <opencv2/core/core.hpp>
@@ -18,15 +23,40 @@
 #include <opencv2/imgproc/imgproc.hpp>
 //#include <opencv2/calib3d/calib3d.hpp>
 
+#include "common_code.hpp"
+#include "fsiv_parallel.hpp"
+
 const cv::String keys =
     "{help h usage ? |      | print this message.   }"
     "{w wait         |67    | number of msecs to wait between frames.}"
     "{camera c       |-1    | open camera index.}"
     "{video v        |      | open video source.}"
+    "{p pipeline     |      | captura, procesa y visualiza en hilos distintos.}"
+    "{q queue        |4     | capacidad de los buffers entre etapas del pipeline.}"
+    "{d drop         |      | el pipeline descarta el frame más antiguo si un buffer está lleno (por defecto espera).}"
     ;
 
+/**
+ * @brief Estado compartido entre el callback del ratón y el proceso de frames.
+ */
+struct ProbeState
+{
+    //Atómicos: en modo pipeline las coordenadas se leen desde otro hilo.
+    std::atomic<int> coords[2];
+    //Regiones de interés seleccionadas arrastrando el ratón.
+    std::mutex mutex;
+    std::vector<cv::Rect> rois;
+    cv::Point drag_start;
+    cv::Rect drag;
+    bool dragging = false;
+};
+
 /**
  * @brief Función callback para gestión del ratón.
+ *
+ * Un click selecciona el pixel a muestrear. Arrastrar con el botón
+ * izquierdo añade una región de interés y el botón derecho las borra.
+ *
  * @param event Qué ocurrió.
  * @param x coordenada x del cursor del ratón.
  * @param y coordenada y del cursor del ratón.
@@ -35,11 +65,86 @@ const cv::String keys =
  */
 void on_mouse(int event, int x, int y, int flags, void *userdata)
 {
+    ProbeState* state = static_cast<ProbeState*>(userdata);
+    std::lock_guard<std::mutex> lock(state->mutex);
     if (event == cv::EVENT_LBUTTONDOWN)
     {
-        static_cast<int*>(userdata)[0] = x;
-        static_cast<int*>(userdata)[1] = y;
+        state->drag_start = cv::Point(x, y);
+        state->drag = cv::Rect();
+        state->dragging = true;
+    }
+    else if (event == cv::EVENT_MOUSEMOVE && state->dragging
+             && (flags & cv::EVENT_FLAG_LBUTTON))
+        state->drag = cv::Rect(state->drag_start, cv::Point(x, y));
+    else if (event == cv::EVENT_LBUTTONUP && state->dragging)
+    {
+        state->dragging = false;
+        const cv::Rect r(state->drag_start, cv::Point(x, y));
+        if (r.width > 1 && r.height > 1)
+            state->rois.push_back(r);
+        else
+        {
+            state->coords[0] = x;
+            state->coords[1] = y;
+        }
+        state->drag = cv::Rect();
+    }
+    else if (event == cv::EVENT_RBUTTONDOWN)
+        state->rois.clear();
+}
+
+/**
+ * @brief Muestrea un frame: valores RGB del pixel y estadísticos de las ROIs.
+ *
+ * Las ROIs (y la que se está arrastrando) se dibujan sobre el frame.
+ * Los estadísticos se consultan en O(1) sobre las imágenes integrales.
+ *
+ * @param frame es el frame a muestrear.
+ * @param state es el estado del ratón.
+ * @param engine es el motor de estadísticos por ROI.
+ */
+void probe_frame(cv::Mat& frame, ProbeState& state,
+                 fsiv_roi_stats_engine& engine)
+{
+    std::ostringstream msg;
+    const int x = std::min(std::max(int(state.coords[0]), 0), frame.cols-1);
+    const int y = std::min(std::max(int(state.coords[1]), 0), frame.rows-1);
+    const cv::Vec3b v = frame.at<cv::Vec3b>(y, x);
+    msg << "RGB point (" << x << ',' << y << "): "
+        << static_cast<int>(v[0]) << ", "
+        << static_cast<int>(v[1]) << ", "
+        << static_cast<int>(v[2]) << '\n';
+
+    std::vector<cv::Rect> rois;
+    cv::Rect drag;
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        rois = state.rois;
+        drag = state.drag;
+    }
+    if (!rois.empty())
+    {
+        engine.update(frame);
+        for (size_t i = 0; i < rois.size(); ++i)
+        {
+            const fsiv_roi_stats s = engine.query(rois[i]);
+            if (s.roi.area() <= 0)
+                continue;
+            msg << "ROI " << i << " " << s.roi << ": mean ("
+                << s.mean[0] << ", " << s.mean[1] << ", " << s.mean[2]
+                << ") dev (" << s.stddev[0] << ", " << s.stddev[1] << ", "
+                << s.stddev[2] << ") min (" << s.min_v[0] << ", "
+                << s.min_v[1] << ", " << s.min_v[2] << ") max ("
+                << s.max_v[0] << ", " << s.max_v[1] << ", " << s.max_v[2]
+                << ")\n";
+        }
+        //Se dibuja después de calcular para no alterar los estadísticos.
+        for (size_t i = 0; i < rois.size(); ++i)
+            cv::rectangle(frame, rois[i], cv::Scalar(0, 255, 0));
     }
+    if (drag.area() > 0)
+        cv::rectangle(frame, drag, cv::Scalar(0, 255, 255));
+    std::cout << msg.str();
 }
 
 int
@@ -51,7 +156,8 @@ main (int argc, char* const* argv)
 
       cv::CommandLineParser parser(argc, argv, keys);
       parser.about("Muestra un video. Pulsa con el raton en un punto para ver "
-                   "los valores RGB. v1.0.0");
+                   "los valores RGB. Arrastra para añadir regiones de interés "
+                   "(boton derecho para borrarlas). v1.1.0");
       if (parser.has("help"))
       {
           parser.printMessage();
@@ -60,6 +166,10 @@ main (int argc, char* const* argv)
       int wait = parser.get<int>("w");      
       int camera_idx = parser.get<int>("camera");
       std::string video_name = parser.get<std::string>("video");
+      bool use_pipeline = parser.has("pipeline");
+      int queue_size = parser.get<int>("queue");
+      fsiv_pipeline_options pipeline_opts;
+      pipeline_opts.drop_oldest = parser.has("drop");
 
       if (!parser.check())
       {
@@ -67,6 +177,13 @@ main (int argc, char* const* argv)
           return 0;
       }
 
+      if (queue_size <= 0)
+      {
+          std::cerr << "Error: la capacidad de los buffers debe ser > 0." << std::endl;
+          return EXIT_FAILURE;
+      }
+      pipeline_opts.queue_size = queue_size;
+
       cv::VideoCapture vid;
       if (parser.has("video"))
           vid.open(video_name);
@@ -105,29 +222,59 @@ main (int argc, char* const* argv)
 
       //Coordenadas del pixel a muestrear.
       //Inicialmente muestrearemos el pixel central.
-      int coords[2] = {frame.cols/2, frame.rows/2};
+      ProbeState state;
+      state.coords[0] = frame.cols/2;
+      state.coords[1] = frame.rows/2;
+      fsiv_roi_stats_engine engine;
 
 
       //Creamos la ventana para mostrar el video y
       //le conectamos una función "callback" para gestionar el raton.
       cv::namedWindow("VIDEO");
-      cv::setMouseCallback ("VIDEO", on_mouse, coords);
+      cv::setMouseCallback ("VIDEO", on_mouse, &state);
       std::cerr << "Pulsa una tecla para continuar (ESC para salir)." << std::endl;
       int key = cv::waitKey(0) & 0xff;
       
+      if (use_pipeline && key != 27)
+      {
+         //El muestreo del pixel se hace en la etapa de proceso y la
+         //visualización en el hilo principal (lo exige HighGUI).
+         bool first = true;
+         fsiv_pipeline_stats stats = fsiv_run_pipeline(
+            [&](cv::Mat& f)
+            {
+               if (first)
+               {
+                  first = false;
+                  f = frame;
+                  return true;
+               }
+               return vid.read(f);
+            },
+            [&state, &engine](cv::Mat& f)
+            {
+               probe_frame(f, state, engine);
+            },
+            [wait](cv::Mat& f)
+            {
+               cv::imshow("VIDEO", f);
+               return (cv::waitKey(wait) & 0xff) != 27;
+            },
+            pipeline_opts);
+         fsiv_print_pipeline_stats(std::cout, stats);
+         key = 27;
+      }
+
       //Muestro frames hasta fin del video (frame vacio),
       //o que el usario pulse la tecla ESCAPE (codigo ascci 27)
       while (!frame.empty() && key!=27)
       {
+         //mostramos los valores RGB del pixel muestreado y los
+         //estadísticos de las regiones de interés.
+         probe_frame(frame, state, engine);
+
          //muestro el frame.
          cv::imshow("VIDEO", frame);
-         
-         //mostramos los valores RGB del pixel muestreado.
-         const cv::Vec3b v = frame.at<cv::Vec3b>(coords[1], coords[0]);
-         std::cout << "RGB point (" << coords[0] << ',' << coords[1] << "): "
-                   << static_cast<int>(v[0]) << ", "
-                   << static_cast<int>(v[1]) << ", "
-                   << static_cast<int>(v[2]) << std::endl;
 
          //Espero un tiempo fijado. Si el usuario pulsa una tecla obtengo
          //el codigo ascci. Si pasa el tiempo, retorna -1.
@@ -0,0 +1,439 @@
+/**
+ * @file test_stats.cpp
+ * @brief Check the fast min/max and statistics kernels against OpenCV.
+ *
+ * The min/max kernels are compared with cv::minMaxLoc per channel, on
+ * images with several occurrences of the extreme values, so the location
+ * must be the first one in rows/cols scanning order. The parallel row tiles
+ * reductions are checked with images of several tiles. The streaming
+ * accumulator is checked in all its modes, adding whole images, row by row
+ * and merging partial accumulators. The region of interest engine is
+ * compared with cv::meanStdDev and cv::minMaxLoc over the region.
+ */
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "common_code.hpp"
+
+static int n_tests = 0;
+static int n_failed = 0;
+
+/**
+ * @brief Report a check.
+ */
+static void
+check(std::string const &name, bool ok, std::string const &detail = "")
+{
+    ++n_tests;
+    if (!ok)
+    {
+        ++n_failed;
+        std::cerr << "Test " << name << ": FAILED";
+        if (!detail.empty())
+            std::cerr << " (" << detail << ")";
+        std::cerr << std::endl;
+    }
+}
+
+/**
+ * @brief A random byte image whose extreme values appear several times.
+ *
+ * Each channel has its min/max values in three places, so there are ties
+ * in the same row, in the same SIMD block and in later rows.
+ */
+static cv::Mat
+test_image(cv::Size const &size, int cn)
+{
+    cv::Mat img(size, CV_8UC(cn));
+    cv::randu(img, cv::Scalar::all(10), cv::Scalar::all(246));
+    const cv::Point places[] = {
+        cv::Point(size.width - 1, size.height / 2),
+        cv::Point(size.width / 3, size.height - 1),
+        cv::Point(size.width - 1, size.height - 1)};
+    for (int c = 0; c < cn; ++c)
+        for (int i = 0; i < 3; ++i)
+        {
+            // Shift the places of each channel, so they are different.
+            const cv::Point min_p((places[i].x + c) % size.width, places[i].y);
+            const cv::Point max_p(places[i].x, (places[i].y + c + 1) % size.height);
+            img.ptr<uchar>(min_p.y)[min_p.x * cn + c] = 3;
+            img.ptr<uchar>(max_p.y)[max_p.x * cn + c] = 250;
+        }
+    return img;
+}
+
+/**
+ * @brief cv::minMaxLoc of each channel.
+ */
+static void
+reference_min_max_loc(cv::Mat const &img, std::vector<double> &min_v,
+                      std::vector<double> &max_v, std::vector<cv::Point> &min_loc,
+                      std::vector<cv::Point> &max_loc)
+{
+    const int cn = img.channels();
+    min_v.resize(cn);
+    max_v.resize(cn);
+    min_loc.resize(cn);
+    max_loc.resize(cn);
+    cv::Mat channel;
+    for (int c = 0; c < cn; ++c)
+    {
+        cv::extractChannel(img, channel, c);
+        cv::minMaxLoc(channel, &min_v[c], &max_v[c], &min_loc[c], &max_loc[c]);
+    }
+}
+
+/**
+ * @brief Compare a min/max result with cv::minMaxLoc.
+ */
+template <class T>
+static void
+check_min_max_loc(std::string const &name, cv::Mat const &img,
+                  std::vector<T> const &min_v, std::vector<T> const &max_v,
+                  std::vector<cv::Point> const &min_loc,
+                  std::vector<cv::Point> const &max_loc)
+{
+    std::vector<double> e_min_v, e_max_v;
+    std::vector<cv::Point> e_min_loc, e_max_loc;
+    reference_min_max_loc(img, e_min_v, e_max_v, e_min_loc, e_max_loc);
+    const size_t cn = img.channels();
+    if (min_v.size() != cn || max_v.size() != cn || min_loc.size() != cn ||
+        max_loc.size() != cn)
+    {
+        check(name, false, "wrong number of channels");
+        return;
+    }
+    for (size_t c = 0; c < cn; ++c)
+    {
+        const std::string cname = name + cv::format(" channel %d", int(c));
+        check(cname + " min", double(min_v[c]) == e_min_v[c] &&
+                                  min_loc[c] == e_min_loc[c],
+              cv::format("%g at (%d,%d) != %g at (%d,%d)", double(min_v[c]),
+                         min_loc[c].x, min_loc[c].y, e_min_v[c],
+                         e_min_loc[c].x, e_min_loc[c].y));
+        check(cname + " max", double(max_v[c]) == e_max_v[c] &&
+                                  max_loc[c] == e_max_loc[c],
+              cv::format("%g at (%d,%d) != %g at (%d,%d)", double(max_v[c]),
+                         max_loc[c].x, max_loc[c].y, e_max_v[c],
+                         e_max_loc[c].x, e_max_loc[c].y));
+    }
+}
+
+/**
+ * @brief fsiv_find_min_max_loc_1 (SIMD single pass) against cv::minMaxLoc.
+ */
+static void
+test_min_max_loc_1(cv::Mat const &img, std::string const &config)
+{
+    std::vector<cv::uint8_t> min_v, max_v;
+    std::vector<cv::Point> min_loc, max_loc;
+    fsiv_find_min_max_loc_1(img, min_v, max_v, min_loc, max_loc);
+    check_min_max_loc("fsiv_find_min_max_loc_1 " + config, img, min_v, max_v,
+                      min_loc, max_loc);
+}
+
+/**
+ * @brief fsiv_find_min_max_loc_2 (parallel row tiles) against cv::minMaxLoc.
+ */
+static void
+test_min_max_loc_2(cv::Mat const &img, std::string const &config)
+{
+    std::vector<double> min_v, max_v;
+    std::vector<cv::Point> min_loc, max_loc;
+    fsiv_find_min_max_loc_2(img, min_v, max_v, min_loc, max_loc);
+    check_min_max_loc("fsiv_find_min_max_loc_2 " + config, img, min_v, max_v,
+                      min_loc, max_loc);
+}
+
+/**
+ * @brief The parallel moments, stats and histogram against OpenCV.
+ */
+static void
+test_parallel_reductions(cv::Mat const &img, std::string const &config)
+{
+    const fsiv_moments_partial m = fsiv_compute_moments_parallel(img);
+    const cv::Scalar e_sum = cv::sum(img);
+    check("fsiv_compute_moments_parallel " + config + " count",
+          m.count == double(img.total()));
+    cv::Mat channel;
+    for (int c = 0; c < img.channels(); ++c)
+    {
+        cv::extractChannel(img, channel, c);
+        const double e_sum2 = cv::norm(channel, cv::NORM_L2SQR);
+        const std::string cname = config + cv::format(" channel %d", c);
+        check("fsiv_compute_moments_parallel " + cname + " sum",
+              std::abs(m.sum[c] - e_sum[c]) <= 1.0e-9 * std::abs(e_sum[c]),
+              cv::format("%.17g != %.17g", m.sum[c], e_sum[c]));
+        check("fsiv_compute_moments_parallel " + cname + " sum2",
+              std::abs(m.sum2[c] - e_sum2) <= 1.0e-9 * e_sum2,
+              cv::format("%.17g != %.17g", m.sum2[c], e_sum2));
+    }
+    if (img.channels() != 1)
+        return;
+
+    float media, dev;
+    fsiv_compute_stats_parallel(img, media, dev);
+    cv::Scalar e_mean, e_dev;
+    cv::meanStdDev(img, e_mean, e_dev);
+    check("fsiv_compute_stats_parallel " + config + " mean",
+          std::abs(media - e_mean[0]) <= 1.0e-4 * std::max(1.0, std::abs(e_mean[0])),
+          cv::format("%g != %g", media, e_mean[0]));
+    check("fsiv_compute_stats_parallel " + config + " dev",
+          std::abs(dev - e_dev[0]) <= 1.0e-4 * std::max(1.0, e_dev[0]),
+          cv::format("%g != %g", dev, e_dev[0]));
+
+    if (img.type() != CV_8UC1)
+        return;
+    cv::Mat e_hist = cv::Mat::zeros(256, 1, CV_32FC1);
+    for (int y = 0; y < img.rows; ++y)
+        for (int x = 0; x < img.cols; ++x)
+            e_hist.at<float>(img.at<uchar>(y, x)) += 1.0f;
+    const cv::Mat hist = fsiv_compute_histogram_parallel(img);
+    check("fsiv_compute_histogram_parallel " + config,
+          hist.type() == CV_32FC1 && hist.size() == e_hist.size() &&
+              cv::norm(hist, e_hist, cv::NORM_INF) == 0.0);
+}
+
+/**
+ * @brief Mean and standard deviation in two passes (in double).
+ */
+static void
+two_pass_mean_dev(cv::Mat const &img, double &mean, double &dev)
+{
+    cv::Mat values;
+    img.convertTo(values, CV_64F);
+    mean = cv::sum(values)[0] / values.total();
+    cv::Mat d = values - mean;
+    dev = std::sqrt(d.dot(d) / values.total());
+}
+
+/**
+ * @brief Compare an accumulator with the expected mean and deviation.
+ */
+static void
+check_accumulator(std::string const &name, fsiv_stats_accumulator const &acc,
+                  double count, double mean, double dev, double tolerance)
+{
+    check(name + " count", acc.count() == count,
+          cv::format("%g != %g", acc.count(), count));
+    check(name + " mean",
+          std::abs(acc.mean() - mean) <= tolerance * std::max(1.0, std::abs(mean)),
+          cv::format("%.17g != %.17g", acc.mean(), mean));
+    check(name + " dev",
+          std::abs(acc.stddev() - dev) <= tolerance * std::max(1.0, dev),
+          cv::format("%.17g != %.17g", acc.stddev(), dev));
+}
+
+/**
+ * @brief fsiv_stats_accumulator in all its modes against the expected stats.
+ */
+static void
+test_accumulator(cv::Mat const &img, std::string const &config, double mean,
+                 double dev, double tolerance)
+{
+    const fsiv_stats_accumulator::Mode modes[] = {
+        fsiv_stats_accumulator::WELFORD, fsiv_stats_accumulator::KAHAN,
+        fsiv_stats_accumulator::PAIRWISE};
+    const char *mode_names[] = {"welford", "kahan", "pairwise"};
+    const double count = double(img.total());
+    for (int m = 0; m < 3; ++m)
+    {
+        const std::string name = std::string("fsiv_stats_accumulator ") +
+                                 mode_names[m] + " " + config;
+        fsiv_stats_accumulator whole(modes[m]);
+        whole.add(img);
+        check_accumulator(name, whole, count, mean, dev, tolerance);
+
+        fsiv_stats_accumulator rows(modes[m]);
+        for (int y = 0; y < img.rows; ++y)
+            rows.add(img.row(y));
+        check_accumulator(name + " by rows", rows, count, mean, dev, tolerance);
+
+        fsiv_stats_accumulator top(modes[m]), bottom(modes[m]);
+        top.add(img.rowRange(0, img.rows / 2));
+        bottom.add(img.rowRange(img.rows / 2, img.rows));
+        top.merge(bottom);
+        check_accumulator(name + " merged", top, count, mean, dev, tolerance);
+
+        whole.reset();
+        check_accumulator(name + " reset", whole, 0.0, 0.0, 0.0, 0.0);
+    }
+}
+
+/**
+ * @brief fsiv_integral_parallel against cv::integral.
+ */
+static void
+test_integral(cv::Mat const &img, std::string const &config)
+{
+    cv::Mat sum, sqsum, e_sum, e_sqsum;
+    fsiv_integral_parallel(img, sum, sqsum);
+    cv::integral(img, e_sum, e_sqsum, CV_64F, CV_64F);
+    check("fsiv_integral_parallel " + config + " sum",
+          sum.type() == e_sum.type() && sum.size() == e_sum.size() &&
+              cv::norm(sum, e_sum, cv::NORM_INF) == 0.0);
+    check("fsiv_integral_parallel " + config + " sqsum",
+          sqsum.type() == e_sqsum.type() && sqsum.size() == e_sqsum.size() &&
+              cv::norm(sqsum, e_sqsum, cv::NORM_INF) == 0.0);
+}
+
+/**
+ * @brief fsiv_roi_stats_engine queries against the stats of the region.
+ */
+static void
+test_roi_stats(cv::Mat const &img, int block, std::string const &config)
+{
+    fsiv_roi_stats_engine engine(block);
+    engine.update(img);
+    const cv::Rect frame(0, 0, img.cols, img.rows);
+    std::vector<cv::Rect> rois;
+    rois.push_back(frame);
+    rois.push_back(cv::Rect(0, 0, 1, 1));
+    rois.push_back(cv::Rect(img.cols - 1, img.rows - 1, 1, 1));
+    // Clipped by the image and empty regions.
+    rois.push_back(cv::Rect(-5, -5, img.cols / 2 + 5, img.rows / 2 + 5));
+    rois.push_back(cv::Rect(img.cols / 2, img.rows / 2, img.cols, img.rows));
+    rois.push_back(cv::Rect(img.cols, 0, 4, 4));
+    rois.push_back(cv::Rect(0, 0, 0, 3));
+    cv::RNG &rng = cv::theRNG();
+    for (int i = 0; i < 20; ++i)
+    {
+        const int x = rng.uniform(0, img.cols);
+        const int y = rng.uniform(0, img.rows);
+        rois.push_back(cv::Rect(x, y, rng.uniform(1, img.cols - x + 1),
+                                rng.uniform(1, img.rows - y + 1)));
+    }
+
+    for (cv::Rect const &roi : rois)
+    {
+        const std::string name = cv::format("fsiv_roi_stats_engine %s block=%d roi=(%d,%d %dx%d)",
+                                            config.c_str(), block, roi.x, roi.y,
+                                            roi.width, roi.height);
+        const fsiv_roi_stats stats = engine.query(roi);
+        const cv::Rect clipped = roi & frame;
+        check(name + " roi", stats.roi == clipped || (stats.roi.area() <= 0 &&
+                                                      clipped.area() <= 0));
+        if (clipped.area() <= 0)
+            continue;
+
+        const cv::Mat region = img(clipped);
+        cv::Scalar e_mean, e_dev;
+        cv::meanStdDev(region, e_mean, e_dev);
+        cv::Mat channel;
+        for (int c = 0; c < img.channels(); ++c)
+        {
+            const std::string cname = name + cv::format(" channel %d", c);
+            check(cname + " mean", std::abs(stats.mean[c] - e_mean[c]) <= 1.0e-9,
+                  cv::format("%.17g != %.17g", stats.mean[c], e_mean[c]));
+            check(cname + " dev", std::abs(stats.stddev[c] - e_dev[c]) <= 1.0e-5,
+                  cv::format("%.17g != %.17g", stats.stddev[c], e_dev[c]));
+            double e_min, e_max;
+            cv::extractChannel(region, channel, c);
+            cv::minMaxLoc(channel, &e_min, &e_max);
+            check(cname + " min", stats.min_v[c] == e_min,
+                  cv::format("%g != %g", stats.min_v[c], e_min));
+            check(cname + " max", stats.max_v[c] == e_max,
+                  cv::format("%g != %g", stats.max_v[c], e_max));
+        }
+    }
+}
+
+int
+main(int, char **)
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        cv::theRNG().state = 0x12345678;
+        const cv::Size sizes[] = {cv::Size(1, 1), cv::Size(5, 3),
+                                  cv::Size(67, 33), cv::Size(640, 480),
+                                  cv::Size(1031, 517)};
+        for (cv::Size const &size : sizes)
+            for (int cn = 1; cn <= 4; ++cn)
+            {
+                const std::string config = cv::format("%dx%dx%d", size.width,
+                                                      size.height, cn);
+                const cv::Mat img = test_image(size, cn);
+                test_min_max_loc_1(img, config);
+                test_min_max_loc_2(img, config);
+                test_parallel_reductions(img, config);
+                // Constant images: every pixel is the first min and max.
+                for (int v = 0; v <= 255; v += 255)
+                {
+                    const cv::Mat constant(size, CV_8UC(cn), cv::Scalar::all(v));
+                    test_min_max_loc_1(constant, config + cv::format(" constant %d", v));
+                    test_min_max_loc_2(constant, config + cv::format(" constant %d", v));
+                }
+            }
+        // Float images (only fsiv_find_min_max_loc_2 and the moments).
+        for (cv::Size const &size : sizes)
+        {
+            const std::string config = cv::format("%dx%d 32F", size.width,
+                                                  size.height);
+            cv::Mat img;
+            test_image(size, 1).convertTo(img, CV_32F, 0.5, -20.0);
+            test_min_max_loc_2(img, config);
+            test_parallel_reductions(img, config);
+        }
+
+        // The accumulator with every depth, rows longer than its blocks and
+        // values with a large offset (which cancel with the plain sums).
+        const cv::Size acc_sizes[] = {cv::Size(1, 1), cv::Size(67, 33),
+                                      cv::Size(3000, 5), cv::Size(640, 480)};
+        for (cv::Size const &size : acc_sizes)
+        {
+            const std::string config = cv::format("%dx%d", size.width, size.height);
+            cv::Mat img_8u(size, CV_8UC1), img_16u(size, CV_16UC1);
+            cv::Mat img_32f(size, CV_32FC1), img_offset(size, CV_32FC1);
+            cv::randu(img_8u, 0, 256);
+            cv::randu(img_16u, 0, 65536);
+            cv::randu(img_32f, -1.0, 1.0);
+            cv::randu(img_offset, 1.0e4, 1.0e4 + 1.0);
+            cv::Mat const *imgs[] = {&img_8u, &img_16u, &img_32f};
+            const char *depths[] = {"8U", "16U", "32F"};
+            for (int d = 0; d < 3; ++d)
+            {
+                cv::Scalar mean, dev;
+                cv::meanStdDev(*imgs[d], mean, dev);
+                test_accumulator(*imgs[d], config + " " + depths[d], mean[0],
+                                 dev[0], 1.0e-9);
+            }
+            double mean, dev;
+            two_pass_mean_dev(img_offset, mean, dev);
+            test_accumulator(img_offset, config + " 32F offset", mean, dev, 1.0e-9);
+        }
+
+        // Integral images of several bands and regions with partial blocks.
+        const cv::Size roi_sizes[] = {cv::Size(1, 1), cv::Size(67, 33),
+                                      cv::Size(640, 480)};
+        for (cv::Size const &size : roi_sizes)
+            for (int cn = 1; cn <= 3; cn += 2)
+            {
+                const std::string config = cv::format("%dx%dx%d", size.width,
+                                                      size.height, cn);
+                const cv::Mat img = test_image(size, cn);
+                test_integral(img, config);
+                const int blocks[] = {1, 7, 16};
+                for (int block : blocks)
+                    test_roi_stats(img, block, config);
+            }
+        std::cout << n_tests - n_failed << "/" << n_tests << " tests passed."
+                  << std::endl;
+        if (n_failed > 0)
+            retCode = EXIT_FAILURE;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
@@ -11,6 +11,24 @@
 
 #include <iostream>
 #include <exception>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/stat.h>
 
 // Includes para OpenCV, Descomentar según los módulo utilizados.
 #include <opencv2/core/core.hpp>
@@ -20,31 +38,83 @@
 // #include <opencv2/calib3d/calib3d.hpp>
 
 #include "common_code.hpp"
+#include "fsiv_preview.hpp"
 
 const cv::String keys =
     "{help h usage ? |      | print this message.}"
     "{i interactive  |      | Activate interactive mode.}"
     "{l luma         |      | process only \"luma\" if color image.}"
+    "{f fused        |      | use the fused single pass kernel to process only luma.}"
+    "{x fixed        |      | use Q4.12 fixed point intermediates and report the error against the float path.}"
     "{c contrast     |1.0   | contrast parameter.}"
     "{b bright       |0.0   | bright parameter.}"
     "{g gamma        |1.0   | gamma parameter.}"
+    "{B batch        |      | batch mode without windows: input is a glob or a list file (.txt) and output a folder.}"
+    "{j jobs         |0     | batch/video mode worker threads. Value 0 means the number of cores.}"
+    "{q queue        |0     | batch mode max images in flight. Value 0 means 2*jobs.}"
+    "{V video        |      | video mode without windows: input and output are videos.}"
+    "{k keyframes    |      | video mode keyframes file. Each line is \"frame contrast bright gamma\", parameters are interpolated between keyframes.}"
+    "{s smooth       |0.0   | video mode temporal smoothing of the parameters in [0, 1). Value 0 means don't smooth.}"
+    "{proxy          |0.25  | interactive mode preview proxy scale. Value 1 means don't render a proxy.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}";
 
+struct UserData;
+typedef fsiv_preview<UserData, cv::Mat> Preview;
+
 struct UserData
 {
     cv::Mat input;
     cv::Mat output;
+    cv::Mat proxy;      // downscaled input for the interactive preview.
+    Preview *preview;   // interactive preview (nullptr if not interactive).
     double contrast;
     double bright;
     double gamma;
     bool luma_is_set;
+    bool fused;
+    bool fixed;
 };
 
 void process_image(UserData *p)
 {
-    p->output = fsiv_cbg_process(p->input, p->contrast, p->bright,
-                                 p->gamma, p->luma_is_set);
+    if (p->fixed)
+        p->output = fsiv_cbg_process_fixed(p->input, p->contrast, p->bright,
+                                           p->gamma, p->luma_is_set);
+    else if (p->luma_is_set && p->fused)
+        p->output = fsiv_cbg_process_luma(p->input, p->contrast, p->bright,
+                                          p->gamma);
+    else
+        p->output = fsiv_cbg_process(p->input, p->contrast, p->bright,
+                                     p->gamma, p->luma_is_set);
+}
+
+/**
+ * @brief Render the interactive preview on a background thread.
+ */
+bool render_preview(UserData const &params, double scale,
+                    std::function<bool()> const &cancelled, cv::Mat &out)
+{
+    UserData d = params;
+    if (scale < 1.0)
+        d.input = d.proxy;
+    process_image(&d);
+    out = d.output;
+    return !cancelled();
+}
+
+/**
+ * @brief Update the output after a parameter change.
+ */
+void update_output(UserData *d)
+{
+    if (d->preview)
+        d->preview->request(*d);
+    else
+    {
+        process_image(d);
+        cv::imshow("PROCESADA", d->output);
+    }
 }
 
 void contrast_trackbar(int pos, void *userdata)
@@ -52,8 +122,7 @@ void contrast_trackbar(int pos, void *userdata)
     UserData *d = static_cast<UserData *>(userdata);
     d->contrast = float(pos) / 200.0 * 2.0;
     std::cout << "Set contrast to " << d->contrast << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    update_output(d);
 }
 
 void bright_trackbar(int pos, void *userdata)
@@ -61,8 +130,7 @@ void bright_trackbar(int pos, void *userdata)
     UserData *d = static_cast<UserData *>(userdata);
     d->bright = (float(pos) - 100.0) / 100.0;
     std::cout << "Set bright to " << d->bright << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    update_output(d);
 }
 
 void gamma_trackbar(int pos, void *userdata)
@@ -70,8 +138,7 @@ void gamma_trackbar(int pos, void *userdata)
     UserData *d = static_cast<UserData *>(userdata);
     d->gamma = float(pos) / 200.0 * 2.0;
     std::cout << "Set gamma to " << d->gamma << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    update_output(d);
 }
 
 void luma_trackbar(int pos, void *userdata)
@@ -79,8 +146,484 @@ void luma_trackbar(int pos, void *userdata)
     UserData *d = static_cast<UserData *>(userdata);
     d->luma_is_set = (pos == 1);
     std::cout << "Set luma mode to state " << d->luma_is_set << std::endl;
-    process_image(d);
-    cv::imshow("PROCESADA", d->output);
+    update_output(d);
+}
+
+/**
+ * @brief Bounded FIFO queue shared by several threads.
+ */
+template <class T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : capacity_(std::max<size_t>(1, capacity)), closed_(false) {}
+
+    /** @brief Push a value, waiting while the queue is full. */
+    void push(T const &v)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return queue_.size() < capacity_; });
+        queue_.push(v);
+        not_empty_.notify_one();
+    }
+
+    /** @brief Pop a value, waiting while empty. False when closed and empty. */
+    bool pop(T &v)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return !queue_.empty() || closed_; });
+        if (queue_.empty())
+            return false;
+        v = queue_.front();
+        queue_.pop();
+        not_full_.notify_one();
+        return true;
+    }
+
+    /** @brief No more values will be pushed. */
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    bool closed_;
+    std::queue<T> queue_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+/**
+ * @brief Get the size of a file.
+ * @return the size in bytes or -1 if the file does not exist.
+ */
+long long file_size(std::string const &fname)
+{
+    struct stat st;
+    if (stat(fname.c_str(), &st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+/**
+ * @brief Batch mode: process a glob or a list file of images into a folder.
+ *
+ * The caller thread lists the input images, skips the ones already in the
+ * output folder (so an interrupted run is resumed) and feeds a bounded
+ * queue. The workers decode, process and encode the images, so there are
+ * at most queue + jobs images in memory. The outputs are written to a
+ * temporary file and renamed, so a killed run never leaves a partial
+ * output that would be skipped on resume. As the outputs are named after
+ * the input base names, an input with the base name of a previous one is
+ * rejected (counted as failed) instead of overwriting its output.
+ */
+int run_batch(std::string const &input, std::string const &out_dir,
+              UserData const &params, int jobs, int queue_size)
+{
+    if (jobs <= 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    if (queue_size <= 0)
+        queue_size = 2 * jobs;
+    struct stat st;
+    if ((mkdir(out_dir.c_str(), 0755) != 0 && errno != EEXIST) ||
+        stat(out_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        std::cerr << "Error: could not create the output folder '" << out_dir << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const bool is_list = input.size() > 4 &&
+                         input.compare(input.size() - 4, 4, ".txt") == 0;
+    std::ifstream list;
+    if (is_list)
+    {
+        list.open(input);
+        if (!list)
+        {
+            std::cerr << "Error: could not open the list file '" << input << "'." << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    // Each worker runs on its own image, do not nest OpenCV threads.
+    const int old_threads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    BoundedQueue<std::string> queue(queue_size);
+    std::atomic<long> done(0), skipped(0), failed(0);
+    std::atomic<long long> bytes_in(0), bytes_out(0);
+    std::mutex log_mutex;
+
+    const int64 t_start = cv::getTickCount();
+    std::vector<std::thread> workers;
+    for (int w = 0; w < jobs; ++w)
+        workers.push_back(std::thread([&]()
+        {
+            UserData data = params;
+            std::string fname;
+            while (queue.pop(fname))
+            {
+                const std::string base = fname.substr(fname.find_last_of('/') + 1);
+                const std::string out_name = out_dir + "/" + base;
+                const std::string tmp_name = out_dir + "/.tmp_" + base;
+                // A file that makes OpenCV throw (i.e. an extension without
+                // a writer) fails alone, the batch goes on.
+                bool ok = false;
+                std::string reason;
+                try
+                {
+                    data.input = cv::imread(fname, cv::IMREAD_ANYCOLOR);
+                    ok = !data.input.empty();
+                    if (ok)
+                    {
+                        process_image(&data);
+                        ok = cv::imwrite(tmp_name, data.output) &&
+                             std::rename(tmp_name.c_str(), out_name.c_str()) == 0;
+                    }
+                }
+                catch (std::exception &e)
+                {
+                    ok = false;
+                    reason = e.what();
+                }
+                if (!ok)
+                {
+                    std::remove(tmp_name.c_str());
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "Error: could not process '" << fname << "'";
+                    if (!reason.empty())
+                        std::cerr << ": " << reason;
+                    std::cerr << std::endl;
+                    ++failed;
+                    continue;
+                }
+                bytes_in += file_size(fname);
+                bytes_out += file_size(out_name);
+                if (++done % 1000 == 0)
+                {
+                    const double s = (cv::getTickCount() - t_start) / cv::getTickFrequency();
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "Processed " << done << " images ("
+                              << done / s << " images/s)." << std::endl;
+                }
+            }
+        }));
+
+    std::vector<cv::String> files;
+    if (!is_list)
+        cv::glob(input, files);
+    // A list file is streamed, so millions of entries only keep their base
+    // names in memory (to reject the repeated ones).
+    std::set<std::string> bases;
+    std::string fname;
+    for (size_t i = 0; is_list ? bool(std::getline(list, fname)) : i < files.size(); ++i)
+    {
+        if (!is_list)
+            fname = files[i];
+        if (fname.empty())
+            continue;
+        const std::string base = fname.substr(fname.find_last_of('/') + 1);
+        if (!bases.insert(base).second)
+        {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            std::cerr << "Error: '" << fname << "' has the same name as a previous input"
+                      << " and would overwrite its output. Skipped." << std::endl;
+            ++failed;
+        }
+        else if (file_size(out_dir + "/" + base) >= 0)
+            ++skipped;
+        else
+            queue.push(fname);
+    }
+    queue.close();
+    for (size_t w = 0; w < workers.size(); ++w)
+        workers[w].join();
+    cv::setNumThreads(old_threads);
+
+    const double wall_s = (cv::getTickCount() - t_start) / cv::getTickFrequency();
+    std::cout << "Images processed: " << done << std::endl;
+    std::cout << "Images skipped  : " << skipped << " (already in the output folder)" << std::endl;
+    std::cout << "Images failed   : " << failed << std::endl;
+    std::cout << "Workers         : " << jobs << std::endl;
+    std::cout << "Wall time       : " << wall_s << " s" << std::endl;
+    if (wall_s > 0.0)
+    {
+        std::cout << "Throughput      : " << done / wall_s << " images/s" << std::endl;
+        std::cout << "Read            : " << bytes_in / wall_s / (1024.0 * 1024.0) << " MiB/s" << std::endl;
+        std::cout << "Written         : " << bytes_out / wall_s / (1024.0 * 1024.0) << " MiB/s" << std::endl;
+    }
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * @brief Video mode parameters at a frame.
+ */
+struct Keyframe
+{
+    long frame;
+    double contrast;
+    double bright;
+    double gamma;
+};
+
+/**
+ * @brief Load a keyframes file.
+ * Each line is "frame contrast bright gamma". Lines starting with # are
+ * comments. The keyframes are sorted by frame.
+ */
+std::vector<Keyframe> load_keyframes(std::string const &fname)
+{
+    std::ifstream in(fname);
+    if (!in)
+        throw std::runtime_error("could not open the keyframes file '" + fname + "'.");
+    std::vector<Keyframe> keyframes;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        Keyframe k;
+        if (!(fields >> k.frame >> k.contrast >> k.bright >> k.gamma))
+            throw std::runtime_error("wrong keyframe line '" + line + "'.");
+        keyframes.push_back(k);
+    }
+    std::sort(keyframes.begin(), keyframes.end(),
+              [](Keyframe const &a, Keyframe const &b)
+              { return a.frame < b.frame; });
+    return keyframes;
+}
+
+/**
+ * @brief Linear interpolation of the keyframes parameters at a frame.
+ * Before the first (after the last) keyframe its parameters are used.
+ */
+void interpolate_keyframes(std::vector<Keyframe> const &keyframes, long frame,
+                           UserData &params)
+{
+    if (keyframes.empty())
+        return;
+    size_t i = 0;
+    while (i < keyframes.size() && keyframes[i].frame <= frame)
+        ++i;
+    const Keyframe &a = keyframes[i == 0 ? 0 : i - 1];
+    const Keyframe &b = keyframes[i == keyframes.size() ? i - 1 : i];
+    const double t = (b.frame > a.frame)
+                         ? std::min(1.0, std::max(0.0, double(frame - a.frame) / (b.frame - a.frame)))
+                         : 0.0;
+    params.contrast = a.contrast + t * (b.contrast - a.contrast);
+    params.bright = a.bright + t * (b.bright - a.bright);
+    params.gamma = a.gamma + t * (b.gamma - a.gamma);
+}
+
+/**
+ * @brief Reassemble frames processed out of order.
+ *
+ * A frame can only be put when it is inside a window of frames after the
+ * next one to be taken, so a slow frame bounds the frames in memory.
+ */
+class FrameReorder
+{
+public:
+    explicit FrameReorder(size_t window)
+        : window_(std::max<size_t>(1, window)), next_(0), total_(-1) {}
+
+    /** @brief Wait until a frame index is inside the window. */
+    void wait_slot(long index)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this, index]()
+                   { return index < next_ + long(window_); });
+    }
+
+    /** @brief Put a processed frame. */
+    void put(long index, cv::Mat const &frame)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        frames_[index] = frame;
+        cond_.notify_all();
+    }
+
+    /** @brief Set the number of frames, when known. */
+    void close(long total)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        total_ = total;
+        cond_.notify_all();
+    }
+
+    /** @brief Take the next frame in order. False when there are no more. */
+    bool take(cv::Mat &frame)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]()
+                   { return frames_.count(next_) > 0 || (total_ >= 0 && next_ >= total_); });
+        std::map<long, cv::Mat>::iterator it = frames_.find(next_);
+        if (it == frames_.end())
+            return false;
+        frame = it->second;
+        frames_.erase(it);
+        ++next_;
+        cond_.notify_all();
+        return true;
+    }
+
+private:
+    size_t window_;
+    long next_;
+    long total_;
+    std::map<long, cv::Mat> frames_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+/**
+ * @brief A video frame to be processed with its parameters.
+ */
+struct VideoTask
+{
+    long index;
+    UserData params;
+};
+
+/**
+ * @brief Video mode: process a video into another one.
+ *
+ * A reader thread decodes the frames and computes their parameters (the
+ * keyframes interpolation and the temporal smoothing are sequential), the
+ * workers process the frames in parallel and the caller thread encodes
+ * them in order.
+ */
+int run_video(std::string const &input, std::string const &output,
+              UserData const &params, std::string const &keyframes_fname,
+              double smooth, int jobs)
+{
+    if (jobs <= 0)
+        jobs = std::max(1u, std::thread::hardware_concurrency());
+    if (smooth < 0.0 || smooth >= 1.0)
+    {
+        std::cerr << "Error: smooth must be in [0, 1)." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::vector<Keyframe> keyframes = keyframes_fname.empty()
+                                                ? std::vector<Keyframe>()
+                                                : load_keyframes(keyframes_fname);
+
+    cv::VideoCapture cap(input);
+    if (!cap.isOpened())
+    {
+        std::cerr << "Error: could not open the input video '" << input << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const double fps = cap.get(cv::CAP_PROP_FPS) > 0.0 ? cap.get(cv::CAP_PROP_FPS) : 25.0;
+    cv::Mat first;
+    if (!cap.read(first) || first.empty())
+    {
+        std::cerr << "Error: could not read the input video '" << input << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const bool is_avi = output.size() > 4 &&
+                        output.compare(output.size() - 4, 4, ".avi") == 0;
+    const int fourcc = is_avi ? cv::VideoWriter::fourcc('M', 'J', 'P', 'G')
+                              : cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+    cv::VideoWriter writer(output, fourcc, fps, first.size(), first.channels() == 3);
+    if (!writer.isOpened())
+    {
+        std::cerr << "Error: could not open the output video '" << output << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Each worker runs on its own frame, do not nest OpenCV threads.
+    const int old_threads = cv::getNumThreads();
+    cv::setNumThreads(1);
+
+    BoundedQueue<VideoTask> tasks(2 * jobs);
+    FrameReorder reorder(4 * jobs);
+    const int64 t_start = cv::getTickCount();
+
+    std::thread reader([&]()
+    {
+        UserData current = params;
+        cv::Mat frame = first;
+        long index = 0;
+        do
+        {
+            UserData target = params;
+            interpolate_keyframes(keyframes, index, target);
+            if (index == 0 || smooth == 0.0)
+                current = target;
+            else
+            {
+                current.contrast = smooth * current.contrast + (1.0 - smooth) * target.contrast;
+                current.bright = smooth * current.bright + (1.0 - smooth) * target.bright;
+                current.gamma = smooth * current.gamma + (1.0 - smooth) * target.gamma;
+            }
+            VideoTask task;
+            task.index = index;
+            task.params = current;
+            task.params.input = frame;
+            reorder.wait_slot(index);
+            tasks.push(task);
+            ++index;
+            frame = cv::Mat();
+        } while (cap.read(frame) && !frame.empty());
+        tasks.close();
+        reorder.close(index);
+    });
+
+    std::atomic<long> failed(0);
+    std::mutex log_mutex;
+    std::vector<std::thread> workers;
+    for (int w = 0; w < jobs; ++w)
+        workers.push_back(std::thread([&]()
+        {
+            VideoTask task;
+            while (tasks.pop(task))
+            {
+                // A frame that fails is written unprocessed, so the writer
+                // does not wait for it forever and the timing is kept.
+                cv::Mat out;
+                try
+                {
+                    process_image(&task.params);
+                    out = task.params.output;
+                }
+                catch (std::exception &e)
+                {
+                    out = task.params.input;
+                    ++failed;
+                    std::lock_guard<std::mutex> lock(log_mutex);
+                    std::cerr << "Error: could not process frame " << task.index
+                              << ": " << e.what() << std::endl;
+                }
+                reorder.put(task.index, out);
+            }
+        }));
+
+    long frames = 0;
+    cv::Mat out;
+    while (reorder.take(out))
+    {
+        writer.write(out);
+        ++frames;
+    }
+
+    reader.join();
+    for (size_t w = 0; w < workers.size(); ++w)
+        workers[w].join();
+    cv::setNumThreads(old_threads);
+
+    const double wall_s = (cv::getTickCount() - t_start) / cv::getTickFrequency();
+    std::cout << "Frames          : " << frames << std::endl;
+    std::cout << "Frames failed   : " << failed << std::endl;
+    std::cout << "Workers         : " << jobs << std::endl;
+    std::cout << "Wall time       : " << wall_s << " s" << std::endl;
+    if (wall_s > 0.0)
+        std::cout << "Throughput      : " << frames / wall_s << " frames/s" << std::endl;
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int main(int argc, char *const *argv)
@@ -107,14 +650,14 @@ int main(int argc, char *const *argv)
             return 0;
         }
 
-        cv::namedWindow("ORIGINAL");
-        cv::namedWindow("PROCESADA");
-
         UserData data;
+        data.preview = nullptr;
         data.contrast = parser.get<double>("c");
         data.bright = parser.get<double>("b");
         data.gamma = parser.get<double>("g");
         data.luma_is_set = parser.has("l");
+        data.fused = parser.has("f");
+        data.fixed = parser.has("x");
         int c_int = data.contrast / 2.0 * 200;
         int b_int = (data.bright + 1.0) / 2.0 * 200;
         int g_int = data.gamma / 2.0 * 200;
@@ -136,6 +679,17 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
+        if (parser.has("B"))
+            return run_batch(input_name, output_name, data,
+                             parser.get<int>("j"), parser.get<int>("q"));
+        if (parser.has("V"))
+            return run_video(input_name, output_name, data,
+                             parser.get<std::string>("k"),
+                             parser.get<double>("s"), parser.get<int>("j"));
+
+        cv::namedWindow("ORIGINAL");
+        cv::namedWindow("PROCESADA");
+
         data.input = cv::imread(input_name, cv::IMREAD_ANYCOLOR);
 
         if (data.input.empty())
@@ -147,9 +701,21 @@ int main(int argc, char *const *argv)
         data.input.copyTo(data.output);
 
         int key = 0;
+        std::unique_ptr<Preview> preview;
 
         if (parser.has("i"))
         {
+            const double proxy_scale = parser.get<double>("proxy");
+            data.proxy = fsiv_preview_proxy(data.input, proxy_scale);
+            preview.reset(new Preview(render_preview,
+                [&data](UserData const &, double scale, cv::Mat const &out)
+                {
+                    cv::imshow("PROCESADA", fsiv_preview_fit(out, data.input.size()));
+                    if (scale >= 1.0)
+                        data.output = out;
+                },
+                proxy_scale));
+            data.preview = preview.get();
             cv::imshow("ORIGINAL", data.input);
             cv::createTrackbar("C", "PROCESADA", &c_int, 200, contrast_trackbar, &data);
             cv::createTrackbar("B", "PROCESADA", &b_int, 200, bright_trackbar, &data);
@@ -159,10 +725,41 @@ int main(int argc, char *const *argv)
 
         process_image(&data);
 
+        if (data.fixed)
+        {
+            // Accuracy of the fixed point path against the float reference.
+            const cv::Mat ref = fsiv_cbg_process(data.input, data.contrast,
+                                                 data.bright, data.gamma,
+                                                 data.luma_is_set);
+            cv::Mat diff;
+            cv::absdiff(ref, data.output, diff);
+            double max_diff = 0.0;
+            cv::minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+            std::cout << "Fixed point vs float: max abs error " << max_diff
+                      << " levels, mean abs error "
+                      << cv::norm(diff, cv::NORM_L1) / diff.total() / diff.channels()
+                      << " levels, differing values "
+                      << cv::countNonZero(diff.reshape(1)) << " of "
+                      << diff.total() * diff.channels() << "." << std::endl;
+        }
+
         cv::imshow("ORIGINAL", data.input);
         cv::imshow("PROCESADA", data.output);
 
-        key = cv::waitKey(0) & 0xff;
+        if (preview)
+        {
+            // Show the preview results while waiting for a key.
+            key = -1;
+            while (key < 0)
+            {
+                key = cv::waitKey(20);
+                preview->poll();
+            }
+            key &= 0xff;
+            preview->finish();
+        }
+        else
+            key = cv::waitKey(0) & 0xff;
 
         if (key != 27)
         {
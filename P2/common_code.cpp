@@ -1,3 +1,12 @@
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+
+#include <opencv2/core/hal/intrin.hpp>
+
 #include "common_code.hpp"
 
 cv::Mat
@@ -52,6 +61,20 @@ fsiv_convert_hsv_to_bgr(const cv::Mat &img)
     return out;
 }
 
+/**
+ * @brief Aplica O = c * I^g + b a una imagen flotante.
+ */
+static cv::Mat
+cbg_process_float(const cv::Mat &float_img,
+                  double contrast, double brightness, double gamma)
+{
+    cv::Mat out;
+    cv::pow(float_img, gamma, out);
+    cv::multiply(cv::Scalar::all(contrast), out, out);
+    out += cv::Scalar::all(brightness);
+    return out;
+}
+
 cv::Mat
 fsiv_cbg_process(const cv::Mat &in,
                  double contrast, double brightness, double gamma,
@@ -60,9 +83,8 @@ fsiv_cbg_process(const cv::Mat &in,
     CV_Assert(in.depth() == CV_8U);
     cv::Mat out;
 
-    cv::Mat float_img = fsiv_convert_image_byte_to_float(in);
-
     if (in.channels() == 3 and only_luma) {
+        cv::Mat float_img = fsiv_convert_image_byte_to_float(in);
         cv::Mat hsv_img = fsiv_convert_bgr_to_hsv(float_img);
         std::vector<cv::Mat> channels;
 
@@ -73,13 +95,307 @@ fsiv_cbg_process(const cv::Mat &in,
         cv::merge(channels, hsv_img);
 
         out = fsiv_convert_hsv_to_bgr(hsv_img);
+        out = fsiv_convert_image_float_to_byte(out);
     } else {
-        cv::pow(float_img, gamma, out);
-        cv::multiply(cv::Scalar::all(contrast), out, out);
-        out += cv::Scalar::all(brightness);
+        // Para 8 bits sólo hay 256 valores posibles por canal.
+        out = fsiv_cbg_process_lut(in, contrast, brightness, gamma);
+    }
+
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    CV_Assert(out.depth() == CV_8U);
+    CV_Assert(out.channels() == in.channels());
+    return out;
+}
+
+cv::Mat
+fsiv_cbg_create_lut(double contrast, double brightness, double gamma)
+{
+    typedef std::tuple<double, double, double> Key;
+    // Con los trackbars hay a lo sumo 201^3 combinaciones, así que se limita
+    // el tamaño de la caché vaciándola cuando se llena.
+    static const size_t max_cached = 256;
+    static std::map<Key, cv::Mat> cache;
+    static std::mutex cache_mutex;
+
+    const Key key(contrast, brightness, gamma);
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::map<Key, cv::Mat>::const_iterator it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+    }
+
+    cv::Mat ramp(1, 256, CV_8UC1);
+    for (int i = 0; i < 256; ++i)
+        ramp.at<uchar>(i) = static_cast<uchar>(i);
+    cv::Mat lut = fsiv_convert_image_float_to_byte(
+        cbg_process_float(fsiv_convert_image_byte_to_float(ramp),
+                          contrast, brightness, gamma));
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache.size() >= max_cached)
+            cache.clear();
+        cache[key] = lut;
+    }
+
+    CV_Assert(lut.rows == 1 && lut.cols == 256 && lut.type() == CV_8UC1);
+    return lut;
+}
+
+cv::Mat
+fsiv_cbg_process_lut(const cv::Mat &in,
+                     double contrast, double brightness, double gamma)
+{
+    CV_Assert(in.depth() == CV_8U);
+    cv::Mat out;
+
+    cv::LUT(in, fsiv_cbg_create_lut(contrast, brightness, gamma), out);
+
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    CV_Assert(out.depth() == CV_8U);
+    CV_Assert(out.channels() == in.channels());
+    return out;
+}
+
+/**
+ * @brief Factores de escalado de fsiv_cbg_process_luma.
+ *
+ * La entrada v (v>0) es el factor V'/V en punto fijo Q16 que lleva la luma
+ * v a su valor de salida V'. Con V=0 (negro) el HSV tiene S=0 y la salida es
+ * gris con valor V', así que la entrada 0 es directamente ese valor.
+ * Se guarda en caché por (contraste, brillo, gamma), como las LUT de
+ * fsiv_cbg_create_lut, porque en vídeo se repiten los mismos parámetros en
+ * cada frame.
+ */
+static cv::Mat
+cbg_luma_scale_table(double contrast, double brightness, double gamma)
+{
+    typedef std::tuple<double, double, double> Key;
+    // Con los trackbars hay a lo sumo 201^3 combinaciones, así que se limita
+    // el tamaño de la caché vaciándola cuando se llena.
+    static const size_t max_cached = 256;
+    static std::map<Key, cv::Mat> cache;
+    static std::mutex cache_mutex;
+
+    const Key key(contrast, brightness, gamma);
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::map<Key, cv::Mat>::const_iterator it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+    }
+
+    // Curva de la luma en flotante, igual que en fsiv_cbg_process.
+    cv::Mat ramp(1, 256, CV_8UC1);
+    for (int i = 0; i < 256; ++i)
+        ramp.at<uchar>(i) = static_cast<uchar>(i);
+    const cv::Mat curve = cbg_process_float(
+        fsiv_convert_image_byte_to_float(ramp), contrast, brightness, gamma);
+
+    // Como cada canal x cumple x<=V, un factor >= 256 satura la salida de
+    // cualquier x>0, así que se limita a 256 y x*m + 2^15 cabe en 32 bits.
+    cv::Mat scale(1, 256, CV_32SC1);
+    int *m = scale.ptr<int>();
+    m[0] = cv::saturate_cast<uchar>(curve.at<float>(0) * 255.0);
+    for (int v = 1; v < 256; ++v)
+    {
+        const double f = curve.at<float>(v) * 255.0 / v;
+        m[v] = cvRound(std::min(std::max(f, 0.0), 256.0) * 65536.0);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (cache.size() >= max_cached)
+            cache.clear();
+        cache[key] = scale;
+    }
+
+    CV_Assert(scale.rows == 1 && scale.cols == 256 && scale.type() == CV_32SC1);
+    return scale;
+}
+
+#if CV_SIMD
+/**
+ * @brief Reescala un canal por los factores Q16 de cada pixel:
+ * (x*m + 2^15) >> 16, saturado.
+ */
+static inline cv::v_uint8
+cbg_rescale_lanes(const cv::v_uint8 &x, const cv::v_uint32 m[4])
+{
+    const cv::v_uint32 half = cv::vx_setall_u32(1u << 15);
+    cv::v_uint16 x0, x1;
+    cv::v_expand(x, x0, x1);
+    cv::v_uint32 a0, a1, a2, a3;
+    cv::v_expand(x0, a0, a1);
+    cv::v_expand(x1, a2, a3);
+    a0 = (a0 * m[0] + half) >> 16;
+    a1 = (a1 * m[1] + half) >> 16;
+    a2 = (a2 * m[2] + half) >> 16;
+    a3 = (a3 * m[3] + half) >> 16;
+    return cv::v_pack(cv::v_pack(a0, a1), cv::v_pack(a2, a3));
+}
+#endif
+
+cv::Mat
+fsiv_cbg_process_luma(const cv::Mat &in,
+                      double contrast, double brightness, double gamma)
+{
+    CV_Assert(in.depth() == CV_8U);
+    if (in.channels() != 3)
+        return fsiv_cbg_process_lut(in, contrast, brightness, gamma);
+
+    const cv::Mat scale = cbg_luma_scale_table(contrast, brightness, gamma);
+    const int *m = scale.ptr<int>();
+    const uchar black = static_cast<uchar>(m[0]);
+
+    cv::Mat out(in.rows, in.cols, in.type());
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &r)
+    {
+        for (int y = r.start; y < r.end; ++y)
+        {
+            const uchar *src = in.ptr<uchar>(y);
+            uchar *dst = out.ptr<uchar>(y);
+            int x = 0;
+#if CV_SIMD
+            const int lanes = cv::v_uint8::nlanes;
+            const cv::v_uint8 zero = cv::vx_setzero_u8();
+            const cv::v_uint8 vblack = cv::vx_setall_u8(black);
+            for (; x <= in.cols - lanes; x += lanes)
+            {
+                cv::v_uint8 b, g, rr;
+                cv::v_load_deinterleave(src + 3 * x, b, g, rr);
+                const cv::v_uint8 luma = cv::v_max(cv::v_max(b, g), rr);
+                // Un factor por pixel (V'/V), compartido por los tres canales.
+                cv::v_uint16 l0, l1;
+                cv::v_expand(luma, l0, l1);
+                cv::v_uint32 idx[4], vm[4];
+                cv::v_expand(l0, idx[0], idx[1]);
+                cv::v_expand(l1, idx[2], idx[3]);
+                for (int i = 0; i < 4; ++i)
+                    vm[i] = cv::v_reinterpret_as_u32(
+                        cv::v_lut(m, cv::v_reinterpret_as_s32(idx[i])));
+                const cv::v_uint8 is_black = luma == zero;
+                cv::v_store_interleave(
+                    dst + 3 * x,
+                    cv::v_select(is_black, vblack, cbg_rescale_lanes(b, vm)),
+                    cv::v_select(is_black, vblack, cbg_rescale_lanes(g, vm)),
+                    cv::v_select(is_black, vblack, cbg_rescale_lanes(rr, vm)));
+            }
+#endif
+            for (; x < in.cols; ++x)
+            {
+                const int luma = std::max(std::max(src[3 * x], src[3 * x + 1]),
+                                          src[3 * x + 2]);
+                for (int c = 0; c < 3; ++c)
+                    dst[3 * x + c] = luma == 0 ? black
+                        : static_cast<uchar>(std::min<unsigned>(
+                              (unsigned(src[3 * x + c]) * unsigned(m[luma]) + (1u << 15)) >> 16,
+                              255u));
+            }
+        }
+    });
+
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    CV_Assert(out.depth() == CV_8U);
+    CV_Assert(out.channels() == in.channels());
+    return out;
+}
+
+// Punto fijo Q4.12.
+static const int FIXED_SHIFT = 12;
+static const int FIXED_ONE = 1 << FIXED_SHIFT;
+
+cv::Mat
+fsiv_convert_image_byte_to_fixed(const cv::Mat &img)
+{
+    CV_Assert(img.depth() == CV_8U);
+    cv::Mat out;
+
+    img.convertTo(out, CV_16S, double(FIXED_ONE) / 255.0);
+
+    CV_Assert(out.rows == img.rows && out.cols == img.cols);
+    CV_Assert(out.depth() == CV_16S);
+    CV_Assert(img.channels() == out.channels());
+    return out;
+}
+
+cv::Mat
+fsiv_convert_image_fixed_to_byte(const cv::Mat &img)
+{
+    CV_Assert(img.depth() == CV_16S);
+    cv::Mat out;
+
+    img.convertTo(out, CV_8U, 255.0 / double(FIXED_ONE));
+
+    CV_Assert(out.rows == img.rows && out.cols == img.cols);
+    CV_Assert(out.depth() == CV_8U);
+    CV_Assert(img.channels() == out.channels());
+    return out;
+}
+
+/**
+ * @brief Curva O = c * I^g + b en punto fijo Q4.12.
+ */
+class FixedCurve
+{
+public:
+    FixedCurve(double contrast, double brightness, double gamma)
+        : gamma_(FIXED_ONE + 1),
+          contrast_(cvRound(contrast * FIXED_ONE)),
+          brightness_(cvRound(brightness * FIXED_ONE))
+    {
+        for (int v = 0; v <= FIXED_ONE; ++v)
+            gamma_[v] = cvRound(std::pow(double(v) / FIXED_ONE, gamma) * FIXED_ONE);
+    }
+
+    int operator()(int v) const
+    {
+        const int t = gamma_[std::min(std::max(v, 0), FIXED_ONE)];
+        return ((t * contrast_ + (FIXED_ONE >> 1)) >> FIXED_SHIFT) + brightness_;
     }
 
-    out = fsiv_convert_image_float_to_byte(out);
+private:
+    std::vector<int> gamma_;
+    int contrast_;
+    int brightness_;
+};
+
+cv::Mat
+fsiv_cbg_process_fixed(const cv::Mat &in,
+                       double contrast, double brightness, double gamma,
+                       bool only_luma)
+{
+    CV_Assert(in.depth() == CV_8U);
+    const FixedCurve curve(contrast, brightness, gamma);
+    const bool luma = in.channels() == 3 && only_luma;
+    cv::Mat fixed_img = fsiv_convert_image_byte_to_fixed(in);
+
+    cv::parallel_for_(cv::Range(0, fixed_img.rows), [&](const cv::Range &r)
+    {
+        const int n = fixed_img.cols * fixed_img.channels();
+        for (int y = r.start; y < r.end; ++y)
+        {
+            short *p = fixed_img.ptr<short>(y);
+            if (!luma)
+            {
+                for (int i = 0; i < n; ++i)
+                    p[i] = cv::saturate_cast<short>(curve(p[i]));
+                continue;
+            }
+            // Se reescala la tripleta por V'/V, como al modificar V en HSV.
+            for (int i = 0; i < n; i += 3)
+            {
+                const int v = std::max(std::max(p[i], p[i + 1]), p[i + 2]);
+                const int new_v = curve(v);
+                for (int c = 0; c < 3; ++c)
+                    p[i + c] = cv::saturate_cast<short>(
+                        v == 0 ? new_v : (p[i + c] * new_v + v / 2) / v);
+            }
+        }
+    });
+
+    cv::Mat out = fsiv_convert_image_fixed_to_byte(fixed_img);
 
     CV_Assert(out.rows == in.rows && out.cols == in.cols);
     CV_Assert(out.depth() == CV_8U);
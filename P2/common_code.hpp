@@ -45,6 +45,9 @@ cv::Mat fsiv_convert_hsv_to_bgr(const cv::Mat &img);
  * Si la imagen es RGB y el flag only_luma es true, se utiliza el espacio HSV
  * para procesar sólo el canal V (luma).
  *
+ * En otro caso la imagen se procesa con una LUT de 256 entradas
+ * (ver fsiv_cbg_process_lut).
+ *
  * @param img  imagen de entrada.
  * @param contrast controla el ajuste del contraste.
  * @param brightness controla el ajuste del brillo.
@@ -55,3 +58,98 @@ cv::Mat fsiv_convert_hsv_to_bgr(const cv::Mat &img);
 cv::Mat fsiv_cbg_process(const cv::Mat &img,
                          double contrast = 1.0, double brightness = 0.0, double gamma = 1.0,
                          bool only_luma = true);
+
+/**
+ * @brief Crea la LUT que aplica O = c * I^g + b a una imagen byte.
+ *
+ * La LUT se calcula procesando una rampa 0..255 con el mismo proceso en
+ * flotante que fsiv_cbg_process, así que el resultado es idéntico.
+ * Las LUTs se guardan en una caché indexada por (contrast, brightness, gamma).
+ *
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @return la LUT (1x256, CV_8UC1). Es compartida con la caché: no modificar.
+ */
+cv::Mat fsiv_cbg_create_lut(double contrast = 1.0, double brightness = 0.0,
+                            double gamma = 1.0);
+
+/**
+ * @brief Realiza un control del brillo/contraste/gamma con una LUT.
+ *
+ * Se procesan todos los canales, sin valores intermedios en flotante.
+ *
+ * @param img  imagen de entrada.
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @return la imagen procesada.
+ * @pre img.depth()==CV_8U
+ */
+cv::Mat fsiv_cbg_process_lut(const cv::Mat &img,
+                             double contrast = 1.0, double brightness = 0.0,
+                             double gamma = 1.0);
+
+/**
+ * @brief Realiza un control del brillo/contraste/gamma sólo de la luma.
+ *
+ * Es una versión fusionada de fsiv_cbg_process con only_luma=true: en una
+ * sola pasada (paralela por filas) se calcula V=max(B,G,R), se aplica la
+ * curva O = c * V^g + b y se reescala la tripleta BGR por V'/V, lo que
+ * conserva el tono y la saturación igual que el paso por HSV.
+ * El factor V'/V de cada pixel sale de una tabla de 256 factores Q16
+ * indexada por V y los tres canales se multiplican por él con SIMD
+ * (multiplicación y desplazamiento), así que no hay valores intermedios en
+ * flotante por pixel. Cada canal difiere como mucho en 1 del paso por HSV.
+ *
+ * @param img  imagen de entrada.
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @return la imagen procesada (igual a fsiv_cbg_process salvo redondeos).
+ * @pre img.depth()==CV_8U
+ * @warning si la imagen es monocroma se procesa con fsiv_cbg_process_lut.
+ */
+cv::Mat fsiv_cbg_process_luma(const cv::Mat &img,
+                              double contrast = 1.0, double brightness = 0.0,
+                              double gamma = 1.0);
+
+/**
+ * @brief Convierte una imagen con tipo byte a punto fijo Q4.12 [0,4096].
+ *
+ * El formato Q4.12 (CV_16S, 1.0 = 4096) usa la mitad de memoria que el
+ * flotante y deja margen para los valores fuera de [0,1] que producen el
+ * contraste y el brillo.
+ *
+ * @param img imagen de entrada.
+ * @return la imagen de salida (CV_16S).
+ * @warning la imagen de entrada puede ser monocroma o RGB.
+ */
+cv::Mat fsiv_convert_image_byte_to_fixed(const cv::Mat &img);
+
+/**
+ * @brief Convierte una imagen en punto fijo Q4.12 a byte [0,255].
+ * @param img imagen de entrada (CV_16S).
+ * @return la imagen de salida (saturada).
+ * @warning la imagen de entrada puede ser monocroma o RGB.
+ */
+cv::Mat fsiv_convert_image_fixed_to_byte(const cv::Mat &img);
+
+/**
+ * @brief Realiza un control del brillo/contraste/gamma en punto fijo Q4.12.
+ *
+ * Igual que fsiv_cbg_process, pero los valores intermedios son Q4.12 en
+ * lugar de flotantes: la gamma se aplica con una tabla de 4097 entradas y
+ * el contraste y el brillo con aritmética entera.
+ *
+ * @param img  imagen de entrada.
+ * @param contrast controla el ajuste del contraste.
+ * @param brightness controla el ajuste del brillo.
+ * @param gamma controla el ajuste de la gamma.
+ * @param only_luma si es true sólo se procesa el canal Luma.
+ * @return la imagen procesada.
+ * @pre img.depth()==CV_8U
+ */
+cv::Mat fsiv_cbg_process_fixed(const cv::Mat &img,
+                               double contrast = 1.0, double brightness = 0.0,
+                               double gamma = 1.0, bool only_luma = true);
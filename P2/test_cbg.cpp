@@ -0,0 +1,174 @@
+/**
+ * @file test_cbg.cpp
+ * @brief Check the fast contrast/brightness/gamma kernels against the float path.
+ *
+ * The LUT path must be bit exact with the float processing of each channel,
+ * as its LUT is built with the same float operations. The fused luma path
+ * only differs from the HSV round trip in the rounding, so no value may
+ * differ by more than 1. The Q4.12 path keeps the error of its intermediates
+ * below half a level (a Q4.12 unit is 255/4096 levels), so its output may
+ * also differ by 1 at most from the float path.
+ */
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+
+#include <opencv2/core.hpp>
+
+#include "common_code.hpp"
+
+static int n_tests = 0;
+static int n_failed = 0;
+
+/**
+ * @brief Report a check.
+ */
+static void
+check(std::string const &name, bool ok, std::string const &detail = "")
+{
+    ++n_tests;
+    if (!ok)
+    {
+        ++n_failed;
+        std::cerr << "Test " << name << ": FAILED";
+        if (!detail.empty())
+            std::cerr << " (" << detail << ")";
+        std::cerr << std::endl;
+    }
+}
+
+/**
+ * @brief Check two byte images differ at most by max_diff.
+ */
+static void
+check_images(std::string const &name, cv::Mat const &result,
+             cv::Mat const &expected, double max_diff)
+{
+    if (result.type() != expected.type() || result.size() != expected.size())
+    {
+        check(name, false, "wrong size or type");
+        return;
+    }
+    const double diff = cv::norm(result, expected, cv::NORM_INF);
+    check(name, diff <= max_diff, cv::format("max. diff %g", diff));
+}
+
+/**
+ * @brief O = c * I^g + b processing each channel in float.
+ */
+static cv::Mat
+float_process(cv::Mat const &img, double contrast, double brightness,
+              double gamma)
+{
+    cv::Mat out = fsiv_convert_image_byte_to_float(img);
+    cv::pow(out, gamma, out);
+    cv::multiply(cv::Scalar::all(contrast), out, out);
+    out += cv::Scalar::all(brightness);
+    return fsiv_convert_image_float_to_byte(out);
+}
+
+/**
+ * @brief The LUT path against the float processing of each channel.
+ */
+static void
+test_lut(cv::Mat const &img, std::string const &config, double contrast,
+         double brightness, double gamma)
+{
+    const cv::Mat expected = float_process(img, contrast, brightness, gamma);
+    check_images("fsiv_cbg_process_lut " + config,
+                 fsiv_cbg_process_lut(img, contrast, brightness, gamma),
+                 expected, 0.0);
+    check_images("fsiv_cbg_process " + config + " all channels",
+                 fsiv_cbg_process(img, contrast, brightness, gamma, false),
+                 expected, 0.0);
+}
+
+/**
+ * @brief The fused luma path against the HSV round trip.
+ */
+static void
+test_luma(cv::Mat const &img, std::string const &config, double contrast,
+          double brightness, double gamma)
+{
+    check_images("fsiv_cbg_process_luma " + config,
+                 fsiv_cbg_process_luma(img, contrast, brightness, gamma),
+                 fsiv_cbg_process(img, contrast, brightness, gamma, true),
+                 img.channels() == 3 ? 1.0 : 0.0);
+}
+
+/**
+ * @brief The Q4.12 fixed point path against the float path.
+ */
+static void
+test_fixed(cv::Mat const &img, std::string const &config, double contrast,
+           double brightness, double gamma)
+{
+    for (int only_luma = 0; only_luma < 2; ++only_luma)
+        check_images("fsiv_cbg_process_fixed " + config +
+                         (only_luma ? " luma" : " all channels"),
+                     fsiv_cbg_process_fixed(img, contrast, brightness, gamma,
+                                            only_luma != 0),
+                     fsiv_cbg_process(img, contrast, brightness, gamma,
+                                      only_luma != 0),
+                     1.0);
+}
+
+int
+main(int, char **)
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        cv::theRNG().state = 0x12345678;
+        const cv::Size sizes[] = {cv::Size(1, 1), cv::Size(67, 33),
+                                  cv::Size(640, 480)};
+        const double contrasts[] = {0.0, 0.5, 1.0, 2.0};
+        const double brightnesses[] = {-1.0, -0.25, 0.0, 0.5};
+        const double gammas[] = {0.25, 1.0, 2.0};
+        for (cv::Size const &size : sizes)
+            for (int cn = 1; cn <= 3; cn += 2)
+            {
+                cv::Mat img(size, CV_8UC(cn));
+                cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(256));
+                // Include the extremes, where the curves saturate.
+                img.ptr<uchar>(0)[0] = 0;
+                img.ptr<uchar>(size.height - 1)[size.width * cn - 1] = 255;
+                // Black and gray pixels (V=0 and S=0 in HSV).
+                if (size.width > 2)
+                {
+                    img(cv::Rect(1, 0, 1, 1)).setTo(cv::Scalar::all(0));
+                    img(cv::Rect(2, 0, 1, 1)).setTo(cv::Scalar::all(128));
+                }
+                // The byte <-> Q4.12 conversions are lossless.
+                const cv::Mat fixed = fsiv_convert_image_byte_to_fixed(img);
+                check("fsiv_convert_image_byte_to_fixed " +
+                          cv::format("%dx%dx%d", size.width, size.height, cn),
+                      fixed.type() == CV_MAKETYPE(CV_16S, cn));
+                check_images("fsiv_convert_image_fixed_to_byte " +
+                                 cv::format("%dx%dx%d", size.width, size.height, cn),
+                             fsiv_convert_image_fixed_to_byte(fixed), img, 0.0);
+                for (double c : contrasts)
+                    for (double b : brightnesses)
+                        for (double g : gammas)
+                        {
+                            const std::string config = cv::format(
+                                "%dx%dx%d c=%g b=%g g=%g", size.width,
+                                size.height, cn, c, b, g);
+                            test_lut(img, config, c, b, g);
+                            test_luma(img, config, c, b, g);
+                            test_fixed(img, config, c, b, g);
+                        }
+            }
+        std::cout << n_tests - n_failed << "/" << n_tests << " tests passed."
+                  << std::endl;
+        if (n_failed > 0)
+            retCode = EXIT_FAILURE;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
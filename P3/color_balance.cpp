@@ -1,5 +1,8 @@
 #include <iostream>
 #include <exception>
+#include <functional>
+#include <memory>
+#include <string>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/utility.hpp>
@@ -7,14 +10,25 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "common_code.hpp"
+#include "fsiv_preview.hpp"
 
 const cv::String keys =
     "{help h usage ? |      | print this message   }"
     "{i interactive  |      | use interactive mode.}"
     "{p              |0     | Percentage of brightest points used. Default 0 means use the classical white patch method. Values (0, 100) means to use this percentage of brighter pixels. Value 100 means use the gray world method.}"
+    "{a approx       |-1    | Approximate the estimation with a sample of pixels: -1 exact, 0 strided, 1 random, 2 pyramid.}"
+    "{e error        |1.0   | Approximate estimation error bound in gray levels.}"
+    "{v video        |      | input and output are videos: balance them frame by frame tracking the illuminant.}"
+    "{n period       |15    | video mode: estimate the illuminant every n frames.}"
+    "{s smooth       |0.8   | video mode: illuminant smoothing, weight of the previous estimation in [0, 1).}"
+    "{c cut          |20    | video mode: mean color change (gray levels) taken as a scene cut.}"
+    "{proxy          |0.25  | interactive mode preview proxy scale. Value 1 means don't render a proxy.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}";
 
+struct UserData;
+typedef fsiv_preview<UserData, cv::Mat> Preview;
+
 /**
  * @brief Application State.
  * Use this structure to maintain the state of the application
@@ -22,10 +36,107 @@ const cv::String keys =
  */
 struct UserData
 {
-    cv::Mat in;  // input image.
-    cv::Mat out; // output image.
+    cv::Mat in;        // input image.
+    cv::Mat out;       // output image.
+    cv::Mat proxy;     // downscaled input for the interactive preview.
+    int p;             // percentage of brightest points used.
+    bool use_white;    // rescale using a clicked white reference.
+    cv::Scalar white;  // clicked white reference.
+    int approx;        // sampling method (-1 exact estimation).
+    double max_error;  // approximate estimation error bound.
+    Preview *preview;  // interactive preview.
 };
 
+/**
+ * @brief Balance an image with the current parameters.
+ */
+cv::Mat balance_image(UserData const &params, cv::Mat const &in)
+{
+    if (params.use_white)
+    {
+        cv::Mat out;
+        fsiv_color_rescaling_inplace(in, params.white, cv::Scalar::all(255.0), out);
+        return out;
+    }
+    if (params.approx >= 0)
+    {
+        if (params.p < 100)
+            return fsiv_white_patch_color_balance_approx(in, params.p, params.approx,
+                                                         params.max_error);
+        return fsiv_gray_world_color_balance_approx(in, params.approx,
+                                                    params.max_error);
+    }
+    if (params.p < 100)
+        return fsiv_white_patch_color_balance_fused(in, params.p);
+    return fsiv_gray_world_color_balance(in);
+}
+
+/**
+ * @brief Balance the input (or its proxy) with the current parameters.
+ * It is used to render the interactive preview on a background thread.
+ */
+bool render_preview(UserData const &params, double scale,
+                    std::function<bool()> const &cancelled, cv::Mat &out)
+{
+    out = balance_image(params, scale < 1.0 ? params.proxy : params.in);
+    return !cancelled();
+}
+
+/**
+ * @brief Video mode: balance a video into another one.
+ *
+ * The illuminant is tracked with fsiv_illuminant_tracker, so most of the
+ * frames only pay for the rescaling, done in place on the decoded frame.
+ */
+int run_video(std::string const &input, std::string const &output,
+              fsiv_illuminant_tracker &tracker)
+{
+    cv::VideoCapture cap(input);
+    if (!cap.isOpened())
+    {
+        std::cerr << "Error: could not open the input video '" << input << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const double fps = cap.get(cv::CAP_PROP_FPS) > 0.0 ? cap.get(cv::CAP_PROP_FPS) : 25.0;
+    cv::Mat frame;
+    if (!cap.read(frame) || frame.empty())
+    {
+        std::cerr << "Error: could not read the input video '" << input << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    const bool is_avi = output.size() > 4 &&
+                        output.compare(output.size() - 4, 4, ".avi") == 0;
+    const int fourcc = is_avi ? cv::VideoWriter::fourcc('M', 'J', 'P', 'G')
+                              : cv::VideoWriter::fourcc('m', 'p', '4', 'v');
+    cv::VideoWriter writer(output, fourcc, fps, frame.size(), true);
+    if (!writer.isOpened())
+    {
+        std::cerr << "Error: could not open the output video '" << output << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    long frames = 0;
+    int64 balance_ticks = 0;
+    const int64 t_start = cv::getTickCount();
+    do
+    {
+        const int64 t0 = cv::getTickCount();
+        tracker.balance(frame, frame);
+        balance_ticks += cv::getTickCount() - t0;
+        writer.write(frame);
+        ++frames;
+    } while (cap.read(frame) && !frame.empty());
+
+    const double secs = (cv::getTickCount() - t_start) / cv::getTickFrequency();
+    const double balance_secs = balance_ticks / cv::getTickFrequency();
+    std::cout << "Balanced " << frames << " frames in " << secs << " s ("
+              << frames / secs << " frames/s, balance "
+              << frames / balance_secs << " frames/s)." << std::endl;
+    std::cout << "Illuminant estimations: " << tracker.estimations()
+              << " (scene cuts: " << tracker.cuts() << ")." << std::endl;
+    return EXIT_SUCCESS;
+}
+
 /** @brief Standard mouse callback
  * Use this function an argument for cv::setMouseCallback to control the
  * mouse interaction with a window.
@@ -41,10 +152,10 @@ void on_mouse(int event, int x, int y, int flags, void *user_data_)
     UserData *user_data = static_cast<UserData *>(user_data_);
     if (event == cv::EVENT_LBUTTONDOWN)
     {
-        user_data->out = fsiv_color_rescaling(user_data->in,
-                                              user_data->in.at<cv::Vec3b>(y, x),
-                                              cv::Scalar::all(255.0));
-        cv::imshow("OUTPUT", user_data->out);
+        const cv::Vec3b white = user_data->in.at<cv::Vec3b>(y, x);
+        user_data->use_white = true;
+        user_data->white = cv::Scalar(white[0], white[1], white[2]);
+        user_data->preview->request(*user_data);
     }
 }
 
@@ -59,11 +170,9 @@ void on_change(int v, void *user_data_)
 {
     UserData *user_data = static_cast<UserData *>(user_data_);
     std::cout << "Setting p to " << v << "%" << std::endl;
-    if (v < 100)
-        user_data->out = fsiv_white_patch_color_balance(user_data->in, v);
-    else
-        user_data->out = fsiv_gray_world_color_balance(user_data->in);
-    cv::imshow("OUTPUT", user_data->out);
+    user_data->p = v;
+    user_data->use_white = false;
+    user_data->preview->request(*user_data);
 }
 
 int main(int argc, char *const *argv)
@@ -94,7 +203,31 @@ int main(int argc, char *const *argv)
             parser.printErrors();
             return EXIT_FAILURE;
         }
+        if (parser.get<int>("a") > FSIV_SAMPLING_PYRAMID || parser.get<double>("e") <= 0.0)
+        {
+            std::cerr << "Error: wrong approximate estimation parameters." << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (parser.has("video"))
+        {
+            if (parser.get<int>("n") <= 0 || parser.get<double>("s") < 0.0 ||
+                parser.get<double>("s") >= 1.0)
+            {
+                std::cerr << "Error: wrong video mode parameters." << std::endl;
+                return EXIT_FAILURE;
+            }
+            fsiv_illuminant_tracker tracker(p, parser.get<int>("n"),
+                                            parser.get<double>("s"),
+                                            parser.get<double>("c"),
+                                            parser.get<double>("e"));
+            return run_video(input_n, output_n, tracker);
+        }
         UserData user_data;
+        user_data.p = p;
+        user_data.use_white = false;
+        user_data.approx = parser.get<int>("a");
+        user_data.max_error = parser.get<double>("e");
+        user_data.preview = nullptr;
         user_data.in = cv::imread(input_n, cv::IMREAD_COLOR);
         if (user_data.in.empty())
         {
@@ -102,22 +235,45 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
-        if (p < 100)
-            user_data.out = fsiv_white_patch_color_balance(user_data.in, p);
-        else
-            user_data.out = fsiv_gray_world_color_balance(user_data.in);
+        user_data.out = balance_image(user_data, user_data.in);
 
         cv::namedWindow("INPUT");
         cv::namedWindow("OUTPUT");
+        std::unique_ptr<Preview> preview;
         if (interactive_mode)
         {
+            const double proxy_scale = parser.get<double>("proxy");
+            user_data.proxy = fsiv_preview_proxy(user_data.in, proxy_scale);
+            preview.reset(new Preview(render_preview,
+                [&user_data](UserData const &, double scale, cv::Mat const &out)
+                {
+                    cv::imshow("OUTPUT", fsiv_preview_fit(out, user_data.in.size()));
+                    if (scale >= 1.0)
+                        user_data.out = out;
+                },
+                proxy_scale));
+            user_data.preview = preview.get();
             cv::setMouseCallback("INPUT", on_mouse, &user_data);
             cv::createTrackbar("P", "OUTPUT", &p, 100, on_change,
                                &user_data);
         }
         cv::imshow("INPUT", user_data.in);
         cv::imshow("OUTPUT", user_data.out);
-        int k = cv::waitKey(0) & 0xff;
+        int k;
+        if (preview)
+        {
+            // Show the preview results while waiting for a key.
+            k = -1;
+            while (k < 0)
+            {
+                k = cv::waitKey(20);
+                preview->poll();
+            }
+            k &= 0xff;
+            preview->finish();
+        }
+        else
+            k = cv::waitKey(0) & 0xff;
         if (k != 27)
             cv::imwrite(output_n, user_data.out);
     }
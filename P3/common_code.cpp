@@ -1,6 +1,11 @@
 #include "common_code.hpp"
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <vector>
 
 cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from, const cv::Scalar &to)
 {
@@ -16,6 +21,75 @@ cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from, const cv
     return out;
 }
 
+#if CV_SIMD
+/**
+ * @brief Rescale 4 u32 lanes groups of a channel: (x*m + 2^15) >> 16, saturated.
+ */
+static inline cv::v_uint8 rescale_lanes(const cv::v_uint8 &x, const cv::v_uint32 &m)
+{
+    const cv::v_uint32 half = cv::vx_setall_u32(1u << 15);
+    cv::v_uint16 x0, x1;
+    cv::v_expand(x, x0, x1);
+    cv::v_uint32 a0, a1, a2, a3;
+    cv::v_expand(x0, a0, a1);
+    cv::v_expand(x1, a2, a3);
+    a0 = (a0 * m + half) >> 16;
+    a1 = (a1 * m + half) >> 16;
+    a2 = (a2 * m + half) >> 16;
+    a3 = (a3 * m + half) >> 16;
+    return cv::v_pack(cv::v_pack(a0, a1), cv::v_pack(a2, a3));
+}
+#endif
+
+void fsiv_color_rescaling_inplace(const cv::Mat &in, const cv::Scalar &from,
+                                  const cv::Scalar &to, cv::Mat &out)
+{
+    CV_Assert(in.type() == CV_8UC3);
+
+    // Q16 multipliers, as cv::divide a zero divisor gives a zero factor.
+    // The largest one keeps 255*m + 2^15 inside 32 bits.
+    const double max_m = (4294967295.0 - 32768.0) / 255.0;
+    unsigned m[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        const double sf = from[c] != 0.0 ? to[c] / from[c] : 0.0;
+        m[c] = static_cast<unsigned>(std::min(max_m, std::max(0.0, std::round(sf * 65536.0))));
+    }
+
+    out.create(in.rows, in.cols, CV_8UC3);
+    cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &r)
+    {
+        for (int y = r.start; y < r.end; ++y)
+        {
+            const uchar *src = in.ptr<uchar>(y);
+            uchar *dst = out.ptr<uchar>(y);
+            int x = 0;
+#if CV_SIMD
+            const int lanes = cv::v_uint8::nlanes;
+            const cv::v_uint32 mb = cv::vx_setall_u32(m[0]);
+            const cv::v_uint32 mg = cv::vx_setall_u32(m[1]);
+            const cv::v_uint32 mr = cv::vx_setall_u32(m[2]);
+            for (; x <= in.cols - lanes; x += lanes)
+            {
+                cv::v_uint8 b, g, rr;
+                cv::v_load_deinterleave(src + 3 * x, b, g, rr);
+                cv::v_store_interleave(dst + 3 * x, rescale_lanes(b, mb),
+                                       rescale_lanes(g, mg), rescale_lanes(rr, mr));
+            }
+#endif
+            for (; x < in.cols; ++x)
+                for (int c = 0; c < 3; ++c)
+                {
+                    const std::uint64_t v = (std::uint64_t(src[3 * x + c]) * m[c] + (1u << 15)) >> 16;
+                    dst[3 * x + c] = static_cast<uchar>(std::min<std::uint64_t>(v, 255));
+                }
+        }
+    });
+
+    CV_Assert(out.type() == in.type());
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+}
+
 cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in)
 {
     CV_Assert(in.type() == CV_8UC3);
@@ -44,14 +118,7 @@ cv::Mat fsiv_convert_bgr_to_gray(const cv::Mat &img, cv::Mat &out)
 cv::Mat fsiv_compute_image_histogram(cv::Mat const &img)
 {
     CV_Assert(img.type() == CV_8UC1);
-    cv::Mat hist;
-
-    int histSize = 256; 
-    float range[] = {0, 256}; 
-    const float *ranges[] = {range};
-    cv::calcHist(&img, 1, 0, cv::Mat(), hist, 1, &histSize, ranges);
-
-    hist.convertTo(hist, CV_32FC1);
+    cv::Mat hist = fsiv_parallel_histogram(img, 256, 0.0, 256.0);
 
     CV_Assert(!hist.empty());
     CV_Assert(hist.type() == CV_32FC1);
@@ -65,18 +132,24 @@ float fsiv_compute_histogram_percentile(cv::Mat const &hist, float p_value)
     CV_Assert(hist.cols == 1);
     CV_Assert(0.0 <= p_value && p_value <= 1.0);
 
-    int p = 0;
+    return fsiv_compute_histogram_percentile(fsiv_cumulative_histogram(hist),
+                                             p_value);
+}
 
-    float total = cv::sum(hist)[0];
-    float total_sum = hist.at<float>(0);
+float fsiv_compute_histogram_percentile(fsiv_cumulative_histogram const &cum,
+                                        float p_value)
+{
+    CV_Assert(cum.bins() > 0);
+    CV_Assert(0.0 <= p_value && p_value <= 1.0);
 
-    while (total_sum < p_value * total and p < hist.rows)
-    {
-        ++p;
-        total_sum += hist.at<float>(p);
-    }
+    // First bin whose cumulative sum reaches p_value * total (in float, as
+    // the linear walk did).
+    const float target = p_value * static_cast<float>(cum.total());
+    int p = cum.find_first([target](double c)
+                           { return static_cast<float>(c) >= target; });
+    p = std::min(p, cum.bins() - 1);
 
-    CV_Assert(0 <= p && p < hist.rows);
+    CV_Assert(0 <= p && p < cum.bins());
     return p;
 }
 
@@ -118,3 +191,273 @@ cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p)
     CV_Assert(out.rows == in.rows && out.cols == in.cols);
     return out;
 }
+
+// cv::cvtColor BGR2GRAY fixed-point coefficients for 8 bits images.
+static const int GRAY_SHIFT = 14;
+static const int GRAY_B = 1868;
+static const int GRAY_G = 9617;
+static const int GRAY_R = 4899;
+
+#if CV_SIMD
+static inline cv::v_uint16 gray_lanes(const cv::v_uint16 &b, const cv::v_uint16 &g,
+                                      const cv::v_uint16 &r)
+{
+    const cv::v_uint16 vb = cv::vx_setall_u16(GRAY_B);
+    const cv::v_uint16 vg = cv::vx_setall_u16(GRAY_G);
+    const cv::v_uint16 vr = cv::vx_setall_u16(GRAY_R);
+    const cv::v_uint32 half = cv::vx_setall_u32(1 << (GRAY_SHIFT - 1));
+    cv::v_uint32 lo, hi, t0, t1;
+    cv::v_mul_expand(b, vb, lo, hi);
+    cv::v_mul_expand(g, vg, t0, t1);
+    lo += t0;
+    hi += t1;
+    cv::v_mul_expand(r, vr, t0, t1);
+    lo += t0 + half;
+    hi += t1 + half;
+    return cv::v_pack(lo >> GRAY_SHIFT, hi >> GRAY_SHIFT);
+}
+#endif
+
+/**
+ * @brief Compute the luminance of a packed BGR row.
+ */
+static void bgr_row_to_gray(const uchar *src, uchar *gray, int cols)
+{
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_uint8::nlanes;
+    for (; x <= cols - lanes; x += lanes)
+    {
+        cv::v_uint8 b, g, r;
+        cv::v_load_deinterleave(src + 3 * x, b, g, r);
+        cv::v_uint16 b0, b1, g0, g1, r0, r1;
+        cv::v_expand(b, b0, b1);
+        cv::v_expand(g, g0, g1);
+        cv::v_expand(r, r0, r1);
+        cv::v_store(gray + x, cv::v_pack(gray_lanes(b0, g0, r0),
+                                         gray_lanes(b1, g1, r1)));
+    }
+#endif
+    for (; x < cols; ++x)
+        gray[x] = static_cast<uchar>((src[3 * x] * GRAY_B + src[3 * x + 1] * GRAY_G +
+                                      src[3 * x + 2] * GRAY_R + (1 << (GRAY_SHIFT - 1))) >> GRAY_SHIFT);
+}
+
+cv::Scalar fsiv_estimate_white_patch(cv::Mat const &in, float p)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(0.0f <= p && p <= 100.0f);
+
+    // First pass: luminance histogram, binning each luminance row while it
+    // is in cache. With p=0 the first brightest pixel of each row is kept
+    // too (each row is computed once, so there is no race).
+    std::vector<uchar> row_max(p == 0.0f ? in.rows : 0, 0);
+    std::vector<int> row_max_x(p == 0.0f ? in.rows : 0, 0);
+    const cv::Mat hist = fsiv_parallel_histogram_rows(in.rows, in.cols,
+        [&](int y, uchar *gray)
+        {
+            bgr_row_to_gray(in.ptr<uchar>(y), gray, in.cols);
+            if (p == 0.0f)
+            {
+                int best_x = 0;
+                for (int x = 1; x < in.cols; ++x)
+                    if (gray[x] > gray[best_x])
+                        best_x = x;
+                row_max[y] = gray[best_x];
+                row_max_x[y] = best_x;
+            }
+        });
+
+    if (p == 0.0f)
+    {
+        // The first brightest pixel in row-major order (as cv::minMaxLoc).
+        int best = 0;
+        for (int y = 1; y < in.rows; ++y)
+            if (row_max[y] > row_max[best])
+                best = y;
+        return cv::Scalar(in.at<cv::Vec3b>(best, row_max_x[best]));
+    }
+
+    const int threshold = static_cast<int>(
+        fsiv_compute_histogram_percentile(hist, 1 - p / 100.0));
+
+    // Second pass: BGR sums of the pixels over the threshold.
+    const std::vector<cv::Range> tiles = fsiv_make_row_tiles(in.rows, in.cols);
+    const int n_tiles = static_cast<int>(tiles.size());
+    std::vector<cv::Vec4d> tile_sums(n_tiles);
+    cv::parallel_for_(cv::Range(0, n_tiles), [&](const cv::Range &range)
+    {
+        std::vector<uchar> gray(in.cols);
+        for (int t = range.start; t < range.end; ++t)
+        {
+            std::uint64_t b = 0, g = 0, r = 0, n = 0;
+            for (int y = tiles[t].start; y < tiles[t].end; ++y)
+            {
+                const uchar *src = in.ptr<uchar>(y);
+                bgr_row_to_gray(src, &gray[0], in.cols);
+                for (int x = 0; x < in.cols; ++x)
+                    if (gray[x] >= threshold)
+                    {
+                        b += src[3 * x];
+                        g += src[3 * x + 1];
+                        r += src[3 * x + 2];
+                        ++n;
+                    }
+            }
+            tile_sums[t] = cv::Vec4d(double(b), double(g), double(r), double(n));
+        }
+    });
+
+    cv::Vec4d sums(0.0, 0.0, 0.0, 0.0);
+    for (int t = 0; t < n_tiles; ++t)
+        sums += tile_sums[t];
+    CV_Assert(sums[3] > 0.0);
+    return cv::Scalar(sums[0] / sums[3], sums[1] / sums[3], sums[2] / sums[3]);
+}
+
+cv::Mat fsiv_white_patch_color_balance_fused(cv::Mat const &in, float p)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(0.0f <= p && p <= 100.0f);
+    cv::Mat out;
+
+    const cv::Scalar from = fsiv_estimate_white_patch(in, p);
+    fsiv_color_rescaling_inplace(in, from, cv::Scalar(255, 255, 255), out);
+
+    CV_Assert(out.type() == in.type());
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    return out;
+}
+
+size_t fsiv_estimation_samples(double max_error, double delta)
+{
+    CV_Assert(max_error > 0.0);
+    CV_Assert(0.0 < delta && delta < 1.0);
+    return static_cast<size_t>(std::ceil(std::log(2.0 / delta) * 255.0 * 255.0 /
+                                         (2.0 * max_error * max_error)));
+}
+
+cv::Mat fsiv_sample_image(cv::Mat const &in, int method, double max_error)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(method >= FSIV_SAMPLING_STRIDED && method <= FSIV_SAMPLING_PYRAMID);
+    const size_t n = fsiv_estimation_samples(max_error);
+    if (in.total() <= n)
+        return in;
+    cv::Mat out;
+
+    if (method == FSIV_SAMPLING_STRIDED)
+    {
+        const int step = std::max(1, static_cast<int>(std::sqrt(double(in.total()) / n)));
+        out.create((in.rows + step - 1) / step, (in.cols + step - 1) / step, CV_8UC3);
+        for (int y = 0; y < out.rows; ++y)
+        {
+            const cv::Vec3b *src = in.ptr<cv::Vec3b>(y * step);
+            cv::Vec3b *dst = out.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < out.cols; ++x)
+                dst[x] = src[x * step];
+        }
+    }
+    else if (method == FSIV_SAMPLING_RANDOM)
+    {
+        cv::RNG rng(0x5eed);
+        out.create(1, static_cast<int>(n), CV_8UC3);
+        cv::Vec3b *dst = out.ptr<cv::Vec3b>(0);
+        for (size_t i = 0; i < n; ++i)
+            dst[i] = in.at<cv::Vec3b>(rng.uniform(0, in.rows), rng.uniform(0, in.cols));
+    }
+    else
+    {
+        out = in;
+        while (out.total() / 4 >= n)
+        {
+            cv::Mat down;
+            cv::pyrDown(out, down);
+            out = down;
+        }
+    }
+
+    CV_Assert(out.type() == in.type());
+    return out;
+}
+
+cv::Mat fsiv_gray_world_color_balance_approx(cv::Mat const &in, int method,
+                                             double max_error)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    cv::Mat out;
+
+    const cv::Scalar mn = cv::mean(fsiv_sample_image(in, method, max_error));
+    fsiv_color_rescaling_inplace(in, mn, cv::Scalar(128, 128, 128), out);
+
+    CV_Assert(out.type() == in.type());
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    return out;
+}
+
+cv::Mat fsiv_white_patch_color_balance_approx(cv::Mat const &in, float p,
+                                              int method, double max_error)
+{
+    CV_Assert(in.type() == CV_8UC3);
+    CV_Assert(0.0f <= p && p <= 100.0f);
+    cv::Mat out;
+
+    const cv::Scalar from = fsiv_estimate_white_patch(
+        fsiv_sample_image(in, method, max_error), p);
+    fsiv_color_rescaling_inplace(in, from, cv::Scalar(255, 255, 255), out);
+
+    CV_Assert(out.type() == in.type());
+    CV_Assert(out.rows == in.rows && out.cols == in.cols);
+    return out;
+}
+
+fsiv_illuminant_tracker::fsiv_illuminant_tracker(float p, int period,
+                                                 double smooth, double cut,
+                                                 double max_error)
+    : p_(p), period_(period), smooth_(smooth), cut_(cut),
+      max_error_(max_error), frames_(0), since_(0), estimations_(0),
+      cuts_(0), estimated_(false)
+{
+    CV_Assert(0.0f <= p && p <= 100.0f);
+    CV_Assert(period > 0);
+    CV_Assert(0.0 <= smooth && smooth < 1.0);
+    CV_Assert(max_error > 0.0);
+}
+
+void fsiv_illuminant_tracker::balance(cv::Mat const &frame, cv::Mat &out)
+{
+    CV_Assert(frame.type() == CV_8UC3);
+
+    const cv::Mat sample = fsiv_sample_image(frame, FSIV_SAMPLING_STRIDED, max_error_);
+    const cv::Scalar signature = cv::mean(sample);
+    double change = 0.0;
+    for (int c = 0; c < 3; ++c)
+        change = std::max(change, std::abs(signature[c] - signature_[c]));
+    const bool is_cut = frames_ > 0 && change > cut_;
+
+    estimated_ = frames_ == 0 || is_cut || since_ + 1 >= period_;
+    if (estimated_)
+    {
+        const cv::Scalar current = p_ < 100.0f
+                                       ? fsiv_estimate_white_patch(sample, p_)
+                                       : signature;
+        if (frames_ == 0 || is_cut)
+            illuminant_ = current;
+        else
+            illuminant_ = smooth_ * illuminant_ + (1.0 - smooth_) * current;
+        signature_ = signature;
+        since_ = 0;
+        ++estimations_;
+        cuts_ += is_cut;
+    }
+    else
+        ++since_;
+    ++frames_;
+
+    const cv::Scalar to = p_ < 100.0f ? cv::Scalar(255, 255, 255)
+                                      : cv::Scalar(128, 128, 128);
+    fsiv_color_rescaling_inplace(frame, illuminant_, to, out);
+
+    CV_Assert(out.type() == frame.type());
+    CV_Assert(out.rows == frame.rows && out.cols == frame.cols);
+}
@@ -1,6 +1,8 @@
 #pragma once
 #include <opencv2/core/core.hpp>
 
+#include "fsiv_histogram.hpp"
+
 /**
  * @brief Scale the color of an image so an input color is transformed into an output color.
  * @param in is the image to be rescaled.
@@ -13,6 +15,27 @@
 cv::Mat fsiv_color_rescaling(const cv::Mat &in, const cv::Scalar &from,
                              const cv::Scalar &to);
 
+/**
+ * @brief Scale the color of an image into a reusable output buffer.
+ *
+ * Same as fsiv_color_rescaling, but each channel factor to/from is
+ * applied as a Q16 fixed-point multiplier with saturating SIMD arithmetic
+ * over the packed BGR bytes, parallel by rows. The output is only
+ * (re)allocated when it does not have the input size and type, so a stream
+ * of frames allocates nothing after the first one, and it can be the input
+ * image itself (in-place).
+ *
+ * @param in is the image to be rescaled.
+ * @param from is the input color.
+ * @param to is the output color.
+ * @param out is the output image (it can be in).
+ * @pre in.type()==CV_8UC3
+ * @post out.type()==in.type() && out.size()==in.size()
+ * @warning A BGR color space is assumed for the input image.
+ */
+void fsiv_color_rescaling_inplace(const cv::Mat &in, const cv::Scalar &from,
+                                  const cv::Scalar &to, cv::Mat &out);
+
 /**
  * @brief Convert a BGR color image to Gray scale.
  * @param img is the input image.
@@ -45,6 +68,22 @@ cv::Mat fsiv_compute_image_histogram(cv::Mat const &img);
  */
 float fsiv_compute_histogram_percentile(cv::Mat const &hist, float p_value);
 
+/**
+ * @brief Compute the percentile index given a p_value of a cumulative histogram.
+ *
+ * It is a binary search in O(log bins), so the cumulative histogram can be
+ * built once and queried many times.
+ *
+ * @param cum the cumulative histogram.
+ * @param p_value the p_value
+ * @return the percentile index.
+ * @pre cum.bins()>0
+ * @pre 0<=p_value && p_value<=1.0
+ * @post 0<=ret_v && ret_v<cum.bins()
+ */
+float fsiv_compute_histogram_percentile(fsiv_cumulative_histogram const &cum,
+                                        float p_value);
+
 /**
  * @brief Apply a "gray world" color balance operation to the image.
  * @param[in] in is the input image.
@@ -63,3 +102,171 @@ cv::Mat fsiv_gray_world_color_balance(cv::Mat const &in);
  * @warning A BGR color space is assumed for the input image.
  */
 cv::Mat fsiv_white_patch_color_balance(cv::Mat const &in, float p);
+
+/**
+ * @brief Estimate the illuminant (the "white" color) for a white patch balance.
+ *
+ * It is fused in two passes over the packed BGR image, without temporary
+ * gray or mask images: the first pass computes the luminance (with the same
+ * fixed-point coefficients as cv::cvtColor) row by row and bins it while it
+ * is in cache (see fsiv_parallel_histogram_rows), and the second one
+ * recomputes it to accumulate the BGR sums of the pixels over the
+ * percentile threshold. Both passes are parallel over row tiles.
+ *
+ * @param[in] in is the input image.
+ * @param[in] p use this percentage of brighter pixels. Value p=0 means use the most brighter.
+ * @return the mean BGR color of the selected pixels.
+ * @pre in.type()==CV_8UC3
+ * @pre 0<=p && p<=100
+ */
+cv::Scalar fsiv_estimate_white_patch(cv::Mat const &in, float p);
+
+/**
+ * @brief Apply a "white patch" color balance operation to the image.
+ *
+ * As fsiv_white_patch_color_balance, but the illuminant is estimated with
+ * fsiv_estimate_white_patch and the image is rescaled with
+ * fsiv_color_rescaling_inplace. The Q16 factors and their rounding (half
+ * up instead of cv::multiply's half to even) make each channel value differ
+ * by at most 1 from fsiv_white_patch_color_balance.
+ *
+ * @param[in] in is the input image.
+ * @param[in] p use this percentage of brighter pixels. Value p=0 means use the most brighter.
+ * @return the color balanced image.
+ * @pre in.type()==CV_8UC3
+ * @warning A BGR color space is assumed for the input image.
+ */
+cv::Mat fsiv_white_patch_color_balance_fused(cv::Mat const &in, float p);
+
+/**
+ * @brief Pixel sampling methods for the approximate estimators.
+ */
+enum fsiv_sampling
+{
+    FSIV_SAMPLING_STRIDED = 0, // a regular grid of pixels.
+    FSIV_SAMPLING_RANDOM = 1,  // uniform random pixels (fixed seed).
+    FSIV_SAMPLING_PYRAMID = 2  // a pyrDown reduced image.
+};
+
+/**
+ * @brief Compute the number of samples needed to estimate a mean.
+ *
+ * By the Hoeffding inequality, with n uniform random samples of values in
+ * [0, 255] the sample mean is within max_error of the image mean with
+ * probability 1-delta when n >= ln(2/delta) * 255^2 / (2 * max_error^2).
+ * With the same n the sample percentiles are within max_error/255 of the
+ * image ones (DKW inequality).
+ *
+ * @param max_error is the error bound in gray levels.
+ * @param delta is the probability of exceeding the bound.
+ * @return the number of samples.
+ * @pre max_error>0 && 0<delta && delta<1
+ */
+size_t fsiv_estimation_samples(double max_error, double delta = 0.05);
+
+/**
+ * @brief Sample the pixels of an image to estimate its statistics.
+ * @param in is the input image.
+ * @param method is the sampling method (see fsiv_sampling).
+ * @param max_error is the error bound in gray levels (see fsiv_estimation_samples).
+ * @return the sampled pixels (in if the image has not more pixels than needed).
+ * @pre in.type()==CV_8UC3
+ * @warning the bound only holds for the random method, the strided and
+ * pyramid methods are heuristics with about the same number of samples.
+ * The pyramid method reads the whole image once to build the first level.
+ */
+cv::Mat fsiv_sample_image(cv::Mat const &in, int method, double max_error);
+
+/**
+ * @brief Apply an approximate "gray world" color balance operation to the image.
+ *
+ * The mean is estimated on a sample of the pixels (see fsiv_sample_image),
+ * so the full image is only processed to apply the rescaling.
+ *
+ * @param[in] in is the input image.
+ * @param[in] method is the sampling method (see fsiv_sampling).
+ * @param[in] max_error is the estimation error bound in gray levels.
+ * @return the color balanced image.
+ * @pre in.type()==CV_8UC3
+ */
+cv::Mat fsiv_gray_world_color_balance_approx(cv::Mat const &in, int method,
+                                             double max_error = 1.0);
+
+/**
+ * @brief Apply an approximate "white patch" color balance operation to the image.
+ *
+ * The illuminant is estimated on a sample of the pixels (see fsiv_sample_image),
+ * so the full image is only processed to apply the rescaling.
+ *
+ * @param[in] in is the input image.
+ * @param[in] p use this percentage of brighter pixels. Value p=0 means use the most brighter.
+ * @param[in] method is the sampling method (see fsiv_sampling).
+ * @param[in] max_error is the estimation error bound in gray levels.
+ * @return the color balanced image.
+ * @pre in.type()==CV_8UC3
+ */
+cv::Mat fsiv_white_patch_color_balance_approx(cv::Mat const &in, float p,
+                                              int method, double max_error = 1.0);
+
+/**
+ * @brief Illuminant tracker for the temporal (video) color balance.
+ *
+ * Each frame is reduced to a strided sample (see fsiv_sample_image) whose
+ * mean color is used as a cheap scene signature. The illuminant is only
+ * estimated on the sample every period frames or when the signature
+ * changes more than a scene cut threshold, and it is smoothed with an
+ * exponential filter (reset on scene cuts). The other frames only apply
+ * the cached factors with fsiv_color_rescaling_inplace.
+ */
+class fsiv_illuminant_tracker
+{
+public:
+    /**
+     * @brief Create a tracker.
+     * @param p use this percentage of brighter pixels (100 means gray world).
+     * @param period re-estimate the illuminant every period frames.
+     * @param smooth is the weight of the previous illuminant in the
+     *        exponential filter (0 means no smoothing).
+     * @param cut is the mean color change (gray levels) taken as a scene cut.
+     * @param max_error is the estimation error bound (see fsiv_sample_image).
+     * @pre 0<=p && p<=100
+     * @pre period>0
+     * @pre 0<=smooth && smooth<1
+     */
+    fsiv_illuminant_tracker(float p, int period = 15, double smooth = 0.8,
+                            double cut = 20.0, double max_error = 2.0);
+
+    /**
+     * @brief Balance the next frame of the stream.
+     * @param frame is the input frame.
+     * @param out is the output frame (it can be frame, it is reused).
+     * @pre frame.type()==CV_8UC3
+     */
+    void balance(cv::Mat const &frame, cv::Mat &out);
+
+    /** @brief The current (smoothed) illuminant. */
+    cv::Scalar illuminant() const { return illuminant_; }
+
+    /** @brief Whether the illuminant was estimated on the last frame. */
+    bool estimated() const { return estimated_; }
+
+    /** @brief Number of illuminant estimations done. */
+    long estimations() const { return estimations_; }
+
+    /** @brief Number of scene cuts detected. */
+    long cuts() const { return cuts_; }
+
+private:
+    float p_;
+    int period_;
+    double smooth_;
+    double cut_;
+    double max_error_;
+    long frames_;
+    long since_;
+    long estimations_;
+    long cuts_;
+    bool estimated_;
+    cv::Scalar signature_;
+    cv::Scalar illuminant_;
+};
@@ -0,0 +1,273 @@
+/**
+ * @file test_balance.cpp
+ * @brief Check the fast color balance kernels against the reference ones.
+ *
+ * The Q16 in-place rescaling rounds its factors and its results half up,
+ * while cv::multiply rounds half to even, so they may differ by 1. The
+ * cumulative histogram queries are compared with linear scans of the bins.
+ */
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "common_code.hpp"
+
+static int n_tests = 0;
+static int n_failed = 0;
+
+/**
+ * @brief Report a check.
+ */
+static void
+check(std::string const &name, bool ok, std::string const &detail = "")
+{
+    ++n_tests;
+    if (!ok)
+    {
+        ++n_failed;
+        std::cerr << "Test " << name << ": FAILED";
+        if (!detail.empty())
+            std::cerr << " (" << detail << ")";
+        std::cerr << std::endl;
+    }
+}
+
+/**
+ * @brief Check two byte images differ at most by max_diff.
+ */
+static void
+check_images(std::string const &name, cv::Mat const &result,
+             cv::Mat const &expected, double max_diff)
+{
+    if (result.type() != expected.type() || result.size() != expected.size())
+    {
+        check(name, false, "wrong size or type");
+        return;
+    }
+    const double diff = cv::norm(result, expected, cv::NORM_INF);
+    check(name, diff <= max_diff, cv::format("max. diff %g", diff));
+}
+
+/**
+ * @brief A random image with a few saturated pixels and flat regions, so
+ * there are ties of the brightest luminance.
+ */
+static cv::Mat
+test_image(cv::Size const &size)
+{
+    cv::Mat img(size, CV_8UC3);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(240));
+    cv::rectangle(img, cv::Rect(size.width / 4, size.height / 4,
+                                size.width / 4, size.height / 4),
+                  cv::Scalar(200, 120, 60), cv::FILLED);
+    img.at<cv::Vec3b>(size.height / 2, size.width - 1) = cv::Vec3b(255, 255, 255);
+    img.at<cv::Vec3b>(size.height - 1, 0) = cv::Vec3b(255, 255, 255);
+    return img;
+}
+
+/**
+ * @brief fsiv_estimate_white_patch and the fused balance against the
+ * reference (gray image, histogram, mask and cv::mean).
+ */
+static void
+test_white_patch(cv::Mat const &img)
+{
+    const std::string config = cv::format("%dx%d", img.cols, img.rows);
+    const float percents[] = {0.0f, 1.0f, 10.0f, 50.0f, 100.0f};
+    cv::Mat gray;
+    cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
+    for (float p : percents)
+    {
+        const std::string pconfig = config + cv::format(" p=%g", p);
+        cv::Scalar expected;
+        if (p == 0.0f)
+        {
+            cv::Point max_loc;
+            cv::minMaxLoc(gray, nullptr, nullptr, nullptr, &max_loc);
+            expected = cv::Scalar(img.at<cv::Vec3b>(max_loc));
+        }
+        else
+        {
+            const float thr = fsiv_compute_histogram_percentile(
+                fsiv_compute_image_histogram(gray), 1 - p / 100.0);
+            expected = cv::mean(img, gray >= thr);
+        }
+        const cv::Scalar result = fsiv_estimate_white_patch(img, p);
+        const double diff = cv::norm(result - expected, cv::NORM_INF);
+        check("fsiv_estimate_white_patch " + pconfig, diff <= 1.0e-9,
+              cv::format("max. diff %g", diff));
+
+        check_images("fsiv_white_patch_color_balance_fused " + pconfig,
+                     fsiv_white_patch_color_balance_fused(img, p),
+                     fsiv_white_patch_color_balance(img, p), 1.0);
+    }
+}
+
+/**
+ * @brief fsiv_color_rescaling_inplace against fsiv_color_rescaling.
+ */
+static void
+test_rescaling(cv::Mat const &img)
+{
+    const std::string config = cv::format("%dx%d", img.cols, img.rows);
+    // Factors below and above 1, a large one (saturated) and a zero divisor.
+    const cv::Scalar froms[] = {cv::Scalar(200, 100, 50), cv::Scalar(1, 255, 0),
+                                cv::Scalar(37.5, 128.25, 254.9)};
+    const cv::Scalar tos[] = {cv::Scalar(255, 255, 255), cv::Scalar(128, 64, 32),
+                              cv::Scalar(12.3, 200, 255)};
+    for (int f = 0; f < 3; ++f)
+        for (int t = 0; t < 3; ++t)
+        {
+            const std::string fconfig = config + cv::format(" from=%d to=%d", f, t);
+            const cv::Mat expected = fsiv_color_rescaling(img, froms[f], tos[t]);
+
+            cv::Mat out;
+            fsiv_color_rescaling_inplace(img, froms[f], tos[t], out);
+            check_images("fsiv_color_rescaling_inplace " + fconfig, out,
+                         expected, 1.0);
+
+            // The output buffer is reused.
+            const uchar *data = out.data;
+            fsiv_color_rescaling_inplace(img, froms[f], tos[t], out);
+            check("fsiv_color_rescaling_inplace " + fconfig + " reuse",
+                  out.data == data);
+
+            cv::Mat inplace = img.clone();
+            fsiv_color_rescaling_inplace(inplace, froms[f], tos[t], inplace);
+            check_images("fsiv_color_rescaling_inplace " + fconfig + " in place",
+                         inplace, expected, 1.0);
+        }
+}
+
+/**
+ * @brief Percentile index by a linear scan of the bins.
+ */
+static int
+linear_percentile(std::vector<double> const &counts, float p_value)
+{
+    double total = 0.0;
+    for (double c : counts)
+        total += c;
+    const float target = p_value * static_cast<float>(total);
+    double acc = 0.0;
+    for (size_t i = 0; i < counts.size(); ++i)
+    {
+        acc += counts[i];
+        if (static_cast<float>(acc) >= target)
+            return static_cast<int>(i);
+    }
+    return static_cast<int>(counts.size()) - 1;
+}
+
+/**
+ * @brief Compare a cumulative histogram with the counts it should hold.
+ */
+static void
+check_cumulative(std::string const &name, fsiv_cumulative_histogram const &cum,
+                 std::vector<double> const &counts)
+{
+    double acc = 0.0;
+    bool prefix_ok = cum.bins() == static_cast<int>(counts.size());
+    for (size_t i = 0; prefix_ok && i < counts.size(); ++i)
+    {
+        acc += counts[i];
+        prefix_ok = cum.count(int(i)) == counts[i] && cum.prefix(int(i)) == acc;
+    }
+    check(name + " prefix", prefix_ok && cum.total() == acc && cum.prefix(-1) == 0.0);
+
+    const float p_values[] = {0.0f, 0.001f, 0.25f, 0.5f, 0.9f, 0.99f, 1.0f};
+    for (float p : p_values)
+    {
+        const int expected = linear_percentile(counts, p);
+        const int result = static_cast<int>(fsiv_compute_histogram_percentile(cum, p));
+        check(name + cv::format(" percentile %g", p), result == expected,
+              cv::format("%d != %d", result, expected));
+    }
+}
+
+/**
+ * @brief fsiv_cumulative_histogram against linear scans of the bins.
+ */
+static void
+test_cumulative_histogram(int bins)
+{
+    const std::string config = cv::format("bins=%d", bins);
+    cv::RNG &rng = cv::theRNG();
+    cv::Mat hist(bins, 1, CV_32FC1);
+    std::vector<double> counts(bins);
+    for (int i = 0; i < bins; ++i)
+    {
+        // Some empty bins, so several prefix sums are equal.
+        counts[i] = rng.uniform(0, 4) == 0 ? 0.0 : rng.uniform(0, 1000);
+        hist.at<float>(i) = static_cast<float>(counts[i]);
+    }
+
+    fsiv_cumulative_histogram cum(hist);
+    check_cumulative("fsiv_cumulative_histogram " + config, cum, counts);
+    for (float p = 0.0f; p <= 1.0f; p += 0.125f)
+        check("fsiv_compute_histogram_percentile " + config + cv::format(" %g", p),
+              int(fsiv_compute_histogram_percentile(hist, p)) ==
+                  linear_percentile(counts, p));
+
+    // Incremental updates.
+    for (int i = 0; i < 50; ++i)
+    {
+        const int idx = rng.uniform(0, bins);
+        const double n = rng.uniform(0, 20);
+        if (rng.uniform(0, 2) == 0)
+        {
+            cum.add(idx, n);
+            counts[idx] += n;
+        }
+        else
+        {
+            const double m = std::min(n, counts[idx]);
+            cum.remove(idx, m);
+            counts[idx] -= m;
+        }
+    }
+    check_cumulative("fsiv_cumulative_histogram " + config + " updated", cum, counts);
+
+    // An empty histogram.
+    hist.setTo(cv::Scalar::all(0));
+    counts.assign(bins, 0.0);
+    check_cumulative("fsiv_cumulative_histogram " + config + " empty",
+                     fsiv_cumulative_histogram(hist), counts);
+}
+
+int
+main(int, char **)
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        cv::theRNG().state = 0x12345678;
+        const cv::Size sizes[] = {cv::Size(1, 1), cv::Size(37, 23),
+                                  cv::Size(640, 480), cv::Size(1031, 517)};
+        for (cv::Size const &size : sizes)
+        {
+            const cv::Mat img = test_image(size);
+            test_white_patch(img);
+            test_rescaling(img);
+        }
+        const int bins[] = {1, 2, 7, 64, 256, 1000};
+        for (int b : bins)
+            test_cumulative_histogram(b);
+        std::cout << n_tests - n_failed << "/" << n_tests << " tests passed."
+                  << std::endl;
+        if (n_failed > 0)
+            retCode = EXIT_FAILURE;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
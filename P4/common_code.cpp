@@ -10,6 +10,15 @@
  */
 #include "common_code.hpp"
 #include <opencv2/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
 
 cv::Mat
 fsiv_create_box_filter(const int r)
@@ -80,6 +89,502 @@ fsiv_circular_expansion(cv::Mat const &in, const int r)
     return ret_v;
 }
 
+/**
+ * @brief Map an index outside [0, n) with a zero (-1) or a wrap border.
+ */
+static inline int
+border_index(int i, int n, bool circular)
+{
+    if (i >= 0 && i < n)
+        return i;
+    if (!circular)
+        return -1;
+    i %= n;
+    return i < 0 ? i + n : i;
+}
+
+/**
+ * @brief Row sink that keeps the filtered rows in an image.
+ *
+ * The same size filters write each output row in row(y) and call
+ * done(y, x0, x1) when its columns [x0, x1) are final.
+ */
+struct store_rows
+{
+    explicit store_rows(cv::Mat &out_) : out(out_) {}
+    float *row(int y) const { return out.ptr<float>(y); }
+    void done(int, int, int) const {}
+    cv::Mat &out;
+};
+
+/**
+ * @brief Row sink that does the unsharp mask enhance of the blurred rows
+ * while they are in cache: mask = in - blurred and out = in + g * mask.
+ * The blurred row is written in the output row and overwritten in place.
+ */
+struct usm_rows
+{
+    usm_rows(cv::Mat const &in_, cv::Mat &out_, cv::Mat *mask_, double g_)
+        : in(in_), out(out_), mask(mask_), g(static_cast<float>(g_)) {}
+    float *row(int y) const { return out.ptr<float>(y); }
+    void done(int y, int x0, int x1) const
+    {
+        const float *src = in.ptr<float>(y);
+        float *dst = out.ptr<float>(y);
+        if (mask)
+        {
+            float *m = mask->ptr<float>(y);
+            for (int x = x0; x < x1; ++x)
+            {
+                m[x] = src[x] - dst[x];
+                dst[x] = src[x] + g * m[x];
+            }
+        }
+        else
+            for (int x = x0; x < x1; ++x)
+                dst[x] = src[x] + g * (src[x] - dst[x]);
+    }
+    cv::Mat const &in;
+    cv::Mat &out;
+    cv::Mat *mask;
+    const float g;
+};
+
+/**
+ * @brief dst[x] = sum_j src[x+j] * k[j], x in [0, w).
+ */
+static void
+correlate_row(const float *src, const float *k, int n, float *dst, int w)
+{
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_float32::nlanes;
+    for (; x <= w - lanes; x += lanes)
+    {
+        cv::v_float32 acc = cv::vx_setzero_f32();
+        for (int j = 0; j < n; ++j)
+            acc = cv::v_muladd(cv::vx_load(src + x + j), cv::vx_setall_f32(k[j]), acc);
+        cv::v_store(dst + x, acc);
+    }
+#endif
+    for (; x < w; ++x)
+    {
+        float sum = 0.0f;
+        for (int j = 0; j < n; ++j)
+            sum += src[x + j] * k[j];
+        dst[x] = sum;
+    }
+}
+
+/**
+ * @brief dst[x] = sum_i src[i*stride+x] * k[i], x in [0, w).
+ */
+static void
+correlate_column(const float *src, size_t stride, const float *k, int n,
+                 float *dst, int w)
+{
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_float32::nlanes;
+    for (; x <= w - lanes; x += lanes)
+    {
+        cv::v_float32 acc = cv::vx_setzero_f32();
+        for (int i = 0; i < n; ++i)
+            acc = cv::v_muladd(cv::vx_load(src + i * stride + x), cv::vx_setall_f32(k[i]), acc);
+        cv::v_store(dst + x, acc);
+    }
+#endif
+    for (; x < w; ++x)
+    {
+        float sum = 0.0f;
+        for (int i = 0; i < n; ++i)
+            sum += src[i * stride + x] * k[i];
+        dst[x] = sum;
+    }
+}
+
+/**
+ * @brief dst[x] = sum_i rows[i][x] * k[i], x in [0, w). Null rows are zeros.
+ */
+static void
+correlate_column_rows(const float *const *rows, const float *k, int n,
+                      float *dst, int w)
+{
+    int x = 0;
+#if CV_SIMD
+    const int lanes = cv::v_float32::nlanes;
+    for (; x <= w - lanes; x += lanes)
+    {
+        cv::v_float32 acc = cv::vx_setzero_f32();
+        for (int i = 0; i < n; ++i)
+            if (rows[i])
+                acc = cv::v_muladd(cv::vx_load(rows[i] + x), cv::vx_setall_f32(k[i]), acc);
+        cv::v_store(dst + x, acc);
+    }
+#endif
+    for (; x < w; ++x)
+    {
+        float sum = 0.0f;
+        for (int i = 0; i < n; ++i)
+            if (rows[i])
+                sum += rows[i][x] * k[i];
+        dst[x] = sum;
+    }
+}
+
+/**
+ * @brief Same size row correlation of the columns [x0, x1) of a row.
+ * The columns whose window is inside the row use correlate_row, the edge
+ * ones read the outside pixels as zeros or wrapped around.
+ */
+static void
+correlate_row_border(const float *src, int cols, const float *k, int n,
+                     bool circular, float *dst, int x0, int x1)
+{
+    const int r = n / 2;
+    const int a = std::min(std::max(x0, r), x1);
+    const int b = std::max(a, std::min(x1, cols - r));
+    const auto edge = [&](int x)
+    {
+        float sum = 0.0f;
+        for (int j = 0; j < n; ++j)
+        {
+            const int sx = border_index(x - r + j, cols, circular);
+            if (sx >= 0)
+                sum += src[sx] * k[j];
+        }
+        dst[x - x0] = sum;
+    };
+    for (int x = x0; x < a; ++x)
+        edge(x);
+    for (int x = b; x < x1; ++x)
+        edge(x);
+    if (a < b)
+        correlate_row(src + a - r, k, n, dst + (a - x0), b - a);
+}
+
+bool
+fsiv_separate_filter(cv::Mat const &filter, cv::Mat &kx, cv::Mat &ky)
+{
+    CV_Assert(!filter.empty() && filter.type() == CV_32FC1);
+
+    // A rank 1 filter is the outer product of its column and row through
+    // the largest coefficient.
+    double max_v;
+    cv::Point pivot;
+    cv::minMaxLoc(cv::abs(filter), nullptr, &max_v, nullptr, &pivot);
+    if (max_v == 0.0)
+        return false;
+    ky = filter.col(pivot.x).clone();
+    kx = filter.row(pivot.y) / filter.at<float>(pivot);
+    const cv::Mat rebuilt = ky * kx;
+    return cv::norm(filter, rebuilt, cv::NORM_INF) <= 1.0e-6 * max_v;
+}
+
+cv::Mat
+fsiv_filter2D_separable(cv::Mat const &in, cv::Mat const &kx, cv::Mat const &ky)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(kx.type() == CV_32FC1 && kx.rows == 1 && kx.cols % 2 == 1);
+    CV_Assert(ky.type() == CV_32FC1 && ky.cols == 1 && ky.rows % 2 == 1);
+    CV_Assert(in.rows >= ky.rows && in.cols >= kx.cols);
+    cv::Mat ret_v;
+
+    const int kw = kx.cols;
+    const int kh = ky.rows;
+    ret_v.create(in.rows - kh + 1, in.cols - kw + 1, CV_32FC1);
+    const cv::Mat hx = kx.isContinuous() ? kx : kx.clone();
+    const cv::Mat hy = ky.isContinuous() ? ky : ky.clone();
+
+    // Each band computes the row pass of its rows (plus the kh-1 below) for
+    // a block of columns, so the intermediate rows stay in cache for the
+    // column pass. Bands are high enough to amortize the extra rows.
+    const int block = 512;
+    const int band = std::max(64, 2 * kh);
+    cv::parallel_for_(cv::Range(0, ret_v.rows), [&](const cv::Range &r)
+    {
+        const int tmp_rows = r.end - r.start + kh - 1;
+        std::vector<float> tmp(size_t(tmp_rows) * block);
+        for (int xb = 0; xb < ret_v.cols; xb += block)
+        {
+            const int w = std::min(block, ret_v.cols - xb);
+            for (int y = 0; y < tmp_rows; ++y)
+                correlate_row(in.ptr<float>(r.start + y) + xb, hx.ptr<float>(),
+                              kw, &tmp[size_t(y) * block], w);
+            for (int y = r.start; y < r.end; ++y)
+                correlate_column(&tmp[size_t(y - r.start) * block], block,
+                                 hy.ptr<float>(), kh, ret_v.ptr<float>(y) + xb, w);
+        }
+    }, std::max(1.0, double(ret_v.rows) / band));
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * (ky.rows / 2));
+    CV_Assert(ret_v.cols == in.cols - 2 * (kx.cols / 2));
+    return ret_v;
+}
+
+// Cost model of the convolution methods. It is measured on first use
+// unless it was set (or calibrated) before, see fsiv_filter2D_calibrate.
+static std::mutex costs_mutex;
+static std::once_flag costs_once;
+static fsiv_filter2D_costs costs;
+
+static fsiv_filter2D_costs measure_costs();
+
+fsiv_filter2D_costs
+fsiv_filter2D_get_costs()
+{
+    std::call_once(costs_once, []()
+    {
+        const fsiv_filter2D_costs c = measure_costs();
+        std::lock_guard<std::mutex> lock(costs_mutex);
+        costs = c;
+    });
+    std::lock_guard<std::mutex> lock(costs_mutex);
+    return costs;
+}
+
+void
+fsiv_filter2D_set_costs(fsiv_filter2D_costs const &c)
+{
+    CV_Assert(c.direct_tap > 0.0 && c.separable_tap > 0.0);
+    CV_Assert(c.fft_unit > 0.0 && c.fft_point > 0.0);
+    // Costs set before the first use are not measured again.
+    std::call_once(costs_once, []() {});
+    std::lock_guard<std::mutex> lock(costs_mutex);
+    costs = c;
+}
+
+/**
+ * @brief Tiling of a frequency domain correlation: dy x dx spectra whose
+ * tiles give ty x tx output pixels each.
+ */
+struct fft_plan
+{
+    int dy, dx, ty, tx;
+    double cost;
+};
+
+/**
+ * @brief Find the cheapest tiling of an output with a kh x kw filter.
+ *
+ * A tile of t output pixels needs a spectrum of d >= t+k-1 points, so big
+ * spectra waste less on the halo but cost more per point (d log d).
+ */
+static fft_plan
+plan_fft(cv::Size const &out, cv::Size const &filter, fsiv_filter2D_costs const &c)
+{
+    // Tiles of 16, 32, ... pixels up to the whole output.
+    std::vector<int> dy, dx;
+    for (int n = 16;; n *= 2)
+    {
+        dy.push_back(cv::getOptimalDFTSize(std::min(n, out.height) + filter.height - 1));
+        if (n >= out.height || n >= 2048)
+            break;
+    }
+    for (int n = 16;; n *= 2)
+    {
+        dx.push_back(cv::getOptimalDFTSize(std::min(n, out.width) + filter.width - 1));
+        if (n >= out.width || n >= 2048)
+            break;
+    }
+    fft_plan best = {0, 0, 0, 0, HUGE_VAL};
+    for (size_t i = 0; i < dy.size(); ++i)
+        for (size_t j = 0; j < dx.size(); ++j)
+        {
+            const int ty = std::min(dy[i] - filter.height + 1, out.height);
+            const int tx = std::min(dx[j] - filter.width + 1, out.width);
+            const double tiles = double((out.height + ty - 1) / ty) *
+                                 ((out.width + tx - 1) / tx);
+            const double points = double(dy[i]) * dx[j];
+            const double cost = tiles * points *
+                                (2.0 * c.fft_unit * std::log2(points) + c.fft_point);
+            if (cost < best.cost)
+                best = {dy[i], dx[j], ty, tx, cost};
+        }
+    return best;
+}
+
+/**
+ * @brief Spectrum of a filter placed at the origin of a dy x dx image.
+ *
+ * The spectra are cached by size and coefficients, so repeated calls with
+ * the same filter (the interactive tool, a batch) only transform the tiles.
+ */
+static cv::Mat
+filter_spectrum(cv::Mat const &filter, int dy, int dx)
+{
+    // The cache keeps the most recently added spectra up to a total size.
+    static const size_t max_bytes = size_t(64) << 20;
+    static std::mutex mutex;
+    static std::map<std::string, cv::Mat> cache;
+    static std::deque<std::string> order;
+    static size_t bytes = 0;
+
+    const int dims[] = {dy, dx, filter.rows, filter.cols};
+    std::string key(reinterpret_cast<const char *>(dims), sizeof(dims));
+    for (int i = 0; i < filter.rows; ++i)
+        key.append(filter.ptr<char>(i), filter.cols * sizeof(float));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        const std::map<std::string, cv::Mat>::const_iterator it = cache.find(key);
+        if (it != cache.end())
+            return it->second;
+    }
+    cv::Mat padded = cv::Mat::zeros(dy, dx, CV_32FC1);
+    filter.copyTo(padded(cv::Rect(0, 0, filter.cols, filter.rows)));
+    cv::Mat spectrum;
+    cv::dft(padded, spectrum, 0, filter.rows);
+
+    const size_t size = spectrum.total() * spectrum.elemSize();
+    if (size > max_bytes)
+        return spectrum;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (cache.count(key))
+        return spectrum;
+    while (bytes + size > max_bytes)
+    {
+        const cv::Mat &old = cache[order.front()];
+        bytes -= old.total() * old.elemSize();
+        cache.erase(order.front());
+        order.pop_front();
+    }
+    cache[key] = spectrum;
+    order.push_back(key);
+    bytes += size;
+    return spectrum;
+}
+
+/**
+ * @brief Correlation in the frequency domain by tiles (overlap-save).
+ *
+ * out(y, x) = sum_ij in(y+oy+i, x+ox+j) * filter(i, j) for an output of
+ * size out, reading the pixels outside the input as zeros or wrapped around
+ * if circular. Each output tile transforms its input block (with the
+ * halo), multiplies it by the conjugated filter spectrum and keeps the part
+ * of the inverse transform not aliased by the circular correlation, so the
+ * tiles are independent and run in parallel.
+ */
+template <class Sink>
+static void
+fft_correlate(cv::Mat const &in, cv::Mat const &filter, int oy, int ox,
+              bool circular, cv::Size const &out, Sink const &sink)
+{
+    const fft_plan plan = plan_fft(out, filter.size(), fsiv_filter2D_get_costs());
+    const cv::Mat spectrum = filter_spectrum(filter, plan.dy, plan.dx);
+    const int nty = (out.height + plan.ty - 1) / plan.ty;
+    const int ntx = (out.width + plan.tx - 1) / plan.tx;
+    cv::parallel_for_(cv::Range(0, nty * ntx), [&](const cv::Range &r)
+    {
+        cv::Mat block(plan.dy, plan.dx, CV_32FC1), freq, corr;
+        for (int t = r.start; t < r.end; ++t)
+        {
+            const int y0 = (t / ntx) * plan.ty;
+            const int x0 = (t % ntx) * plan.tx;
+            const int h = std::min(plan.ty, out.height - y0);
+            const int w = std::min(plan.tx, out.width - x0);
+            const int bh = h + filter.rows - 1;
+            const int bw = w + filter.cols - 1;
+            const int xs = x0 + ox;
+            block.setTo(0.0f);
+            for (int i = 0; i < bh; ++i)
+            {
+                const int sy = border_index(y0 + oy + i, in.rows, circular);
+                if (sy < 0)
+                    continue;
+                const float *src = in.ptr<float>(sy);
+                float *dst = block.ptr<float>(i);
+                if (xs >= 0 && xs + bw <= in.cols)
+                    std::copy(src + xs, src + xs + bw, dst);
+                else
+                    for (int j = 0; j < bw; ++j)
+                    {
+                        const int sx = border_index(xs + j, in.cols, circular);
+                        if (sx >= 0)
+                            dst[j] = src[sx];
+                    }
+            }
+            cv::dft(block, freq, 0, bh);
+            cv::mulSpectrums(freq, spectrum, freq, 0, true);
+            cv::dft(freq, corr, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT, h);
+            for (int i = 0; i < h; ++i)
+            {
+                const float *src = corr.ptr<float>(i);
+                std::copy(src, src + w, sink.row(y0 + i) + x0);
+                sink.done(y0 + i, x0, x0 + w);
+            }
+        }
+    });
+}
+
+/**
+ * @brief Direct "valid" correlation (see fsiv_filter2D).
+ *
+ * It keeps the rounding of the scalar loop: the products are added in the
+ * same order (no fused multiply-add).
+ */
+static cv::Mat
+filter2D_direct(cv::Mat const &in, cv::Mat const &filter)
+{
+    cv::Mat ret_v(in.rows - 2 * (filter.rows / 2), in.cols - 2 * (filter.cols / 2), CV_32FC1);
+    const cv::Mat f = filter.isContinuous() ? filter : filter.clone();
+    cv::parallel_for_(cv::Range(0, ret_v.rows), [&](const cv::Range &r)
+    {
+        for (int i = r.start; i < r.end; ++i)
+        {
+            float *dst = ret_v.ptr<float>(i);
+            int j = 0;
+#if CV_SIMD
+            const int lanes = cv::v_float32::nlanes;
+            for (; j <= ret_v.cols - lanes; j += lanes)
+            {
+                cv::v_float32 sum = cv::vx_setzero_f32();
+                for (int fi = 0; fi < f.rows; fi++)
+                {
+                    const float *src = in.ptr<float>(i + fi) + j;
+                    const float *k = f.ptr<float>(fi);
+                    for (int fj = 0; fj < f.cols; fj++)
+                        sum = sum + cv::vx_load(src + fj) * cv::vx_setall_f32(k[fj]);
+                }
+                cv::v_store(dst + j, sum);
+            }
+#endif
+            for (; j < ret_v.cols; ++j)
+            {
+                float sum = 0.0f;
+                for (int fi = 0; fi < f.rows; fi++)
+                {
+                    const float *src = in.ptr<float>(i + fi) + j;
+                    const float *k = f.ptr<float>(fi);
+                    for (int fj = 0; fj < f.cols; fj++)
+                        sum += src[fj] * k[fj];
+                }
+                dst[j] = sum;
+            }
+        }
+    });
+    return ret_v;
+}
+
+fsiv_filter2D_method
+fsiv_filter2D_select(cv::Size const &out, cv::Size const &filter, bool separable)
+{
+    CV_Assert(out.area() > 0 && filter.area() > 0);
+    const fsiv_filter2D_costs c = fsiv_filter2D_get_costs();
+    const double pixels = double(out.area());
+
+    fsiv_filter2D_method method = FSIV_FILTER2D_DIRECT;
+    double cost = pixels * filter.area() * c.direct_tap;
+    if (separable && pixels * (filter.width + filter.height) * c.separable_tap < cost)
+    {
+        method = FSIV_FILTER2D_SEPARABLE;
+        cost = pixels * (filter.width + filter.height) * c.separable_tap;
+    }
+    if (plan_fft(out, filter, c).cost < cost)
+        method = FSIV_FILTER2D_FFT;
+    return method;
+}
+
 cv::Mat
 fsiv_filter2D(cv::Mat const &in, cv::Mat const &filter)
 {
@@ -87,24 +592,526 @@ fsiv_filter2D(cv::Mat const &in, cv::Mat const &filter)
     CV_Assert(in.type() == CV_32FC1 && filter.type() == CV_32FC1);
     cv::Mat ret_v;
 
-    ret_v = cv::Mat::zeros(in.rows - 2 * (filter.rows / 2), in.cols - 2 * (filter.cols / 2), CV_32FC1);
+    // Up to 5x5 the direct pass is about as fast as the others and it keeps
+    // the rounding of the scalar loop. Larger filters use the cheapest
+    // method of the cost model.
+    const cv::Size out(in.cols - 2 * (filter.cols / 2), in.rows - 2 * (filter.rows / 2));
+    cv::Mat kx, ky;
+    const bool large = filter.rows * filter.cols > 25;
+    const bool separable = large && filter.rows % 2 == 1 &&
+                           filter.cols % 2 == 1 && fsiv_separate_filter(filter, kx, ky);
+    const fsiv_filter2D_method method =
+        large ? fsiv_filter2D_select(out, filter.size(), separable) : FSIV_FILTER2D_DIRECT;
+    if (method == FSIV_FILTER2D_SEPARABLE)
+        ret_v = fsiv_filter2D_separable(in, kx, ky);
+    else if (method == FSIV_FILTER2D_FFT)
+        ret_v = fsiv_filter2D_fft(in, filter);
+    else
+        ret_v = filter2D_direct(in, filter);
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * (filter.rows / 2));
+    CV_Assert(ret_v.cols == in.cols - 2 * (filter.cols / 2));
+    return ret_v;
+}
+
+cv::Mat
+fsiv_filter2D_fft(cv::Mat const &in, cv::Mat const &filter)
+{
+    CV_Assert(!in.empty() && !filter.empty());
+    CV_Assert(in.type() == CV_32FC1 && filter.type() == CV_32FC1);
+    CV_Assert(in.rows >= filter.rows && in.cols >= filter.cols);
+    cv::Mat ret_v(in.rows - 2 * (filter.rows / 2), in.cols - 2 * (filter.cols / 2), CV_32FC1);
+
+    fft_correlate(in, filter, 0, 0, false, ret_v.size(), store_rows(ret_v));
 
-    for (int i = filter.rows / 2; i < in.rows - filter.rows / 2; i++) {
-        for (int j = filter.cols / 2; j < in.cols - filter.cols / 2; j++) {
-            float sum = 0.0f;
-            for (int fi = 0; fi < filter.rows; fi++) {
-                for (int fj = 0; fj < filter.cols; fj++) {
-                    sum += in.at<float>(i + fi - filter.rows / 2, j + fj - filter.cols / 2) *
-                           filter.at<float>(fi, fj);
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * (filter.rows / 2));
+    CV_Assert(ret_v.cols == in.cols - 2 * (filter.cols / 2));
+    return ret_v;
+}
+
+/**
+ * @brief Best of some runs of a function, in ns.
+ */
+template <class Fn>
+static double
+time_ns(Fn fn)
+{
+    double best = HUGE_VAL;
+    for (int i = 0; i < 3; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double, std::nano>(
+                                  std::chrono::steady_clock::now() - t0).count());
+    }
+    return best;
+}
+
+/**
+ * @brief Measure the cost model in this machine.
+ */
+static fsiv_filter2D_costs
+measure_costs()
+{
+    fsiv_filter2D_costs c;
+    cv::Mat img(512, 512, CV_32FC1);
+    cv::randu(img, 0.0f, 1.0f);
+
+    // A non separable filter for the direct pass and a gaussian for the
+    // separable one.
+    cv::Mat filter(9, 9, CV_32FC1);
+    cv::randu(filter, 0.0f, 1.0f);
+    const double out = double(img.rows - 8) * (img.cols - 8);
+    c.direct_tap = time_ns([&]() { filter2D_direct(img, filter); }) / (out * 81);
+
+    const cv::Mat k = cv::getGaussianKernel(31, -1, CV_32F);
+    const cv::Mat kx = k.t();
+    const double sep_out = double(img.rows - 30) * (img.cols - 30);
+    c.separable_tap = time_ns([&]() { fsiv_filter2D_separable(img, kx, k); }) /
+                      (sep_out * 62);
+
+    // The tiles are transformed in parallel, so the dft is timed in the
+    // same way.
+    const int n = 256;
+    const double points = double(n) * n;
+    const int tiles = std::max(1, cv::getNumThreads());
+    std::vector<cv::Mat> blocks(tiles), freqs(tiles), products(tiles);
+    for (int t = 0; t < tiles; ++t)
+        blocks[t] = img(cv::Rect(0, 0, n, n)).clone();
+    c.fft_unit = time_ns([&]()
+    {
+        cv::parallel_for_(cv::Range(0, tiles), [&](const cv::Range &r)
+        {
+            for (int t = r.start; t < r.end; ++t)
+                cv::dft(blocks[t], freqs[t]);
+        });
+    }) / (tiles * points * std::log2(points));
+    c.fft_point = time_ns([&]()
+    {
+        cv::parallel_for_(cv::Range(0, tiles), [&](const cv::Range &r)
+        {
+            for (int t = r.start; t < r.end; ++t)
+            {
+                blocks[t].setTo(0.0f);
+                cv::mulSpectrums(freqs[t], freqs[t], products[t], 0, true);
+            }
+        });
+    }) / (tiles * points);
+    // Guard against a timer too coarse for a stage.
+    const fsiv_filter2D_costs defaults;
+    if (!(c.direct_tap > 0.0))
+        c.direct_tap = defaults.direct_tap;
+    if (!(c.separable_tap > 0.0))
+        c.separable_tap = defaults.separable_tap;
+    if (!(c.fft_unit > 0.0))
+        c.fft_unit = defaults.fft_unit;
+    if (!(c.fft_point > 0.0))
+        c.fft_point = defaults.fft_point;
+    return c;
+}
+
+fsiv_filter2D_costs
+fsiv_filter2D_calibrate()
+{
+    const fsiv_filter2D_costs c = measure_costs();
+    fsiv_filter2D_set_costs(c);
+    return c;
+}
+
+/**
+ * @brief Same size correlation (see fsiv_filter2D_same) writing the rows in a sink.
+ */
+template <class Sink>
+static void
+filter2D_same_rows(cv::Mat const &in, cv::Mat const &filter, bool circular,
+                   Sink const &sink)
+{
+    const int ry = filter.rows / 2;
+    const int rx = filter.cols / 2;
+    cv::Mat kx, ky;
+    const bool large = filter.rows * filter.cols > 25;
+    const bool separable = large && fsiv_separate_filter(filter, kx, ky);
+    const fsiv_filter2D_method method =
+        large ? fsiv_filter2D_select(in.size(), filter.size(), separable) : FSIV_FILTER2D_DIRECT;
+    if (method == FSIV_FILTER2D_FFT)
+    {
+        // The border (zeros or wrapped around) is read when loading the
+        // tile blocks.
+        fft_correlate(in, filter, -ry, -rx, circular, in.size(), sink);
+    }
+    else if (method == FSIV_FILTER2D_SEPARABLE)
+    {
+        // Row pass of the band rows (and the ry above and below, read with
+        // the border) by blocks of columns, then the column pass.
+        const cv::Mat hx = kx.isContinuous() ? kx : kx.clone();
+        const cv::Mat hy = ky.isContinuous() ? ky : ky.clone();
+        const int kh = filter.rows;
+        const int block = 512;
+        const int band = std::max(64, 2 * kh);
+        cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &r)
+        {
+            const int tmp_rows = r.end - r.start + kh - 1;
+            std::vector<float> tmp(size_t(tmp_rows) * block);
+            std::vector<char> present(tmp_rows);
+            std::vector<const float *> rows(kh);
+            for (int xb = 0; xb < in.cols; xb += block)
+            {
+                const int w = std::min(block, in.cols - xb);
+                for (int t = 0; t < tmp_rows; ++t)
+                {
+                    const int sy = border_index(r.start - ry + t, in.rows, circular);
+                    present[t] = sy >= 0;
+                    if (sy >= 0)
+                        correlate_row_border(in.ptr<float>(sy), in.cols, hx.ptr<float>(),
+                                             filter.cols, circular,
+                                             &tmp[size_t(t) * block], xb, xb + w);
+                }
+                for (int y = r.start; y < r.end; ++y)
+                {
+                    for (int i = 0; i < kh; ++i)
+                    {
+                        const int t = y - r.start + i;
+                        rows[i] = present[t] ? &tmp[size_t(t) * block] : nullptr;
+                    }
+                    correlate_column_rows(&rows[0], hy.ptr<float>(), kh,
+                                          sink.row(y) + xb, w);
+                    sink.done(y, xb, xb + w);
                 }
             }
-            ret_v.at<float>(i - filter.rows / 2, j - filter.cols / 2) = sum;
+        }, std::max(1.0, double(in.rows) / band));
+    }
+    else
+    {
+        // Direct pass in the same order as fsiv_filter2D: the zero border
+        // rows and columns are skipped instead of adding zero products.
+        const cv::Mat f = filter.isContinuous() ? filter : filter.clone();
+        cv::parallel_for_(cv::Range(0, in.rows), [&](const cv::Range &r)
+        {
+            std::vector<const float *> rows(f.rows);
+            const int a = std::min(rx, in.cols);
+            const int b = std::max(a, in.cols - rx);
+            for (int i = r.start; i < r.end; ++i)
+            {
+                for (int fi = 0; fi < f.rows; ++fi)
+                {
+                    const int sy = border_index(i - ry + fi, in.rows, circular);
+                    rows[fi] = sy < 0 ? nullptr : in.ptr<float>(sy);
+                }
+                float *dst = sink.row(i);
+                const auto edge = [&](int x)
+                {
+                    float sum = 0.0f;
+                    for (int fi = 0; fi < f.rows; fi++)
+                    {
+                        if (!rows[fi])
+                            continue;
+                        const float *k = f.ptr<float>(fi);
+                        for (int fj = 0; fj < f.cols; fj++)
+                        {
+                            const int sx = border_index(x - rx + fj, in.cols, circular);
+                            if (sx >= 0)
+                                sum += rows[fi][sx] * k[fj];
+                        }
+                    }
+                    dst[x] = sum;
+                };
+                for (int x = 0; x < a; ++x)
+                    edge(x);
+                for (int x = b; x < in.cols; ++x)
+                    edge(x);
+                int j = a;
+#if CV_SIMD
+                const int lanes = cv::v_float32::nlanes;
+                for (; j <= b - lanes; j += lanes)
+                {
+                    cv::v_float32 sum = cv::vx_setzero_f32();
+                    for (int fi = 0; fi < f.rows; fi++)
+                    {
+                        if (!rows[fi])
+                            continue;
+                        const float *src = rows[fi] + j - rx;
+                        const float *k = f.ptr<float>(fi);
+                        for (int fj = 0; fj < f.cols; fj++)
+                            sum = sum + cv::vx_load(src + fj) * cv::vx_setall_f32(k[fj]);
+                    }
+                    cv::v_store(dst + j, sum);
+                }
+#endif
+                for (; j < b; ++j)
+                {
+                    float sum = 0.0f;
+                    for (int fi = 0; fi < f.rows; fi++)
+                    {
+                        if (!rows[fi])
+                            continue;
+                        const float *src = rows[fi] + j - rx;
+                        const float *k = f.ptr<float>(fi);
+                        for (int fj = 0; fj < f.cols; fj++)
+                            sum += src[fj] * k[fj];
+                    }
+                    dst[j] = sum;
+                }
+                sink.done(i, 0, in.cols);
+            }
+        });
+    }
+}
+
+cv::Mat
+fsiv_filter2D_same(cv::Mat const &in, cv::Mat const &filter, bool circular)
+{
+    CV_Assert(!in.empty() && !filter.empty());
+    CV_Assert(in.type() == CV_32FC1 && filter.type() == CV_32FC1);
+    CV_Assert(filter.rows % 2 == 1 && filter.cols % 2 == 1);
+    cv::Mat ret_v(in.rows, in.cols, CV_32FC1);
+
+    filter2D_same_rows(in, filter, circular, store_rows(ret_v));
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.size() == in.size());
+    return ret_v;
+}
+
+/**
+ * @brief Box filter with running sums.
+ *
+ * The output has the input size expanded by m pixels on each side (m < 0
+ * shrinks it) and the window reads the pixels outside the input as zeros or
+ * wrapped around, so m=-r is the "valid" part and m=0 the same size one.
+ * The output rows are written in a sink.
+ * @pre m >= -r
+ */
+template <class Sink>
+static void
+running_box_rows(cv::Mat const &in, int r, int m, bool circular,
+                 Sink const &sink)
+{
+    CV_Assert(m >= -r);
+    const int out_rows = in.rows + 2 * m;
+    const int out_cols = in.cols + 2 * m;
+
+    const int k = 2 * r + 1;
+    const double norm = 1.0 / (double(k) * k);
+    // The column sums cover the input columns [-off, cols+off), the margin
+    // ones are zeros or copies of the wrapped ones.
+    const int off = m + r;
+    // Each band initializes its column sums with k rows, so the bands are
+    // high enough to amortize it.
+    const int band = std::max(64, 2 * k);
+    cv::parallel_for_(cv::Range(0, out_rows), [&](const cv::Range &rg)
+    {
+        std::vector<double> ext(in.cols + 2 * off, 0.0);
+        double *col = &ext[off];
+        for (int y = rg.start; y < rg.end; ++y)
+        {
+            // Window rows of the output row y: [y-m-r, y-m+r].
+            if (y == rg.start)
+            {
+                std::fill(col, col + in.cols, 0.0);
+                for (int i = y - m - r; i <= y - m + r; ++i)
+                {
+                    const int sy = border_index(i, in.rows, circular);
+                    if (sy < 0)
+                        continue;
+                    const float *src = in.ptr<float>(sy);
+                    for (int x = 0; x < in.cols; ++x)
+                        col[x] += src[x];
+                }
+            }
+            else
+            {
+                const int sa = border_index(y - m + r, in.rows, circular);
+                const int ss = border_index(y - m - r - 1, in.rows, circular);
+                if (sa >= 0)
+                {
+                    const float *add = in.ptr<float>(sa);
+                    for (int x = 0; x < in.cols; ++x)
+                        col[x] += add[x];
+                }
+                if (ss >= 0)
+                {
+                    const float *sub = in.ptr<float>(ss);
+                    for (int x = 0; x < in.cols; ++x)
+                        col[x] -= sub[x];
+                }
+            }
+            if (circular)
+                for (int x = 0; x < off; ++x)
+                {
+                    ext[x] = col[border_index(x - off, in.cols, true)];
+                    ext[off + in.cols + x] = col[border_index(in.cols + x, in.cols, true)];
+                }
+
+            float *dst = sink.row(y);
+            double sum = 0.0;
+            for (int x = 0; x < k; ++x)
+                sum += ext[x];
+            dst[0] = static_cast<float>(sum * norm);
+            for (int x = 1; x < out_cols; ++x)
+            {
+                sum += ext[x + k - 1] - ext[x - 1];
+                dst[x] = static_cast<float>(sum * norm);
+            }
+            sink.done(y, 0, out_cols);
+        }
+    }, std::max(1.0, double(out_rows) / band));
+}
+
+/**
+ * @brief Box filter with running sums (see running_box_rows).
+ */
+static cv::Mat
+running_box(cv::Mat const &in, int r, int m, bool circular)
+{
+    cv::Mat out(in.rows + 2 * m, in.cols + 2 * m, CV_32FC1);
+    running_box_rows(in, r, m, circular, store_rows(out));
+    return out;
+}
+
+cv::Mat
+fsiv_box_filter_running(cv::Mat const &in, int r)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0 && in.rows > 2 * r && in.cols > 2 * r);
+    cv::Mat ret_v = running_box(in, r, -r, false);
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.rows == in.rows - 2 * r);
+    CV_Assert(ret_v.cols == in.cols - 2 * r);
+    return ret_v;
+}
+
+cv::Mat
+fsiv_box_filter_running_same(cv::Mat const &in, int r, bool circular)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0);
+    cv::Mat ret_v = running_box(in, r, 0, circular);
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.size() == in.size());
+    return ret_v;
+}
+
+std::vector<int>
+fsiv_gaussian_box_radii(int r, int passes)
+{
+    CV_Assert(r > 0 && passes > 0);
+
+    // Sigma of cv::getGaussianKernel(2r+1, -1) and box widths whose
+    // iterated variance matches it (widths wl or wl+2, odd).
+    const double sigma = 0.3 * (r - 1) + 0.8;
+    const double var = sigma * sigma;
+    int wl = static_cast<int>(std::floor(std::sqrt(12.0 * var / passes + 1.0)));
+    if (wl % 2 == 0)
+        --wl;
+    wl = std::max(wl, 1);
+    const int wu = wl + 2;
+    const int m = std::min(passes, std::max(0, cvRound(
+        (12.0 * var - passes * wl * wl - 4.0 * passes * wl - 3.0 * passes) /
+        (-4.0 * wl - 4.0))));
+
+    std::vector<int> radii;
+    int total = 0;
+    for (int i = 0; i < passes; ++i)
+    {
+        const int w = i < m ? wl : wu;
+        if (w > 1)
+        {
+            radii.push_back((w - 1) / 2);
+            total += radii.back();
         }
     }
+    // The boxes support must be inside the gaussian window.
+    while (total > r)
+    {
+        std::vector<int>::iterator it = std::max_element(radii.begin(), radii.end());
+        if (--(*it) == 0)
+            radii.erase(it);
+        --total;
+    }
+
+    CV_Assert(total <= r);
+    return radii;
+}
+
+cv::Mat
+fsiv_gaussian_filter_boxes(cv::Mat const &in, int r, int passes)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0 && in.rows > 2 * r && in.cols > 2 * r);
+    cv::Mat ret_v;
+
+    const std::vector<int> radii = fsiv_gaussian_box_radii(r, passes);
+    cv::Mat blurred = in;
+    int used = 0;
+    for (size_t i = 0; i < radii.size(); ++i)
+    {
+        blurred = fsiv_box_filter_running(blurred, radii[i]);
+        used += radii[i];
+    }
+    // Crop what the boxes did not use of the gaussian window.
+    const int m = r - used;
+    ret_v = blurred(cv::Rect(m, m, in.cols - 2 * r, in.rows - 2 * r)).clone();
 
     CV_Assert(ret_v.type() == CV_32FC1);
-    CV_Assert(ret_v.rows == in.rows - 2 * (filter.rows / 2));
-    CV_Assert(ret_v.cols == in.cols - 2 * (filter.cols / 2));
+    CV_Assert(ret_v.rows == in.rows - 2 * r);
+    CV_Assert(ret_v.cols == in.cols - 2 * r);
+    return ret_v;
+}
+
+/**
+ * @brief Same size iterated boxes (see fsiv_gaussian_filter_boxes_same).
+ * Only the last box writes its rows in the sink.
+ */
+template <class Sink>
+static void
+gaussian_boxes_same_rows(cv::Mat const &in, int r, bool circular, int passes,
+                         Sink const &sink)
+{
+    // The first box reads the input with the border and outputs it
+    // expanded with the margin the next boxes consume, so the last one
+    // outputs the input size.
+    const std::vector<int> radii = fsiv_gaussian_box_radii(r, passes);
+    if (radii.empty())
+    {
+        for (int y = 0; y < in.rows; ++y)
+        {
+            std::copy(in.ptr<float>(y), in.ptr<float>(y) + in.cols, sink.row(y));
+            sink.done(y, 0, in.cols);
+        }
+        return;
+    }
+    int margin = 0;
+    for (size_t i = 0; i < radii.size(); ++i)
+        margin += radii[i];
+    cv::Mat blurred = in;
+    for (size_t i = 0; i + 1 < radii.size(); ++i)
+    {
+        margin -= radii[i];
+        blurred = i == 0 ? running_box(in, radii[i], margin, circular)
+                         : running_box(blurred, radii[i], -radii[i], false);
+    }
+    if (radii.size() == 1)
+        running_box_rows(in, radii[0], 0, circular, sink);
+    else
+        running_box_rows(blurred, radii.back(), -radii.back(), false, sink);
+}
+
+cv::Mat
+fsiv_gaussian_filter_boxes_same(cv::Mat const &in, int r, bool circular,
+                                int passes)
+{
+    CV_Assert(!in.empty() && in.type() == CV_32FC1);
+    CV_Assert(r > 0);
+    cv::Mat ret_v(in.rows, in.cols, CV_32FC1);
+
+    gaussian_boxes_same_rows(in, r, circular, passes, store_rows(ret_v));
+
+    CV_Assert(ret_v.type() == CV_32FC1);
+    CV_Assert(ret_v.size() == in.size());
     return ret_v;
 }
 
@@ -132,54 +1139,42 @@ fsiv_usm_enhance(cv::Mat const &in, double g, int r,
     CV_Assert(!in.empty());
     CV_Assert(in.type() == CV_32FC1);
     CV_Assert(r > 0);
-    CV_Assert(filter_type >= 0 && filter_type <= 1);
+    CV_Assert(filter_type >= 0 && filter_type <= 2);
     CV_Assert(g >= 0.0);
     cv::Mat ret_v;
 
-    cv::Mat expanded_in;
-    if (circular)
-    {
-        expanded_in = fsiv_circular_expansion(in, r);
-    }
-    else
+    // The filters read the pixels outside the image as zeros (or wrapped
+    // around if circular), so no expanded copy nor crop are needed, and
+    // each blurred row is turned into the enhanced one (and the mask row,
+    // only if asked) while it is in cache, so neither blurred nor mask
+    // images are needed.
+    ret_v.create(in.rows, in.cols, CV_32FC1);
+    if (unsharp_mask != nullptr)
+        *unsharp_mask = cv::Mat(in.rows, in.cols, CV_32FC1);
+    const usm_rows sink(in, ret_v, unsharp_mask, g);
+    if (filter_type == 0 && r > 2)
     {
-        expanded_in = fsiv_fill_expansion(in, r);
+        // The running sums cost does not depend on r.
+        running_box_rows(in, r, 0, circular, sink);
     }
-
-    cv::Mat filter;
-    if (filter_type == 0)
+    else if (filter_type == 2)
     {
-        filter = fsiv_create_box_filter(r);
+        gaussian_boxes_same_rows(in, r, circular, 3, sink);
     }
     else
     {
-        filter = fsiv_create_gaussian_filter(r);
-    }
-
-    cv::Mat blurred = fsiv_filter2D(expanded_in, filter);
-
-    int crop_width = std::min(in.cols, blurred.cols);
-    int crop_height = std::min(in.rows, blurred.rows);
-    int crop_start_x = (blurred.cols - crop_width) / 2;
-    int crop_start_y = (blurred.rows - crop_height) / 2;
-
-    cv::Rect crop_region(crop_start_x, crop_start_y, crop_width, crop_height);
-
-    CV_Assert(crop_region.x >= 0 && crop_region.y >= 0 &&
-              crop_region.x + crop_region.width <= blurred.cols &&
-              crop_region.y + crop_region.height <= blurred.rows);
-
-    cv::Mat cropped_blurred = blurred(crop_region);
-
-    cv::Mat mask = in - cropped_blurred;
-
-    if (unsharp_mask != nullptr)
-    {
-        *unsharp_mask = mask.clone();
+        cv::Mat filter;
+        if (filter_type == 0)
+        {
+            filter = fsiv_create_box_filter(r);
+        }
+        else
+        {
+            filter = fsiv_create_gaussian_filter(r);
+        }
+        filter2D_same_rows(in, filter, circular, sink);
     }
 
-    ret_v = fsiv_combine_images(in, mask, 1.0, g);
-
     CV_Assert(ret_v.rows == in.rows);
     CV_Assert(ret_v.cols == in.cols);
     CV_Assert(ret_v.type() == CV_32FC1);
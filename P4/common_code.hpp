@@ -9,6 +9,7 @@
  *
  */
 #pragma once
+#include <vector>
 #include <opencv2/core.hpp>
 
 /**
@@ -61,6 +62,12 @@ cv::Mat fsiv_circular_expansion(cv::Mat const &in, const int r);
 
 /**
  * @brief Compute the digital correlation between two images.
+ *
+ * Filters up to 5x5 use a direct vectorized pass with the same summation
+ * order as the scalar loop. Larger ones use the direct pass,
+ * fsiv_filter2D_separable (if separable) or fsiv_filter2D_fft, the cheapest
+ * by the cost model (see fsiv_filter2D_select).
+ *
  * @warning Code from scracth. Use cv::filter2D() is not allowed.
  * @arg[in] in is the input image.
  * @arg[in] filter is the filter to be applied.
@@ -72,6 +79,222 @@ cv::Mat fsiv_circular_expansion(cv::Mat const &in, const int r);
  */
 cv::Mat fsiv_filter2D(cv::Mat const &in, cv::Mat const &filter);
 
+/**
+ * @brief Compute the digital correlation keeping the image size.
+ *
+ * Same result as fsiv_filter2D over fsiv_fill_expansion(in, r) (or
+ * fsiv_circular_expansion(in, r) if circular) for a (2r+1) square filter,
+ * but without the expanded copy: the interior pixels are computed from the
+ * input and the border rows and columns read the outside pixels as zeros
+ * (or wrapped around) in specific edge loops. The method is chosen as in
+ * fsiv_filter2D; the frequency domain one reads the border when loading
+ * its tiles.
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] filter is the filter to be applied.
+ * @arg[in] circular reads the outside pixels wrapped around, else as zeros.
+ * @pre !in.empty() && !filter.empty()
+ * @pre in.type()==CV_32FC1 && filter.type()==CV_32FC1.
+ * @pre filter.rows and filter.cols are odd.
+ * @post ret.type()==CV_32FC1
+ * @post ret.size() == in.size()
+ */
+cv::Mat fsiv_filter2D_same(cv::Mat const &in, cv::Mat const &filter,
+                           bool circular = false);
+
+/**
+ * @brief Split a filter into a column and a row filter (filter == ky * kx).
+ * @arg[in] filter is the filter.
+ * @arg[out] kx is the row filter (1 x filter.cols).
+ * @arg[out] ky is the column filter (filter.rows x 1).
+ * @return true if the filter is separable (rank 1 up to float precision).
+ * @pre !filter.empty() && filter.type()==CV_32FC1
+ */
+bool fsiv_separate_filter(cv::Mat const &filter, cv::Mat &kx, cv::Mat &ky);
+
+/**
+ * @brief Compute the digital correlation with a separable filter ky * kx.
+ *
+ * It runs a row pass and a column pass, O(kx.cols + ky.rows) per pixel.
+ * Both passes are parallel by row bands, cache blocked by columns and
+ * vectorized. The output is the "valid" part as fsiv_filter2D.
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] kx is the row filter.
+ * @arg[in] ky is the column filter.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre kx.type()==CV_32FC1 && kx.rows==1 && kx.cols is odd.
+ * @pre ky.type()==CV_32FC1 && ky.cols==1 && ky.rows is odd.
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*(ky.rows/2)
+ * @post ret.cols == in.cols-2*(kx.cols/2)
+ */
+cv::Mat fsiv_filter2D_separable(cv::Mat const &in, cv::Mat const &kx,
+                                cv::Mat const &ky);
+
+/**
+ * @brief Compute the digital correlation in the frequency domain.
+ *
+ * The output is split in tiles and each one is computed from the spectrum
+ * of its input block (with the filter halo) times the conjugated filter
+ * spectrum (overlap-save), so the cost per pixel grows with log(size)
+ * instead of with the filter area. The tile size is chosen with the cost
+ * model and the filter spectra are cached between calls. The output is the
+ * "valid" part as fsiv_filter2D.
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] filter is the filter to be applied.
+ * @pre !in.empty() && !filter.empty()
+ * @pre in.type()==CV_32FC1 && filter.type()==CV_32FC1.
+ * @pre in.rows>=filter.rows && in.cols>=filter.cols
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*(filter.rows/2)
+ * @post ret.cols == in.cols-2*(filter.cols/2)
+ */
+cv::Mat fsiv_filter2D_fft(cv::Mat const &in, cv::Mat const &filter);
+
+/**
+ * @brief Correlation methods.
+ */
+enum fsiv_filter2D_method
+{
+    FSIV_FILTER2D_DIRECT = 0,    // sum of products, O(kh*kw) per pixel.
+    FSIV_FILTER2D_SEPARABLE = 1, // row and column passes, O(kh+kw) per pixel.
+    FSIV_FILTER2D_FFT = 2        // tiles in the frequency domain.
+};
+
+/**
+ * @brief Cost model of the correlation methods (ns per unit of work).
+ *
+ * The model in use is measured in the machine on its first use (some tens
+ * of ms), unless it was set before with fsiv_filter2D_set_costs. These
+ * defaults are only a fallback for a stage too fast for the timer.
+ */
+struct fsiv_filter2D_costs
+{
+    double direct_tap = 0.05;    // a product of the direct pass.
+    double separable_tap = 0.1;  // a product of a row or column pass.
+    double fft_unit = 0.3;       // a point * log2(points) of a dft.
+    double fft_point = 1.0;      // loading and spectra product of a point.
+};
+
+/**
+ * @brief Get the cost model used to choose the correlation method.
+ * The first call measures it, unless it was set before.
+ */
+fsiv_filter2D_costs fsiv_filter2D_get_costs();
+
+/**
+ * @brief Set the cost model used to choose the correlation method.
+ * @pre all the costs are > 0.
+ */
+void fsiv_filter2D_set_costs(fsiv_filter2D_costs const &c);
+
+/**
+ * @brief Measure the cost model in this machine again and set it.
+ * It takes some tens of ms.
+ * @return the measured costs.
+ */
+fsiv_filter2D_costs fsiv_filter2D_calibrate();
+
+/**
+ * @brief Choose the cheapest correlation method by the cost model.
+ * @arg[in] out is the output size.
+ * @arg[in] filter is the filter size.
+ * @arg[in] separable is true if the filter is separable.
+ * @return the method.
+ * @pre out.area()>0 && filter.area()>0
+ */
+fsiv_filter2D_method fsiv_filter2D_select(cv::Size const &out,
+                                          cv::Size const &filter,
+                                          bool separable);
+
+/**
+ * @brief Apply a box filter with running sums.
+ *
+ * The column sums of the window are updated when the window moves down a
+ * row and the row sums slide along the columns, so the cost per pixel does
+ * not depend on r. The sums are accumulated in double to avoid drift.
+ * The output is the "valid" part as fsiv_filter2D with a box filter.
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] r is the window's radius.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0 && in.rows>2*r && in.cols>2*r
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*r
+ * @post ret.cols == in.cols-2*r
+ */
+cv::Mat fsiv_box_filter_running(cv::Mat const &in, int r);
+
+/**
+ * @brief Apply a box filter with running sums keeping the image size.
+ *
+ * As fsiv_box_filter_running over the image expanded with zeros (or
+ * wrapped around if circular), without the expanded copy.
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] r is the window's radius.
+ * @arg[in] circular reads the outside pixels wrapped around, else as zeros.
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0
+ * @post ret.type()==CV_32FC1
+ * @post ret.size() == in.size()
+ */
+cv::Mat fsiv_box_filter_running_same(cv::Mat const &in, int r,
+                                     bool circular = false);
+
+/**
+ * @brief Compute the radii of the boxes that approximate a gaussian.
+ *
+ * The variance of the iterated boxes is the one of the gaussian used by
+ * fsiv_create_gaussian_filter(r), and the sum of the radii is not greater
+ * than r (with more than 3 passes this limit can reduce the variance).
+ *
+ * @arg[in] r is the gaussian filter radius.
+ * @arg[in] passes is the number of boxes.
+ * @return the box radii (radius 0 boxes are skipped).
+ * @pre r>0 && passes>0
+ */
+std::vector<int> fsiv_gaussian_box_radii(int r, int passes = 3);
+
+/**
+ * @brief Approximate a gaussian filter with iterated running box filters.
+ *
+ * The cost per pixel does not depend on r. The output is the "valid" part
+ * as fsiv_filter2D with fsiv_create_gaussian_filter(r).
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] r is the gaussian filter radius.
+ * @arg[in] passes is the number of boxes (3 to 5 are usual).
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0 && in.rows>2*r && in.cols>2*r
+ * @post ret.type()==CV_32FC1
+ * @post ret.rows == in.rows-2*r
+ * @post ret.cols == in.cols-2*r
+ */
+cv::Mat fsiv_gaussian_filter_boxes(cv::Mat const &in, int r, int passes = 3);
+
+/**
+ * @brief Approximate a gaussian filter with iterated boxes keeping the image size.
+ *
+ * As fsiv_gaussian_filter_boxes over the image expanded with zeros (or
+ * wrapped around if circular), without the expanded copy: only the first
+ * box reads the border and the intermediate images keep the margin the
+ * next boxes need.
+ *
+ * @arg[in] in is the input image.
+ * @arg[in] r is the gaussian filter radius.
+ * @arg[in] circular reads the outside pixels wrapped around, else as zeros.
+ * @arg[in] passes is the number of boxes (3 to 5 are usual).
+ * @pre !in.empty() && in.type()==CV_32FC1
+ * @pre r>0
+ * @post ret.type()==CV_32FC1
+ * @post ret.size() == in.size()
+ */
+cv::Mat fsiv_gaussian_filter_boxes_same(cv::Mat const &in, int r,
+                                        bool circular = false, int passes = 3);
+
 /**
  * @brief Combine two images using weigths.
  * @param src1 first image.
@@ -93,14 +316,18 @@ cv::Mat fsiv_combine_images(const cv::Mat src1, const cv::Mat src2,
  * @arg[in] in is the input image.
  * @arg[in] g is the enhance's gain.
  * @arg[in] r is the window's radius.
- * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian.
+ * @arg[in] filter_type specifies which filter to use. 0->Box, 1->Gaussian,
+ * 2->Gaussian approximated with 3 iterated boxes. The box filters use
+ * running sums for r>2, so large radii are cheap. The blur, the mask and
+ * the combination are fused by rows, so only the output (and the mask, if
+ * asked) are written.
  * @arg[in] circular specifies if it is true, it be used circular expansion to do the convolution, else it is used zero padding.
  * @arg[out] unsharp_mask if it is not nullptr, save the unsharp mask used.
  * @pre !in.empty()
  * @pre in.type()==CV_32FC1
  * @pre g>=0.0
  * @pre r>0
- * @pre filter_type is {0, 1}
+ * @pre filter_type is {0, 1, 2}
  * @post ret_v.rows==in.rows && ret_v.cols==in.cols
  * @post ret_v.type()==CV_32FC1
  */
@@ -0,0 +1,257 @@
+/**
+ * @file test_filters.cpp
+ * @brief Check the filtering engines against the direct correlation.
+ *
+ * Each engine is compared with a direct loop (accumulated in double) over
+ * the image expanded with fsiv_fill_expansion or fsiv_circular_expansion,
+ * for zero and circular borders and radii below and above 2 (fsiv_usm_enhance
+ * only uses the running box for r>2). fsiv_filter2D and fsiv_filter2D_same
+ * are checked with cost models that force each correlation method.
+ */
+#include <algorithm>
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "common_code.hpp"
+
+// Max. abs. difference allowed per unit of the filter L1 norm.
+static const double TOLERANCE = 5.0e-4;
+
+static int n_tests = 0;
+static int n_failed = 0;
+
+/**
+ * @brief Valid part of the correlation of an image with a filter.
+ */
+static cv::Mat
+direct_correlation(cv::Mat const &in, cv::Mat const &filter)
+{
+    cv::Mat out(in.rows - filter.rows + 1, in.cols - filter.cols + 1, CV_32FC1);
+    for (int y = 0; y < out.rows; ++y)
+        for (int x = 0; x < out.cols; ++x)
+        {
+            double sum = 0.0;
+            for (int i = 0; i < filter.rows; ++i)
+                for (int j = 0; j < filter.cols; ++j)
+                    sum += double(in.at<float>(y + i, x + j)) *
+                           filter.at<float>(i, j);
+            out.at<float>(y, x) = static_cast<float>(sum);
+        }
+    return out;
+}
+
+/**
+ * @brief Same size correlation over the expanded image.
+ * @pre filter is a (2r+1) square filter.
+ */
+static cv::Mat
+direct_correlation_same(cv::Mat const &in, cv::Mat const &filter, bool circular)
+{
+    const int r = filter.rows / 2;
+    const cv::Mat expanded = circular ? fsiv_circular_expansion(in, r)
+                                      : fsiv_fill_expansion(in, r);
+    return direct_correlation(expanded, filter);
+}
+
+/**
+ * @brief Filter equivalent to the iterated boxes of fsiv_gaussian_filter_boxes.
+ *
+ * The 1D boxes are convolved in one kernel, which is centered in a (2r+1)
+ * square filter because the boxes only use part of the gaussian window.
+ */
+static cv::Mat
+boxes_filter(int r, int passes)
+{
+    std::vector<double> k(1, 1.0);
+    const std::vector<int> radii = fsiv_gaussian_box_radii(r, passes);
+    for (size_t b = 0; b < radii.size(); ++b)
+    {
+        const int w = 2 * radii[b] + 1;
+        std::vector<double> next(k.size() + w - 1, 0.0);
+        for (size_t i = 0; i < k.size(); ++i)
+            for (int j = 0; j < w; ++j)
+                next[i + j] += k[i] / w;
+        k.swap(next);
+    }
+    const int m = r - static_cast<int>(k.size() / 2);
+    CV_Assert(m >= 0);
+    cv::Mat filter = cv::Mat::zeros(2 * r + 1, 2 * r + 1, CV_32FC1);
+    for (size_t i = 0; i < k.size(); ++i)
+        for (size_t j = 0; j < k.size(); ++j)
+            filter.at<float>(m + int(i), m + int(j)) = static_cast<float>(k[i] * k[j]);
+    return filter;
+}
+
+/**
+ * @brief Report the comparison of an engine output with the expected one.
+ */
+static void
+check(std::string const &name, cv::Mat const &result, cv::Mat const &expected,
+      double l1 = 1.0)
+{
+    ++n_tests;
+    bool ok = result.type() == CV_32FC1 && result.size() == expected.size();
+    double error = 0.0;
+    if (ok)
+    {
+        error = cv::norm(result, expected, cv::NORM_INF);
+        ok = error <= TOLERANCE * std::max(1.0, l1);
+    }
+    if (!ok)
+    {
+        ++n_failed;
+        std::cerr << "Test " << name << ": FAILED";
+        if (result.size() == expected.size())
+            std::cerr << " (max. error " << error << ")";
+        else
+            std::cerr << " (wrong size " << result.size() << " != "
+                      << expected.size() << ")";
+        std::cerr << std::endl;
+    }
+}
+
+/**
+ * @brief Cost models that force each correlation method for filters > 5x5.
+ */
+static std::vector<std::pair<std::string, fsiv_filter2D_costs> >
+forced_costs()
+{
+    fsiv_filter2D_costs direct, separable, fft;
+    direct.direct_tap = 1.0e-6;
+    separable.direct_tap = 1.0e3;
+    separable.separable_tap = 1.0e-6;
+    fft.direct_tap = 1.0e3;
+    fft.separable_tap = 1.0e3;
+    fft.fft_unit = 1.0e-6;
+    fft.fft_point = 1.0e-6;
+    std::vector<std::pair<std::string, fsiv_filter2D_costs> > costs;
+    costs.push_back(std::make_pair(std::string("direct"), direct));
+    costs.push_back(std::make_pair(std::string("separable"), separable));
+    costs.push_back(std::make_pair(std::string("fft"), fft));
+    return costs;
+}
+
+static void
+test_image(cv::Mat const &in, int r)
+{
+    const std::string config = cv::format("%dx%d r=%d", in.cols, in.rows, r);
+    const int w = 2 * r + 1;
+
+    // A non separable filter and a separable one (with a taller column filter).
+    cv::Mat filter(w, w, CV_32FC1);
+    cv::randu(filter, -0.5, 0.5);
+    cv::Mat kx(1, w, CV_32FC1), ky(w + 2, 1, CV_32FC1);
+    cv::randu(kx, -0.5, 0.5);
+    cv::randu(ky, -0.5, 0.5);
+    const cv::Mat separable = ky * kx;
+    const cv::Mat box = fsiv_create_box_filter(r);
+    const cv::Mat gauss = fsiv_create_gaussian_filter(r);
+    const double filter_l1 = cv::norm(filter, cv::NORM_L1);
+
+    check("fsiv_filter2D_separable " + config,
+          fsiv_filter2D_separable(in, kx, ky),
+          direct_correlation(in, separable), cv::norm(separable, cv::NORM_L1));
+    check("fsiv_filter2D_fft " + config, fsiv_filter2D_fft(in, filter),
+          direct_correlation(in, filter), filter_l1);
+    check("fsiv_filter2D_fft " + config + " separable",
+          fsiv_filter2D_fft(in, separable), direct_correlation(in, separable),
+          cv::norm(separable, cv::NORM_L1));
+    check("fsiv_box_filter_running " + config, fsiv_box_filter_running(in, r),
+          direct_correlation(in, box));
+    for (int passes = 3; passes <= 5; passes += 2)
+        check("fsiv_gaussian_filter_boxes " + config +
+                  cv::format(" passes=%d", passes),
+              fsiv_gaussian_filter_boxes(in, r, passes),
+              direct_correlation(in, boxes_filter(r, passes)));
+
+    const std::vector<std::pair<std::string, fsiv_filter2D_costs> > costs =
+        forced_costs();
+    for (size_t c = 0; c < costs.size(); ++c)
+    {
+        fsiv_filter2D_set_costs(costs[c].second);
+        const std::string cconfig = config + " " + costs[c].first;
+        check("fsiv_filter2D " + cconfig, fsiv_filter2D(in, filter),
+              direct_correlation(in, filter), filter_l1);
+        check("fsiv_filter2D " + cconfig + " gaussian", fsiv_filter2D(in, gauss),
+              direct_correlation(in, gauss));
+        for (int circular = 0; circular < 2; ++circular)
+        {
+            const std::string bconfig = cconfig + (circular ? " circular" : " zero");
+            check("fsiv_filter2D_same " + bconfig,
+                  fsiv_filter2D_same(in, filter, circular != 0),
+                  direct_correlation_same(in, filter, circular != 0), filter_l1);
+            check("fsiv_filter2D_same " + bconfig + " gaussian",
+                  fsiv_filter2D_same(in, gauss, circular != 0),
+                  direct_correlation_same(in, gauss, circular != 0));
+        }
+    }
+
+    for (int circular = 0; circular < 2; ++circular)
+    {
+        const bool circ = circular != 0;
+        const std::string bconfig = config + (circ ? " circular" : " zero");
+        check("fsiv_box_filter_running_same " + bconfig,
+              fsiv_box_filter_running_same(in, r, circ),
+              direct_correlation_same(in, box, circ));
+        for (int passes = 3; passes <= 5; passes += 2)
+            check("fsiv_gaussian_filter_boxes_same " + bconfig +
+                      cv::format(" passes=%d", passes),
+                  fsiv_gaussian_filter_boxes_same(in, r, circ, passes),
+                  direct_correlation_same(in, boxes_filter(r, passes), circ));
+
+        // Blur of each usm filter type: box, gaussian and 3 iterated boxes.
+        const cv::Mat blurs[] = {
+            direct_correlation_same(in, box, circ),
+            direct_correlation_same(in, gauss, circ),
+            direct_correlation_same(in, boxes_filter(r, 3), circ)};
+        const double g = 1.5;
+        for (int type = 0; type < 3; ++type)
+        {
+            const cv::Mat mask = in - blurs[type];
+            const cv::Mat expected = in + g * mask;
+            cv::Mat result_mask;
+            const std::string tconfig = bconfig + cv::format(" type=%d", type);
+            check("fsiv_usm_enhance " + tconfig,
+                  fsiv_usm_enhance(in, g, r, type, circ, &result_mask), expected,
+                  1.0 + 2.0 * g);
+            check("fsiv_usm_enhance " + tconfig + " mask", result_mask, mask, 2.0);
+            check("fsiv_usm_enhance " + tconfig + " without mask",
+                  fsiv_usm_enhance(in, g, r, type, circ), expected, 1.0 + 2.0 * g);
+        }
+    }
+}
+
+int
+main(int, char **)
+{
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        cv::theRNG().state = 0x12345678;
+        const cv::Size sizes[] = {cv::Size(23, 17), cv::Size(64, 48),
+                                  cv::Size(131, 97)};
+        const int radii[] = {1, 2, 3, 5};
+        for (cv::Size const &size : sizes)
+        {
+            cv::Mat in(size, CV_32FC1);
+            cv::randu(in, 0.0, 1.0);
+            for (int r : radii)
+                test_image(in, r);
+        }
+        std::cout << n_tests - n_failed << "/" << n_tests << " tests passed."
+                  << std::endl;
+        if (n_failed > 0)
+            retCode = EXIT_FAILURE;
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Error: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
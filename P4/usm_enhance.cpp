@@ -8,8 +8,12 @@
  * @copyright Copyright (c) 2024-
  *
  */
+#include <cstdio>
 #include <iostream>
 #include <exception>
+#include <functional>
+#include <memory>
+#include <string>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/utility.hpp>
@@ -17,6 +21,8 @@
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include "common_code.hpp"
+#include "fsiv_preview.hpp"
+#include "fsiv_tiles.hpp"
 
 const cv::String keys =
     "{help h usage ? |      | print this message.}"
@@ -24,10 +30,25 @@ const cv::String keys =
     "{r radius       |1     | Window's radius. Default 1.}"
     "{g gain         |1.0   | Enhance's gain. Default 1.0}"
     "{c circular     |      | Use circular convolution.}"
-    "{f filter       |0     | Filter type: 0->Box, 1->Gaussian. Default 0.}"
+    "{f filter       |0     | Filter type: 0->Box, 1->Gaussian, 2->Gaussian approximated with iterated boxes (fast for large radii). Default 0.}"
+    "{raw            |      | out-of-core mode: input and output are raw 8 bit gray images of this size (WxH) processed by tiles.}"
+    "{tile           |1024  | out-of-core mode tile size.}"
+    "{proxy          |0.25  | interactive mode preview proxy scale. Value 1 means don't render a proxy.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}";
 
+struct UserData;
+
+/**
+ * @brief Result of the interactive preview.
+ */
+struct PreviewResult
+{
+    cv::Mat out;          // output image.
+    cv::Mat unsharp_mask; // unsharp mask used to do the enhance.
+};
+typedef fsiv_preview<UserData, PreviewResult> Preview;
+
 /**
  * @brief Application State.
  * Use this structure to maintain the state of the application
@@ -45,10 +66,13 @@ struct UserData
     int f;                         // filter type.
     int circular;                  // use circular expansion.
     bool interactive;              // interactive mode is activated.
+    std::vector<cv::Mat> proxy_channels; // downscaled HSV channels.
+    cv::Mat proxy_luma;            // downscaled luma for the interactive preview.
+    Preview *preview;              // interactive preview.
 };
 
-/**@brief Do the gui work**/
-void do_the_work(UserData *user_data)
+/**@brief Do the image work**/
+void do_the_process(UserData *user_data)
 {
     user_data->out = fsiv_usm_enhance(user_data->luma, user_data->g,
                                       user_data->r, user_data->f,
@@ -62,6 +86,12 @@ void do_the_work(UserData *user_data)
         cv::merge(user_data->channels, hsv);
         cv::cvtColor(hsv, user_data->out, cv::COLOR_HSV2BGR);
     }
+}
+
+/**@brief Do the gui work**/
+void do_the_work(UserData *user_data)
+{
+    do_the_process(user_data);
     if (user_data->interactive)
     {
         cv::imshow("OUTPUT", user_data->out);
@@ -69,6 +99,36 @@ void do_the_work(UserData *user_data)
     }
 }
 
+/**
+ * @brief Render the interactive preview on a background thread.
+ * The proxy is processed with the radius scaled too.
+ */
+bool render_preview(UserData const &params, double scale,
+                    std::function<bool()> const &cancelled,
+                    PreviewResult &result)
+{
+    UserData d = params;
+    if (scale < 1.0)
+    {
+        d.luma = d.proxy_luma;
+        d.channels = d.proxy_channels;
+        d.r = std::max(1, cvRound(d.r * scale));
+    }
+    do_the_process(&d);
+    result.out = d.out;
+    result.unsharp_mask = d.unsharp_mask;
+    return !cancelled();
+}
+
+/**@brief Update the output after a parameter change.**/
+void update_work(UserData *user_data)
+{
+    if (user_data->preview)
+        user_data->preview->request(*user_data);
+    else
+        do_the_work(user_data);
+}
+
 /** @brief Standard trackbar callback
  * Use this function an argument for cv::createTrackbar to control
  * the trackbar changes.
@@ -81,7 +141,7 @@ void on_change_r(int v, void *user_data_)
     UserData *user_data = static_cast<UserData *>(user_data_);
     user_data->r = v + 1; // to avoid 0 value.
     std::cout << "Setting radius to " << user_data->r << std::endl;
-    do_the_work(user_data);
+    update_work(user_data);
 }
 
 /**
@@ -97,7 +157,7 @@ void on_change_g(int v, void *user_data_)
     UserData *user_data = static_cast<UserData *>(user_data_);
     user_data->g = v / 10.0; // we assume that max value is 100
     std::cout << "Setting gain to " << user_data->g << std::endl;
-    do_the_work(user_data);
+    update_work(user_data);
 }
 
 /**
@@ -112,9 +172,9 @@ void on_change_f(int v, void *user_data_)
 {
     UserData *user_data = static_cast<UserData *>(user_data_);
     user_data->f = v;
-    std::cout << "Setting filter type to " << (v == 0 ? "box" : "gaussian")
+    std::cout << "Setting filter type to " << (v == 0 ? "box" : (v == 1 ? "gaussian" : "gaussian (iterated boxes)"))
               << std::endl;
-    do_the_work(user_data);
+    update_work(user_data);
 }
 
 /**
@@ -131,7 +191,49 @@ void on_change_c(int state, void *user_data_)
     user_data->circular = state;
     std::cout << "Setting image expansion type to " << (state == 0 ? "filling" : "circular")
               << std::endl;
-    do_the_work(user_data);
+    update_work(user_data);
+}
+
+/**
+ * @brief Out-of-core mode: enhance a raw 8 bit gray image by tiles.
+ *
+ * The input and output files are mapped in memory and processed by tiles
+ * with a halo of r pixels, so the result is the same as processing the
+ * whole image but the memory used does not depend on the image size.
+ */
+int run_tiled(std::string const &input, std::string const &output,
+              cv::Size const &size, int tile, UserData const &params)
+{
+    fsiv_mapped_image in, out;
+    if (!in.open(input, size.height, size.width, CV_8UC1))
+    {
+        std::cerr << "Error: could not map the raw input image '" << input
+                  << "' of " << size << " pixels." << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (!out.create(output, size.height, size.width, CV_8UC1))
+    {
+        std::cerr << "Error: could not create the raw output image '" << output
+                  << "'." << std::endl;
+        return EXIT_FAILURE;
+    }
+    fsiv_tile_options opts;
+    opts.tile = cv::Size(tile, tile);
+    opts.halo = params.r;
+    // The same expansion the enhance does, but applied to the whole image.
+    opts.border = params.circular ? cv::BORDER_WRAP : cv::BORDER_CONSTANT;
+    opts.border_value = cv::Scalar(0);
+    const fsiv_tile_stats stats = fsiv_process_tiles(in, out,
+        [&params](cv::Mat const &t, cv::Mat &o)
+        {
+            cv::Mat luma;
+            t.convertTo(luma, CV_32F, 1.0 / 255.0);
+            fsiv_usm_enhance(luma, params.g, params.r, params.f,
+                             params.circular).convertTo(o, CV_8U, 255.0);
+        },
+        opts);
+    fsiv_print_tile_stats(std::cout, stats);
+    return EXIT_SUCCESS;
 }
 
 int main(int argc, char *const *argv)
@@ -141,6 +243,7 @@ int main(int argc, char *const *argv)
     try
     {
         UserData user_data;
+        user_data.preview = nullptr;
         cv::CommandLineParser parser(argc, argv, keys);
         parser.about("Apply an unsharp mask enhance to an image.");
         if (parser.has("help"))
@@ -172,6 +275,20 @@ int main(int argc, char *const *argv)
             return EXIT_FAILURE;
         }
 
+        if (parser.has("raw"))
+        {
+            cv::Size size;
+            const std::string raw = parser.get<std::string>("raw");
+            if (std::sscanf(raw.c_str(), "%dx%d", &size.width, &size.height) != 2 ||
+                size.width <= 0 || size.height <= 0 || parser.get<int>("tile") <= 0)
+            {
+                std::cerr << "Error: wrong out-of-core mode parameters." << std::endl;
+                return EXIT_FAILURE;
+            }
+            return run_tiled(input_n, output_n, size, parser.get<int>("tile"),
+                             user_data);
+        }
+
         cv::Mat in = cv::imread(input_n, cv::IMREAD_UNCHANGED);
         if (in.empty())
         {
@@ -193,9 +310,30 @@ int main(int argc, char *const *argv)
             user_data.luma = user_data.in;
 
         int k = 0;
+        std::unique_ptr<Preview> preview;
 
         if (user_data.interactive)
         {
+            const double proxy_scale = parser.get<double>("proxy");
+            user_data.proxy_luma = fsiv_preview_proxy(user_data.luma, proxy_scale);
+            if (user_data.channels.size() == 3)
+                for (size_t c = 0; c < user_data.channels.size(); ++c)
+                    user_data.proxy_channels.push_back(
+                        fsiv_preview_proxy(user_data.channels[c], proxy_scale));
+            preview.reset(new Preview(render_preview,
+                [&user_data](UserData const &, double scale, PreviewResult const &r)
+                {
+                    cv::imshow("OUTPUT", fsiv_preview_fit(r.out, user_data.in.size()));
+                    cv::imshow("UNSHARP MASK",
+                               fsiv_preview_fit(r.unsharp_mask, user_data.in.size()));
+                    if (scale >= 1.0)
+                    {
+                        user_data.out = r.out;
+                        user_data.unsharp_mask = r.unsharp_mask;
+                    }
+                },
+                proxy_scale));
+            user_data.preview = preview.get();
             cv::namedWindow("INPUT", cv::WINDOW_GUI_EXPANDED);
             cv::imshow("INPUT", user_data.in);
             cv::namedWindow("OUTPUT", cv::WINDOW_GUI_EXPANDED);
@@ -203,10 +341,18 @@ int main(int argc, char *const *argv)
             cv::createTrackbar("R", "OUTPUT", &user_data.r, std::min(in.rows, in.cols) / 2 - 1, on_change_r, &user_data);
             int g_int = static_cast<int>(std::min(10.0, user_data.g * 10.0));
             cv::createTrackbar("G", "OUTPUT", &g_int, 100, on_change_g, &user_data);
-            cv::createTrackbar("Filter", "OUTPUT", &user_data.f, 1, on_change_f, &user_data);
+            cv::createTrackbar("Filter", "OUTPUT", &user_data.f, 2, on_change_f, &user_data);
             cv::createTrackbar("Circular", "OUTPUT", &user_data.circular, 1, on_change_c, &user_data);
             do_the_work(&user_data);
-            k = cv::waitKey(0) & 0xff;
+            // Show the preview results while waiting for a key.
+            k = -1;
+            while (k < 0)
+            {
+                k = cv::waitKey(20);
+                preview->poll();
+            }
+            k &= 0xff;
+            preview->finish();
         }
         else
             do_the_work(&user_data);
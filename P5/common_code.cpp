@@ -7,14 +7,16 @@ void fsiv_compute_derivate(cv::Mat const &img, cv::Mat &dx, cv::Mat &dy, int g_r
 {
     CV_Assert(img.type() == CV_8UC1);
 
+    // The input is not modified, the blurred image is a local one.
+    cv::Mat smoothed = img;
     if (g_r > 0)
     {
         int kernel_size = 2 * g_r + 1;
-        cv::GaussianBlur(img, img, cv::Size(kernel_size, kernel_size), 0);
+        cv::GaussianBlur(img, smoothed, cv::Size(kernel_size, kernel_size), 0);
     }
 
-    cv::Sobel(img, dx, CV_32F, 1, 0, s_ap);
-    cv::Sobel(img, dy, CV_32F, 0, 1, s_ap);
+    cv::Sobel(smoothed, dx, CV_32F, 1, 0, s_ap);
+    cv::Sobel(smoothed, dy, CV_32F, 0, 1, s_ap);
 
     CV_Assert(dx.size() == img.size());
     CV_Assert(dy.size() == dx.size());
@@ -41,28 +43,14 @@ void fsiv_compute_gradient_histogram(cv::Mat const &gradient, int n_bins, cv::Ma
     CV_Assert(gradient.type() == CV_32F || gradient.type() == CV_64F);
     CV_Assert(n_bins > 0);
 
-    double min_val, max_val;
-    cv::minMaxLoc(gradient, &min_val, &max_val);
+    // The max is discovered by the histogram engine while binning. As
+    // cv::calcHist with the range [0, max_gradient), the pixels equal to
+    // the max gradient are not counted.
+    double max_val = 0.0;
+    hist = fsiv_parallel_histogram(gradient, n_bins, 0.0, FSIV_HIST_AUTO,
+                                   cv::Mat(), nullptr, &max_val);
     max_gradient = static_cast<float>(max_val);
 
-    CV_Assert(max_gradient > 0.0); 
-
-    float range[] = {0, max_gradient};
-    const float *hist_range = {range};
-    bool uniform = true;
-    bool accumulate = false;
-
-    cv::calcHist(&gradient,
-                 1,         
-                 0,
-                 cv::Mat(), 
-                 hist,      
-                 1,         
-                 &n_bins,
-                 &hist_range,
-                 uniform,
-                 accumulate);
-
     CV_Assert(max_gradient > 0.0);
     CV_Assert(hist.rows == n_bins);
 }
@@ -72,27 +60,27 @@ int fsiv_compute_histogram_percentile(cv::Mat const &hist, float percentile)
     CV_Assert(percentile >= 0.0 && percentile <= 1.0);
     CV_Assert(hist.type() == CV_32FC1);
     CV_Assert(hist.cols == 1);
-    int idx = -1;
 
-    float total_area = cv::sum(hist)[0];
+    return fsiv_compute_histogram_percentile(fsiv_cumulative_histogram(hist),
+                                             percentile);
+}
+
+int fsiv_compute_histogram_percentile(fsiv_cumulative_histogram const &cum,
+                                      float percentile)
+{
+    CV_Assert(percentile >= 0.0 && percentile <= 1.0);
+
+    const float total_area = static_cast<float>(cum.total());
     CV_Assert(total_area > 0.0);
-    float cumulative_sum = 0.0f;
 
-    for (int i = 0; i < hist.rows; ++i)
-    {
-        cumulative_sum += hist.at<float>(i);
-        if (cumulative_sum / total_area >= percentile)
-        {
-            idx = i;
-            break;
-        }
-    }
+    int idx = cum.find_first([total_area, percentile](double c)
+                             { return static_cast<float>(c) / total_area >= percentile; });
 
-    if (percentile == 1.0) { idx = hist.rows - 1; }
+    if (percentile == 1.0) { idx = cum.bins() - 1; }
 
-    CV_Assert(idx >= 0 && idx < hist.rows);
-    CV_Assert(idx == 0 || cv::sum(hist(cv::Range(0, idx), cv::Range::all()))[0] / cv::sum(hist)[0] < percentile);
-    CV_Assert(cv::sum(hist(cv::Range(0, idx + 1), cv::Range::all()))[0] / cv::sum(hist)[0] >= percentile);
+    CV_Assert(idx >= 0 && idx < cum.bins());
+    CV_Assert(idx == 0 || cum.prefix(idx - 1) / cum.total() < percentile);
+    CV_Assert(cum.prefix(idx) / cum.total() >= percentile);
     return idx;
 }
 
@@ -122,7 +110,7 @@ void fsiv_percentile_edge_detector(cv::Mat const &gradient, cv::Mat &edges,
     float max_gradient;
     fsiv_compute_gradient_histogram(gradient, n_bins, hist, max_gradient);
 
-    int idx = fsiv_compute_histogram_percentile(hist, th);
+    int idx = fsiv_compute_histogram_percentile(fsiv_cumulative_histogram(hist), th);
 
     float gradient_threshold = fsiv_histogram_idx_to_value(idx, n_bins, max_gradient, 0.0f);
 
@@ -170,8 +158,10 @@ void fsiv_canny_edge_detector(cv::Mat const &dx, cv::Mat const &dy, cv::Mat &edg
     float max_gradient;
     fsiv_compute_gradient_histogram(gradient, n_bins, hist, max_gradient);
 
-    int idx1 = fsiv_compute_histogram_percentile(hist, th1);
-    int idx2 = fsiv_compute_histogram_percentile(hist, th2);
+    // Both thresholds are searched on the same cumulative histogram.
+    const fsiv_cumulative_histogram cum(hist);
+    int idx1 = fsiv_compute_histogram_percentile(cum, th1);
+    int idx2 = fsiv_compute_histogram_percentile(cum, th2);
 
     float gradient_th1 = fsiv_histogram_idx_to_value(idx1, n_bins, max_gradient, 0.0f);
     float gradient_th2 = fsiv_histogram_idx_to_value(idx2, n_bins, max_gradient, 0.0f);
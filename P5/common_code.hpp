@@ -2,6 +2,8 @@
 
 #include <opencv2/core/core.hpp>
 
+#include "fsiv_histogram.hpp"
+
 /**
  * @brief Compute image derivatives.
  *
@@ -45,6 +47,19 @@ void fsiv_compute_gradient_histogram(cv::Mat const &gradient, int n_bins,
  */
 int fsiv_compute_histogram_percentile(cv::Mat const &hist, float percentile);
 
+/**
+ * @brief Compute the histogram idx corresponding with a percentile.
+ *
+ * The cumulative histogram is built once, so several percentiles can be
+ * found with O(log bins) binary searches.
+ *
+ * @param[in] cum the cumulative histogram.
+ * @param[in] percentile the percentile to find.
+ * @return the histogram index corresponding with the percentile.
+ */
+int fsiv_compute_histogram_percentile(fsiv_cumulative_histogram const &cum,
+                                      float percentile);
+
 /**
  * @brief Maps from integer range [0, nbins) to float range [min_value, max_value).
  *
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <exception>
+#include <functional>
 
 // Includes para OpenCV
 #include <opencv2/core/core.hpp>
@@ -9,6 +10,7 @@
 #include <opencv2/calib3d/calib3d.hpp>
 
 #include "common_code.hpp"
+#include "fsiv_preview.hpp"
 
 const char *keys =
     "{help h usage ? |      | print this message   }"
@@ -20,13 +22,18 @@ const char *keys =
     "{th1            | 0.2  | Gradient percentile used as th1 threshold for the Canny detector (th1 < th).}"
     "{m method       | 0    | Detector used: 0:percentile detector, 1:Otsu detector, 2:canny detector}"
     "{c consensus    | 50   | If a ground truth was given, use greater to c% consensus to generate ground truth.}"
+    "{proxy          | 0.25 | interactive mode preview proxy scale. Value 1 means don't render a proxy.}"
     "{@input         |<none>| input image.}"
     "{@output        |<none>| output image.}"
     "{@ground_truth  |      | optional ground truth image to compute the detector metrics.}";
 
+struct Parameters;
+typedef fsiv_preview<Parameters, Parameters> Preview;
+
 struct Parameters
 {
   cv::Mat input;
+  cv::Mat proxy;
   cv::Mat gt_img;
   cv::Mat edges;
   cv::Mat dx;
@@ -40,6 +47,7 @@ struct Parameters
   int method;
   bool interactive;
   float consensus;
+  Preview *preview;
 };
 
 const char *detectors_names[] = {
@@ -47,7 +55,7 @@ const char *detectors_names[] = {
     "OTSU",
     "CANNY"};
 
-void do_the_process(Parameters *params)
+void compute_edges(Parameters *params)
 {
   fsiv_compute_derivate(params->input, params->dx, params->dy, params->g_r,
                         2 * params->s_ap + 1);
@@ -69,7 +77,10 @@ void do_the_process(Parameters *params)
     throw std::runtime_error("Method not implemented.");
     break;
   }
+}
 
+void show_the_results(Parameters *params)
+{
   if (!params->gt_img.empty())
   {
     cv::Mat cm;
@@ -94,18 +105,71 @@ void do_the_process(Parameters *params)
   }
 }
 
+void do_the_process(Parameters *params)
+{
+  compute_edges(params);
+  show_the_results(params);
+}
+
+// Render the interactive preview on a background thread. The proxy is
+// processed with the gaussian radius scaled too.
+bool render_preview(Parameters const &params, double scale,
+                    std::function<bool()> const &cancelled, Parameters &result)
+{
+  // The result only shares the parameters, the images it computes (and
+  // the input it reads) are private to the rendering thread.
+  result = params;
+  result.input = (scale < 1.0 ? params.proxy : params.input).clone();
+  result.edges = cv::Mat();
+  result.dx = cv::Mat();
+  result.dy = cv::Mat();
+  result.gradient = cv::Mat();
+  if (scale < 1.0)
+    result.g_r = cvRound(params.g_r * scale);
+  compute_edges(&result);
+  return !cancelled();
+}
+
+// Show a preview result. The metrics are only computed at full resolution.
+void show_preview(Parameters *params, double scale, Parameters const &result)
+{
+  if (scale < 1.0)
+  {
+    cv::Mat grad_norm;
+    cv::normalize(result.gradient, grad_norm, 0.0, 1.0, cv::NORM_MINMAX);
+    cv::imshow("GRADIENT", fsiv_preview_fit(grad_norm, params->input.size()));
+    cv::imshow(detectors_names[result.method],
+               fsiv_preview_fit(result.edges, params->input.size()));
+    return;
+  }
+  params->dx = result.dx;
+  params->dy = result.dy;
+  params->gradient = result.gradient;
+  params->edges = result.edges;
+  Parameters shown = result;
+  show_the_results(&shown);
+}
+
+void update_the_process(Parameters *params)
+{
+  if (params->preview)
+    params->preview->request(*params);
+  else
+    do_the_process(params);
+}
+
 void onChange_s_ap(int count, void *data)
 {
   Parameters *params = reinterpret_cast<Parameters *>(data);
   params->s_ap = count;
-  do_the_process(params);
+  update_the_process(params);
 }
 
 void onChange_g_r(int count, void *data)
 {
   Parameters *params = reinterpret_cast<Parameters *>(data);
   params->g_r = count;
-  do_the_process(params);
+  update_the_process(params);
 }
 
 void onChange_th1(int count, void *data)
@@ -117,7 +181,7 @@ void onChange_th1(int count, void *data)
     params->th1 = params->th2 - 1;
     cv::setTrackbarPos("TH1", "ORIGINAL", params->th1);
   }
-  do_the_process(params);
+  update_the_process(params);
 }
 
 void onChange_th2(int count, void *data)
@@ -129,21 +193,21 @@ void onChange_th2(int count, void *data)
     params->th2 = params->th1 + 1;
     cv::setTrackbarPos("TH2", "ORIGINAL", params->th2);
   }
-  do_the_process(params);
+  update_the_process(params);
 }
 
 void onChange_method(int count, void *data)
 {
   Parameters *params = reinterpret_cast<Parameters *>(data);
   params->method = count;
-  do_the_process(params);
+  update_the_process(params);
 }
 
 void onChange_consensus(int count, void *data)
 {
   Parameters *params = reinterpret_cast<Parameters *>(data);
   params->consensus = count;
-  do_the_process(params);
+  update_the_process(params);
 }
 
 int main(int argc, char *const *argv)
@@ -194,6 +258,7 @@ int main(int argc, char *const *argv)
     params.method = method;
     params.interactive = interactive;
     params.consensus = consensus;
+    params.preview = nullptr;
 
     if (interactive)
     {
@@ -227,9 +292,23 @@ int main(int argc, char *const *argv)
         cv::setTrackbarPos("consensus", "ORIGINAL", params.consensus);
       }
       do_the_process(&params);
+
+      const double proxy_scale = parser.get<double>("proxy");
+      params.proxy = fsiv_preview_proxy(params.input, proxy_scale);
+      Preview preview(render_preview,
+                      [&params](Parameters const &, double scale, Parameters const &result)
+                      { show_preview(&params, scale, result); },
+                      proxy_scale);
+      params.preview = &preview;
       int key = 0;
       while (key != 13 && key != 27)
-        key = cv::waitKey(0) & 0xff;
+      {
+        // Show the preview results while waiting for a key.
+        key = cv::waitKey(20) & 0xff;
+        preview.poll();
+      }
+      preview.finish();
+      params.preview = nullptr;
       if (key != 27)
         cv::imwrite(output_fname, params.edges);
     }
@@ -0,0 +1,67 @@
+/**
+ * @file bench_p1.cpp
+ * @brief Benchmark of the P1 fsiv_* functions.
+ */
+#include "fsiv_bench.hpp"
+#include "common_code.hpp"
+
+static void
+register_cases(fsiv_bench &bench)
+{
+    const std::vector<cv::Size> &sizes = bench.options().sizes;
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        const int types[] = {CV_8UC1, CV_8UC3, CV_16UC1, CV_32FC1};
+        for (int type : types)
+        {
+            const cv::Mat img = fsiv_bench_image(sizes[s], type);
+            const std::string config = cv::format("%dx%d %s", img.cols, img.rows,
+                                                  fsiv_type_name(type).c_str());
+
+            if (img.depth() == CV_8U)
+                bench.run("fsiv_find_min_max_loc_1", config, [&]()
+                {
+                    std::vector<cv::uint8_t> min_v, max_v;
+                    std::vector<cv::Point> min_loc, max_loc;
+                    fsiv_find_min_max_loc_1(img, min_v, max_v, min_loc, max_loc);
+                });
+
+            bench.run("fsiv_find_min_max_loc_2", config, [&]()
+            {
+                std::vector<double> min_v, max_v;
+                std::vector<cv::Point> min_loc, max_loc;
+                fsiv_find_min_max_loc_2(img, min_v, max_v, min_loc, max_loc);
+            });
+
+            if (img.channels() == 1)
+            {
+                bench.run("fsiv_compute_stats_parallel", config, [&]()
+                {
+                    float media, dev;
+                    fsiv_compute_stats_parallel(img, media, dev);
+                });
+                bench.run("fsiv_stats_accumulator(WELFORD)", config, [&]()
+                {
+                    fsiv_stats_accumulator acc(fsiv_stats_accumulator::WELFORD);
+                    acc.add(img);
+                });
+                bench.run("fsiv_stats_accumulator(KAHAN)", config, [&]()
+                {
+                    fsiv_stats_accumulator acc(fsiv_stats_accumulator::KAHAN);
+                    acc.add(img);
+                });
+            }
+
+            if (type == CV_8UC1)
+                bench.run("fsiv_compute_histogram_parallel", config, [&]()
+                {
+                    fsiv_compute_histogram_parallel(img);
+                });
+        }
+    }
+}
+
+int main(int argc, char *const *argv)
+{
+    return fsiv_bench_main(argc, argv, "P1", register_cases);
+}
@@ -0,0 +1,69 @@
+/**
+ * @file bench_p2.cpp
+ * @brief Benchmark of the P2 fsiv_* functions.
+ */
+#include "fsiv_bench.hpp"
+#include "common_code.hpp"
+
+static void
+register_cases(fsiv_bench &bench)
+{
+    const std::vector<cv::Size> &sizes = bench.options().sizes;
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        const int types[] = {CV_8UC1, CV_8UC3};
+        for (int type : types)
+        {
+            const cv::Mat img = fsiv_bench_image(sizes[s], type);
+            const cv::Mat fimg = fsiv_convert_image_byte_to_float(img);
+            const std::string config = cv::format("%dx%d %s", img.cols, img.rows,
+                                                  fsiv_type_name(type).c_str());
+
+            bench.run("fsiv_convert_image_byte_to_float", config, [&]()
+            {
+                fsiv_convert_image_byte_to_float(img);
+            });
+            bench.run("fsiv_convert_image_float_to_byte", config, [&]()
+            {
+                fsiv_convert_image_float_to_byte(fimg);
+            });
+            if (img.channels() == 3)
+            {
+                const cv::Mat hsv = fsiv_convert_bgr_to_hsv(fimg);
+                bench.run("fsiv_convert_bgr_to_hsv", config, [&]()
+                {
+                    fsiv_convert_bgr_to_hsv(fimg);
+                });
+                bench.run("fsiv_convert_hsv_to_bgr", config, [&]()
+                {
+                    fsiv_convert_hsv_to_bgr(hsv);
+                });
+                bench.run("fsiv_cbg_process", config + " luma", [&]()
+                {
+                    fsiv_cbg_process(img, 1.2, 0.1, 0.8, true);
+                });
+                bench.run("fsiv_cbg_process_luma", config, [&]()
+                {
+                    fsiv_cbg_process_luma(img, 1.2, 0.1, 0.8);
+                });
+            }
+            bench.run("fsiv_cbg_process", config, [&]()
+            {
+                fsiv_cbg_process(img, 1.2, 0.1, 0.8, false);
+            });
+            bench.run("fsiv_cbg_process_fixed", config, [&]()
+            {
+                fsiv_cbg_process_fixed(img, 1.2, 0.1, 0.8, false);
+            });
+            bench.run("fsiv_cbg_create_lut", config, [&]()
+            {
+                fsiv_cbg_create_lut(1.2, 0.1, 0.8);
+            });
+        }
+    }
+}
+
+int main(int argc, char *const *argv)
+{
+    return fsiv_bench_main(argc, argv, "P2", register_cases);
+}
@@ -0,0 +1,128 @@
+/**
+ * @file bench_p3.cpp
+ * @brief Benchmark of the P3 fsiv_* functions.
+ */
+#include <opencv2/imgproc.hpp>
+
+#include "fsiv_bench.hpp"
+#include "common_code.hpp"
+
+/**
+ * @brief Add the estimation error (max channel difference) to a result.
+ */
+static void
+add_error(fsiv_bench_result *r, cv::Scalar const &d)
+{
+    if (!r)
+        return;
+    const double e = std::max(std::abs(d[0]), std::max(std::abs(d[1]), std::abs(d[2])));
+    r->metrics.push_back(std::make_pair("error", e));
+    std::cout << "    estimation error: " << e << " levels" << std::endl;
+}
+
+static void
+register_cases(fsiv_bench &bench)
+{
+    const std::vector<cv::Size> &sizes = bench.options().sizes;
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        const cv::Mat img = fsiv_bench_image(sizes[s], CV_8UC3);
+        cv::Mat gray;
+        fsiv_convert_bgr_to_gray(img, gray);
+        const cv::Mat hist = fsiv_compute_image_histogram(gray);
+        const std::string config = cv::format("%dx%d %s", img.cols, img.rows,
+                                              fsiv_type_name(img.type()).c_str());
+
+        bench.run("fsiv_color_rescaling", config, [&]()
+        {
+            fsiv_color_rescaling(img, cv::Scalar(200, 180, 160), cv::Scalar::all(255));
+        });
+        cv::Mat rescaled;
+        bench.run("fsiv_color_rescaling_inplace", config, [&]()
+        {
+            fsiv_color_rescaling_inplace(img, cv::Scalar(200, 180, 160),
+                                         cv::Scalar::all(255), rescaled);
+        });
+        bench.run("fsiv_convert_bgr_to_gray", config, [&]()
+        {
+            cv::Mat out;
+            fsiv_convert_bgr_to_gray(img, out);
+        });
+        bench.run("fsiv_compute_image_histogram", config, [&]()
+        {
+            fsiv_compute_image_histogram(gray);
+        });
+        bench.run("cv::calcHist (baseline)", config, [&]()
+        {
+            cv::Mat h;
+            const int bins = 256;
+            const float range[] = {0, 256};
+            const float *ranges[] = {range};
+            cv::calcHist(&gray, 1, 0, cv::Mat(), h, 1, &bins, ranges);
+        });
+        bench.run("fsiv_compute_histogram_percentile", config, [&]()
+        {
+            fsiv_compute_histogram_percentile(hist, 0.9f);
+        });
+        bench.run("fsiv_gray_world_color_balance", config, [&]()
+        {
+            fsiv_gray_world_color_balance(img);
+        });
+        bench.run("fsiv_white_patch_color_balance", config + " p=0", [&]()
+        {
+            fsiv_white_patch_color_balance(img, 0.0f);
+        });
+        bench.run("fsiv_white_patch_color_balance", config + " p=10", [&]()
+        {
+            fsiv_white_patch_color_balance(img, 10.0f);
+        });
+        bench.run("fsiv_white_patch_color_balance_fused", config + " p=0", [&]()
+        {
+            fsiv_white_patch_color_balance_fused(img, 0.0f);
+        });
+        bench.run("fsiv_white_patch_color_balance_fused", config + " p=10", [&]()
+        {
+            fsiv_white_patch_color_balance_fused(img, 10.0f);
+        });
+
+        // Video mode steady state: most frames only apply the cached factors.
+        fsiv_illuminant_tracker tracker(10.0f);
+        cv::Mat balanced;
+        bench.run("fsiv_illuminant_tracker::balance", config + " p=10 period=15", [&]()
+        {
+            tracker.balance(img, balanced);
+        });
+
+        // Speed/accuracy trade-off of the approximate estimators: the error
+        // is the max channel difference (gray levels) of the estimated
+        // illuminant against the exact one.
+        const cv::Scalar exact_mean = cv::mean(img);
+        const cv::Scalar exact_white = fsiv_estimate_white_patch(img, 10.0f);
+        const char *methods[] = {"strided", "random", "pyramid"};
+        const double errors[] = {0.5, 1.0, 4.0};
+        for (int m = FSIV_SAMPLING_STRIDED; m <= FSIV_SAMPLING_PYRAMID; ++m)
+            for (double e : errors)
+            {
+                const std::string cfg = cv::format("%s %s e=%g", config.c_str(),
+                                                   methods[m], e);
+                fsiv_bench_result *r = bench.run("fsiv_gray_world_color_balance_approx", cfg, [&]()
+                {
+                    fsiv_gray_world_color_balance_approx(img, m, e);
+                });
+                if (r)
+                    add_error(r, cv::mean(fsiv_sample_image(img, m, e)) - exact_mean);
+                r = bench.run("fsiv_white_patch_color_balance_approx", cfg + " p=10", [&]()
+                {
+                    fsiv_white_patch_color_balance_approx(img, 10.0f, m, e);
+                });
+                if (r)
+                    add_error(r, fsiv_estimate_white_patch(
+                                     fsiv_sample_image(img, m, e), 10.0f) - exact_white);
+            }
+    }
+}
+
+int main(int argc, char *const *argv)
+{
+    return fsiv_bench_main(argc, argv, "P3", register_cases);
+}
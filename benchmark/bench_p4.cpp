@@ -0,0 +1,112 @@
+/**
+ * @file bench_p4.cpp
+ * @brief Benchmark of the P4 fsiv_* functions.
+ */
+#include "fsiv_bench.hpp"
+#include "common_code.hpp"
+
+static void
+register_cases(fsiv_bench &bench)
+{
+    const std::vector<cv::Size> &sizes = bench.options().sizes;
+    const int radius[] = {1, 3, 15, 100};
+    // Measure the correlation cost model now, not inside the first case.
+    fsiv_filter2D_get_costs();
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        const cv::Mat img = fsiv_bench_image(sizes[s], CV_32FC1);
+        const std::string config = cv::format("%dx%d %s", img.cols, img.rows,
+                                              fsiv_type_name(img.type()).c_str());
+
+        bench.run("fsiv_combine_images", config, [&]()
+        {
+            fsiv_combine_images(img, img, 1.0, 0.5);
+        });
+        for (int r : radius)
+        {
+            const std::string rconfig = config + cv::format(" r=%d", r);
+            const cv::Mat box = fsiv_create_box_filter(r);
+            const cv::Mat gauss = fsiv_create_gaussian_filter(r);
+            // A disk is not separable.
+            cv::Mat disk = cv::Mat::zeros(2 * r + 1, 2 * r + 1, CV_32FC1);
+            for (int y = -r; y <= r; ++y)
+                for (int x = -r; x <= r; ++x)
+                    if (x * x + y * y <= r * r)
+                        disk.at<float>(y + r, x + r) = 1.0f;
+            disk /= cv::sum(disk)[0];
+
+            bench.run("fsiv_fill_expansion", rconfig, [&]()
+            {
+                fsiv_fill_expansion(img, r);
+            });
+            bench.run("fsiv_circular_expansion", rconfig, [&]()
+            {
+                fsiv_circular_expansion(img, r);
+            });
+            bench.run("fsiv_filter2D", rconfig + " box", [&]()
+            {
+                fsiv_filter2D(img, box);
+            });
+            bench.run("fsiv_filter2D", rconfig + " gaussian", [&]()
+            {
+                fsiv_filter2D(img, gauss);
+            });
+            bench.run("fsiv_filter2D", rconfig + " disk", [&]()
+            {
+                fsiv_filter2D(img, disk);
+            });
+            bench.run("fsiv_filter2D_fft", rconfig + " disk", [&]()
+            {
+                fsiv_filter2D_fft(img, disk);
+            });
+            cv::Mat kx, ky;
+            fsiv_separate_filter(gauss, kx, ky);
+            bench.run("fsiv_filter2D_separable", rconfig + " gaussian", [&]()
+            {
+                fsiv_filter2D_separable(img, kx, ky);
+            });
+            bench.run("fsiv_box_filter_running", rconfig, [&]()
+            {
+                fsiv_box_filter_running(img, r);
+            });
+            bench.run("fsiv_filter2D_same", rconfig + " gaussian", [&]()
+            {
+                fsiv_filter2D_same(img, gauss, false);
+            });
+            bench.run("fsiv_filter2D_same", rconfig + " gaussian circular", [&]()
+            {
+                fsiv_filter2D_same(img, gauss, true);
+            });
+            bench.run("fsiv_box_filter_running_same", rconfig, [&]()
+            {
+                fsiv_box_filter_running_same(img, r, false);
+            });
+            bench.run("fsiv_gaussian_filter_boxes", rconfig + " passes=3", [&]()
+            {
+                fsiv_gaussian_filter_boxes(img, r, 3);
+            });
+            bench.run("fsiv_usm_enhance", rconfig + " box", [&]()
+            {
+                fsiv_usm_enhance(img, 1.0, r, 0, false);
+            });
+            bench.run("fsiv_usm_enhance", rconfig + " gaussian circular", [&]()
+            {
+                fsiv_usm_enhance(img, 1.0, r, 1, true);
+            });
+            bench.run("fsiv_usm_enhance", rconfig + " gaussian boxes", [&]()
+            {
+                fsiv_usm_enhance(img, 1.0, r, 2, false);
+            });
+            cv::Mat mask;
+            bench.run("fsiv_usm_enhance", rconfig + " gaussian boxes mask", [&]()
+            {
+                fsiv_usm_enhance(img, 1.0, r, 2, false, &mask);
+            });
+        }
+    }
+}
+
+int main(int argc, char *const *argv)
+{
+    return fsiv_bench_main(argc, argv, "P4", register_cases);
+}
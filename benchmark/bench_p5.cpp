@@ -0,0 +1,88 @@
+/**
+ * @file bench_p5.cpp
+ * @brief Benchmark of the P5 fsiv_* functions.
+ */
+#include <opencv2/imgproc.hpp>
+
+#include "fsiv_bench.hpp"
+#include "common_code.hpp"
+
+static void
+register_cases(fsiv_bench &bench)
+{
+    const std::vector<cv::Size> &sizes = bench.options().sizes;
+    const int n_bins = 100;
+    for (size_t s = 0; s < sizes.size(); ++s)
+    {
+        const cv::Mat img = fsiv_bench_image(sizes[s], CV_8UC1);
+        const std::string config = cv::format("%dx%d %s", img.cols, img.rows,
+                                              fsiv_type_name(img.type()).c_str());
+        cv::Mat dx, dy, gradient, hist, edges, cm;
+        float max_gradient = 0.0f;
+        // fsiv_compute_derivate() blurs its input in place.
+        cv::Mat work = img.clone();
+        fsiv_compute_derivate(work, dx, dy, 1, 3);
+        fsiv_compute_gradient_magnitude(dx, dy, gradient);
+        fsiv_compute_gradient_histogram(gradient, n_bins, hist, max_gradient);
+        fsiv_percentile_edge_detector(gradient, edges, 0.8f, n_bins);
+
+        bench.run("fsiv_compute_derivate", config, [&]()
+        {
+            cv::Mat dx_, dy_;
+            fsiv_compute_derivate(work, dx_, dy_, 1, 3);
+        });
+        bench.run("fsiv_compute_gradient_magnitude", config, [&]()
+        {
+            cv::Mat g;
+            fsiv_compute_gradient_magnitude(dx, dy, g);
+        });
+        bench.run("fsiv_compute_gradient_histogram", config, [&]()
+        {
+            cv::Mat h;
+            float m;
+            fsiv_compute_gradient_histogram(gradient, n_bins, h, m);
+        });
+        bench.run("cv::calcHist (baseline)", config, [&]()
+        {
+            cv::Mat h;
+            double min_v, max_v;
+            cv::minMaxLoc(gradient, &min_v, &max_v);
+            const float range[] = {0, static_cast<float>(max_v)};
+            const float *ranges[] = {range};
+            cv::calcHist(&gradient, 1, 0, cv::Mat(), h, 1, &n_bins, ranges);
+        });
+        bench.run("fsiv_compute_histogram_percentile", config, [&]()
+        {
+            fsiv_compute_histogram_percentile(hist, 0.8f);
+        });
+        const fsiv_cumulative_histogram cum(hist);
+        bench.run("fsiv_compute_histogram_percentile (cumulative)", config, [&]()
+        {
+            fsiv_compute_histogram_percentile(cum, 0.8f);
+        });
+        bench.run("fsiv_percentile_edge_detector", config, [&]()
+        {
+            cv::Mat e;
+            fsiv_percentile_edge_detector(gradient, e, 0.8f, n_bins);
+        });
+        bench.run("fsiv_otsu_edge_detector", config, [&]()
+        {
+            cv::Mat e;
+            fsiv_otsu_edge_detector(gradient, e);
+        });
+        bench.run("fsiv_canny_edge_detector", config, [&]()
+        {
+            cv::Mat e;
+            fsiv_canny_edge_detector(dx, dy, e, 0.2f, 0.8f, n_bins);
+        });
+        bench.run("fsiv_compute_confusion_matrix", config, [&]()
+        {
+            fsiv_compute_confusion_matrix(edges, edges, cm);
+        });
+    }
+}
+
+int main(int argc, char *const *argv)
+{
+    return fsiv_bench_main(argc, argv, "P5", register_cases);
+}
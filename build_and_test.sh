@@ -1,7 +1,7 @@
 #!/bin/bash
 
 # List of directories
-build_folders=("P1" "P2" "P3" "P4" "P5" "P6" "P7" "P8" "P9" "P10")
+build_folders=("P1" "P2" "P3" "P4" "P5" "P6" "P7" "P8" "P9" "P10" "benchmark")
 test_folders=("P1" "P2" "P3" "P4" "P5")
 
 # Check if a specific folder is passed as an argument
@@ -46,15 +46,24 @@ for folder in "${build_folders[@]}"; do
 
         if [ "$folder" ]; then
             if [[ " ${test_folders[@]} " =~ " $folder " ]]; then
-                # Run the test and capture its output
-                echo "Running test for $folder..."
-                ./test_common_code >> "../../$test_results_file" 2>&1
-                if [ $? -eq 0 ]; then
-                    echo "[$folder] Test passed." >> "../../$test_results_file"
-                else
-                    echo "[$folder] Test failed." >> "../../$test_results_file"
-                fi
-                echo "======================" >> "../../$test_results_file"
+                # Run the tests (test_common_code and the other test_*
+                # programs of the folder) and capture their output
+                tests=("test_common_code")
+                for test in test_*; do
+                    if [ "$test" != "test_common_code" ] && [ -f "$test" ] && [ -x "$test" ]; then
+                        tests+=("$test")
+                    fi
+                done
+                for test in "${tests[@]}"; do
+                    echo "Running $test for $folder..."
+                    "./$test" >> "../../$test_results_file" 2>&1
+                    if [ $? -eq 0 ]; then
+                        echo "[$folder] Test $test passed." >> "../../$test_results_file"
+                    else
+                        echo "[$folder] Test $test failed." >> "../../$test_results_file"
+                    fi
+                    echo "======================" >> "../../$test_results_file"
+                done
 
                 # Return to the parent folder
             fi
@@ -0,0 +1,329 @@
+/**
+ * @file fsiv_bench.hpp
+ * @brief Micro-benchmark harness for the fsiv_* functions.
+ *
+ * Each case is run some warm-up times and then it is repeated until the
+ * number of repetitions or the time budget is reached. The median and the
+ * median absolute deviation (MAD) of the run times are reported, and the
+ * results can be exported to a JSON file to track regressions.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+/**
+ * @brief Benchmark options.
+ */
+struct fsiv_bench_options
+{
+    int warmup = 3;           // warm-up runs (not measured).
+    int repetitions = 15;     // measured runs.
+    double budget_ms = 2000.; // stop repeating after this time (at least 3 runs).
+    int cpu = -1;             // pin to this cpu (-1 don't pin).
+    std::string filter;       // only run the cases whose name contains it.
+    std::string json;         // export the results to this file.
+    std::vector<cv::Size> sizes;
+};
+
+/**
+ * @brief Result of a benchmark case.
+ */
+struct fsiv_bench_result
+{
+    std::string name;   // function name.
+    std::string config; // size, type and parameters.
+    int repetitions = 0;
+    double median_ms = 0.0;
+    double mad_ms = 0.0;
+    double min_ms = 0.0;
+    std::vector<std::pair<std::string, double>> metrics; // extra values.
+};
+
+/**
+ * @brief Pin the calling thread (and the threads created later) to a cpu.
+ * @param cpu is the cpu index.
+ * @return true if success.
+ */
+inline bool fsiv_pin_to_cpu(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+/**
+ * @brief Median of some values.
+ */
+inline double fsiv_median(std::vector<double> v)
+{
+    if (v.empty())
+        return 0.0;
+    std::sort(v.begin(), v.end());
+    const size_t n = v.size();
+    return (n % 2) ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+/**
+ * @brief Readable name of an OpenCV type (i.e. "8UC3").
+ */
+inline std::string fsiv_type_name(int type)
+{
+    static const char *depths[] = {"8U", "8S", "16U", "16S", "32S", "32F", "64F", "16F"};
+    std::ostringstream s;
+    s << depths[CV_MAT_DEPTH(type)] << 'C' << CV_MAT_CN(type);
+    return s.str();
+}
+
+/**
+ * @brief Parse a list of sizes like "vga,hd,fullhd,4k,8k,320x240".
+ */
+inline std::vector<cv::Size> fsiv_parse_sizes(std::string const &list)
+{
+    std::vector<cv::Size> sizes;
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+    {
+        if (item == "vga")
+            sizes.push_back(cv::Size(640, 480));
+        else if (item == "hd")
+            sizes.push_back(cv::Size(1280, 720));
+        else if (item == "fullhd")
+            sizes.push_back(cv::Size(1920, 1080));
+        else if (item == "4k")
+            sizes.push_back(cv::Size(3840, 2160));
+        else if (item == "8k")
+            sizes.push_back(cv::Size(7680, 4320));
+        else
+        {
+            int w = 0, h = 0;
+            char x = 0;
+            std::istringstream wh(item);
+            if (!(wh >> w >> x >> h) || x != 'x' || w <= 0 || h <= 0)
+                throw std::runtime_error("Wrong size '" + item + "'.");
+            sizes.push_back(cv::Size(w, h));
+        }
+    }
+    return sizes;
+}
+
+/**
+ * @brief Create a random image to be used as benchmark input.
+ * @param size is the image size.
+ * @param type is the image type (8U, 16U or 32F depths are in full range,
+ * 32F values are in [0, 1)).
+ * @return the image.
+ */
+inline cv::Mat fsiv_bench_image(cv::Size size, int type)
+{
+    cv::Mat img(size, type);
+    cv::RNG rng(0x5eed);
+    const int depth = CV_MAT_DEPTH(type);
+    const double high = depth == CV_8U ? 256.0 : depth == CV_16U ? 65536.0 : 1.0;
+    rng.fill(img, cv::RNG::UNIFORM, 0.0, high);
+    return img;
+}
+
+/**
+ * @brief Benchmark runner.
+ */
+class fsiv_bench
+{
+public:
+    explicit fsiv_bench(fsiv_bench_options const &opts) : opts_(opts) {}
+
+    /** @brief The options. */
+    fsiv_bench_options const &options() const { return opts_; }
+
+    /**
+     * @brief Run a case.
+     * @param name is the function name.
+     * @param config describes the input (size, type, parameters).
+     * @param fn runs the function once.
+     * @return the result (nullptr if it was filtered out).
+     */
+    fsiv_bench_result *run(std::string const &name, std::string const &config,
+                           std::function<void()> fn)
+    {
+        if (!opts_.filter.empty() && name.find(opts_.filter) == std::string::npos)
+            return nullptr;
+
+        for (int i = 0; i < opts_.warmup; ++i)
+            fn();
+
+        std::vector<double> times;
+        double total = 0.0;
+        cv::TickMeter tm;
+        while (static_cast<int>(times.size()) < opts_.repetitions &&
+               (times.size() < 3 || total < opts_.budget_ms))
+        {
+            tm.reset();
+            tm.start();
+            fn();
+            tm.stop();
+            times.push_back(tm.getTimeMilli());
+            total += times.back();
+        }
+
+        CV_Assert(!times.empty());
+        fsiv_bench_result r;
+        r.name = name;
+        r.config = config;
+        r.repetitions = static_cast<int>(times.size());
+        r.median_ms = fsiv_median(times);
+        r.min_ms = *std::min_element(times.begin(), times.end());
+        std::vector<double> dev(times.size());
+        for (size_t i = 0; i < times.size(); ++i)
+            dev[i] = std::abs(times[i] - r.median_ms);
+        r.mad_ms = fsiv_median(dev);
+
+        std::cout << std::left << std::setw(40) << name << std::setw(36) << config
+                  << std::right << std::fixed << std::setprecision(3)
+                  << std::setw(12) << r.median_ms << " ms +- "
+                  << std::setw(8) << r.mad_ms << " (" << r.repetitions << " reps)"
+                  << std::endl;
+        results_.push_back(r);
+        return &results_.back();
+    }
+
+    /** @brief The results. */
+    std::vector<fsiv_bench_result> const &results() const { return results_; }
+
+    /**
+     * @brief Export the results as a JSON document.
+     * @param fname is the output file name.
+     * @param module is the module name (i.e. "P1").
+     * @return true if success.
+     */
+    bool write_json(std::string const &fname, std::string const &module) const
+    {
+        std::ofstream out(fname);
+        if (!out)
+            return false;
+        const std::time_t now = std::time(nullptr);
+        char date[32];
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+        out << "{\n  \"module\": \"" << module << "\",\n"
+            << "  \"date\": \"" << date << "\",\n"
+            << "  \"opencv\": \"" << CV_VERSION << "\",\n"
+            << "  \"threads\": " << cv::getNumThreads() << ",\n"
+            << "  \"cpu\": " << opts_.cpu << ",\n"
+            << "  \"results\": [\n";
+        out << std::setprecision(6);
+        for (size_t i = 0; i < results_.size(); ++i)
+        {
+            const fsiv_bench_result &r = results_[i];
+            out << "    {\"name\": \"" << r.name << "\", \"config\": \"" << r.config
+                << "\", \"repetitions\": " << r.repetitions
+                << ", \"median_ms\": " << r.median_ms
+                << ", \"mad_ms\": " << r.mad_ms
+                << ", \"min_ms\": " << r.min_ms;
+            for (size_t m = 0; m < r.metrics.size(); ++m)
+                out << ", \"" << r.metrics[m].first << "\": " << r.metrics[m].second;
+            out << "}" << (i + 1 < results_.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        return static_cast<bool>(out);
+    }
+
+private:
+    fsiv_bench_options opts_;
+    std::vector<fsiv_bench_result> results_;
+};
+
+/**
+ * @brief Common main() of the benchmark programs.
+ * @param argc,argv are the program arguments.
+ * @param module is the module name (i.e. "P1").
+ * @param register_cases runs the module cases.
+ * @return the program exit code.
+ */
+inline int fsiv_bench_main(int argc, char *const *argv, std::string const &module,
+                           std::function<void(fsiv_bench &)> register_cases)
+{
+    const cv::String keys =
+        "{help h usage ? |                    | print this message.}"
+        "{w warmup       |3                   | warm-up runs.}"
+        "{r reps         |15                  | measured runs.}"
+        "{t time         |2000                | time budget per case in ms (at least 3 runs).}"
+        "{p cpu          |-1                  | pin to this cpu (it also limits OpenCV to one thread).}"
+        "{s sizes        |vga,hd,fullhd,4k,8k | image sizes: vga,hd,fullhd,4k,8k or WxH.}"
+        "{f filter       |                    | only run the functions whose name contains it.}"
+        "{o json         |                    | export the results to this JSON file.}";
+
+    int retCode = EXIT_SUCCESS;
+    try
+    {
+        cv::CommandLineParser parser(argc, argv, keys);
+        parser.about("Benchmark the " + module + " fsiv_* functions.");
+        if (parser.has("help"))
+        {
+            parser.printMessage();
+            return EXIT_SUCCESS;
+        }
+        fsiv_bench_options opts;
+        opts.warmup = parser.get<int>("w");
+        opts.repetitions = parser.get<int>("r");
+        opts.budget_ms = parser.get<double>("t");
+        opts.cpu = parser.get<int>("p");
+        opts.filter = parser.get<std::string>("f");
+        opts.json = parser.get<std::string>("o");
+        opts.sizes = fsiv_parse_sizes(parser.get<std::string>("s"));
+        if (!parser.check())
+        {
+            parser.printErrors();
+            return EXIT_FAILURE;
+        }
+        if (opts.warmup < 0 || opts.repetitions <= 0)
+        {
+            std::cerr << "Error: the warm-up runs must be >= 0 and the measured runs > 0."
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (opts.cpu >= 0)
+        {
+            if (!fsiv_pin_to_cpu(opts.cpu))
+                std::cerr << "Warning: could not pin to cpu " << opts.cpu << "." << std::endl;
+            cv::setNumThreads(1);
+        }
+
+        fsiv_bench bench(opts);
+        register_cases(bench);
+
+        if (!opts.json.empty() && !bench.write_json(opts.json, module))
+        {
+            std::cerr << "Error: could not write '" << opts.json << "'." << std::endl;
+            retCode = EXIT_FAILURE;
+        }
+    }
+    catch (std::exception &e)
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        retCode = EXIT_FAILURE;
+    }
+    return retCode;
+}
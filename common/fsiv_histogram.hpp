@@ -0,0 +1,474 @@
+/**
+ * @file fsiv_histogram.hpp
+ * @brief Parallel privatized histogram engine.
+ *
+ * The image is split in row tiles that are processed in parallel. Each
+ * worker bins its tiles into its own private histogram (several
+ * sub-histograms, so consecutive equal values do not serialize on the same
+ * counter) and the private histograms are merged at the end. The binning is the one of a uniform cv::calcHist: a value v in
+ * [low, high) goes to bin floor((v - low) * bins / (high - low)).
+ */
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#include "fsiv_parallel.hpp"
+
+/**
+ * @brief Use this value as histogram range limit to discover it from the image.
+ */
+const double FSIV_HIST_AUTO = std::numeric_limits<double>::quiet_NaN();
+
+/**
+ * @brief Count the values of an integer image tile (one counter per value).
+ * @param counts has n_sub sub-histograms of 1 << (8*sizeof(T)) counters.
+ * @pre n_sub is 1, 2 or 4.
+ */
+template <class T>
+inline void
+fsiv_histogram_count_values(cv::Mat const &img, cv::Mat const &mask,
+                            cv::Range const &rows, int n_sub,
+                            std::int64_t *counts)
+{
+    const int values = 1 << (8 * sizeof(T));
+    for (int y = rows.start; y < rows.end; ++y)
+    {
+        const T *p = img.ptr<T>(y);
+        const uchar *m = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+        if (m)
+        {
+            for (int x = 0; x < img.cols; ++x)
+                if (m[x])
+                    ++counts[(x % n_sub) * values + p[x]];
+            continue;
+        }
+        // Value x goes to the sub-histogram x % n_sub.
+        std::int64_t *c1 = counts + (1 % n_sub) * values;
+        std::int64_t *c2 = counts + (2 % n_sub) * values;
+        std::int64_t *c3 = counts + (3 % n_sub) * values;
+        int x = 0;
+        for (; x <= img.cols - 4; x += 4)
+        {
+            ++counts[p[x]];
+            ++c1[p[x + 1]];
+            ++c2[p[x + 2]];
+            ++c3[p[x + 3]];
+        }
+        for (; x < img.cols; ++x)
+            ++counts[(x % n_sub) * values + p[x]];
+    }
+}
+
+/**
+ * @brief Find the min/max values of a floating point image tile.
+ * @param lo,hi are updated with the min/max of the (masked) values.
+ */
+template <class T>
+inline void
+fsiv_histogram_min_max(cv::Mat const &img, cv::Mat const &mask,
+                       cv::Range const &rows, double &lo, double &hi)
+{
+    for (int y = rows.start; y < rows.end; ++y)
+    {
+        const T *p = img.ptr<T>(y);
+        const uchar *m = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+        T l = std::numeric_limits<T>::max();
+        T h = std::numeric_limits<T>::lowest();
+        for (int x = 0; x < img.cols; ++x)
+            if (!m || m[x])
+            {
+                l = std::min(l, p[x]);
+                h = std::max(h, p[x]);
+            }
+        if (l <= h)
+        {
+            lo = std::min(lo, double(l));
+            hi = std::max(hi, double(h));
+        }
+    }
+}
+
+/**
+ * @brief Bin the values of a floating point image tile, tracking the min/max
+ * values in the same pass.
+ * @param hist has 4 sub-histograms of bins counters.
+ * @param lo,hi are updated with the min/max of the (masked) values.
+ * @pre low < high
+ */
+template <class T>
+inline void
+fsiv_histogram_bin_values(cv::Mat const &img, cv::Mat const &mask,
+                          cv::Range const &rows, int bins, double low,
+                          double high, std::int64_t *hist, double &lo,
+                          double &hi)
+{
+    const double a = bins / (high - low);
+    const double b = -low * a;
+    for (int y = rows.start; y < rows.end; ++y)
+    {
+        const T *p = img.ptr<T>(y);
+        const uchar *m = mask.empty() ? nullptr : mask.ptr<uchar>(y);
+        T l = std::numeric_limits<T>::max();
+        T h = std::numeric_limits<T>::lowest();
+        for (int x = 0; x < img.cols; ++x)
+        {
+            if (m && !m[x])
+                continue;
+            l = std::min(l, p[x]);
+            h = std::max(h, p[x]);
+            const double v = p[x];
+            if (!(v >= low && v < high))
+                continue;
+            const int idx = std::min(std::max(cvFloor(v * a + b), 0), bins - 1);
+            ++hist[(x & 3) * bins + idx];
+        }
+        if (l <= h)
+        {
+            lo = std::min(lo, double(l));
+            hi = std::max(hi, double(h));
+        }
+    }
+}
+
+/**
+ * @brief Compute the histogram of an image in parallel.
+ *
+ * For 8U/16U images each worker counts every value and the min/max are
+ * found from the counts, so they are discovered in the same pass (4
+ * sub-histograms per worker for 8U images, 2 for 16U images so the private
+ * counts stay small). For 32F/64F images the min/max are tracked while
+ * binning, so a given range needs one pass. An automatic range needs a
+ * first min/max pass: the bin edges depend on the min/max values and the
+ * uniform cv::calcHist binning can not be recovered exactly by rebinning a
+ * histogram of a guessed range.
+ *
+ * @param img is the input image.
+ * @param bins is the number of bins.
+ * @param low is the lower (inclusive) limit of the range. Use FSIV_HIST_AUTO
+ *        to use the min value of the image.
+ * @param high is the upper (exclusive) limit of the range. Use FSIV_HIST_AUTO
+ *        to use the max value of the image (as cv::calcHist, the pixels
+ *        equal to it are out of the range).
+ * @param mask is an optional mask. Only the pixels with mask!=0 are used.
+ * @param min_v if it is not null, it returns the min value of the (masked) image.
+ * @param max_v if it is not null, it returns the max value of the (masked) image.
+ * @return the histogram (bins x 1, CV_32FC1).
+ * @pre img.channels()==1
+ * @pre img.depth() is CV_8U, CV_16U, CV_32F or CV_64F.
+ * @pre bins>0
+ * @pre mask.empty() || (mask.type()==CV_8UC1 && mask.size()==img.size())
+ */
+inline cv::Mat
+fsiv_parallel_histogram(cv::Mat const &img, int bins, double low, double high,
+                        cv::Mat const &mask = cv::Mat(),
+                        double *min_v = nullptr, double *max_v = nullptr)
+{
+    CV_Assert(img.channels() == 1);
+    CV_Assert(img.depth() == CV_8U || img.depth() == CV_16U ||
+              img.depth() == CV_32F || img.depth() == CV_64F);
+    CV_Assert(bins > 0);
+    CV_Assert(mask.empty() || (mask.type() == CV_8UC1 && mask.size() == img.size()));
+
+    const std::vector<cv::Range> tiles = img.rows > 0
+        ? fsiv_make_row_tiles(img.rows, img.cols) : std::vector<cv::Range>();
+    const int n_tiles = static_cast<int>(tiles.size());
+    const double stripes = std::max(1, cv::getNumThreads());
+    std::mutex merge_mutex;
+    double lo = std::numeric_limits<double>::max();
+    double hi = std::numeric_limits<double>::lowest();
+    std::vector<std::int64_t> hist(bins, 0);
+
+    if (img.depth() == CV_8U || img.depth() == CV_16U)
+    {
+        const bool is_8u = img.depth() == CV_8U;
+        const int values = is_8u ? 256 : 65536;
+        const int n_sub = is_8u ? 4 : 2;
+        std::vector<std::int64_t> counts(values, 0);
+        cv::parallel_for_(cv::Range(0, n_tiles), [&](const cv::Range &r)
+        {
+            std::vector<std::int64_t> local(n_sub * values, 0);
+            for (int t = r.start; t < r.end; ++t)
+                if (is_8u)
+                    fsiv_histogram_count_values<uchar>(img, mask, tiles[t], n_sub, &local[0]);
+                else
+                    fsiv_histogram_count_values<ushort>(img, mask, tiles[t], n_sub, &local[0]);
+            std::lock_guard<std::mutex> lock(merge_mutex);
+            for (int s = 0; s < n_sub; ++s)
+                for (int v = 0; v < values; ++v)
+                    counts[v] += local[s * values + v];
+        }, stripes);
+
+        for (int v = 0; v < values; ++v)
+            if (counts[v])
+            {
+                lo = std::min(lo, double(v));
+                hi = v;
+            }
+        if (lo > hi)
+            lo = hi = 0.0;
+        if (std::isnan(low))
+            low = lo;
+        if (std::isnan(high))
+            high = hi;
+        if (low < high)
+        {
+            const double a = bins / (high - low);
+            const double b = -low * a;
+            for (int v = 0; v < values; ++v)
+                if (counts[v] && v >= low && v < high)
+                    hist[std::min(std::max(cvFloor(v * a + b), 0), bins - 1)] += counts[v];
+        }
+    }
+    else
+    {
+        const bool is_32f = img.depth() == CV_32F;
+        // A min/max pass is needed for an automatic range (or an empty one,
+        // which is not binned). Otherwise they are tracked while binning.
+        if (std::isnan(low) || std::isnan(high) || (!(low < high) && (min_v || max_v)))
+        {
+            cv::parallel_for_(cv::Range(0, n_tiles), [&](const cv::Range &r)
+            {
+                double tlo = std::numeric_limits<double>::max();
+                double thi = std::numeric_limits<double>::lowest();
+                for (int t = r.start; t < r.end; ++t)
+                    if (is_32f)
+                        fsiv_histogram_min_max<float>(img, mask, tiles[t], tlo, thi);
+                    else
+                        fsiv_histogram_min_max<double>(img, mask, tiles[t], tlo, thi);
+                std::lock_guard<std::mutex> lock(merge_mutex);
+                lo = std::min(lo, tlo);
+                hi = std::max(hi, thi);
+            }, stripes);
+            if (std::isnan(low))
+                low = lo > hi ? 0.0 : lo;
+            if (std::isnan(high))
+                high = lo > hi ? 0.0 : hi;
+        }
+        if (low < high)
+            cv::parallel_for_(cv::Range(0, n_tiles), [&](const cv::Range &r)
+            {
+                std::vector<std::int64_t> local(4 * bins, 0);
+                double tlo = std::numeric_limits<double>::max();
+                double thi = std::numeric_limits<double>::lowest();
+                for (int t = r.start; t < r.end; ++t)
+                    if (is_32f)
+                        fsiv_histogram_bin_values<float>(img, mask, tiles[t], bins, low, high,
+                                                         &local[0], tlo, thi);
+                    else
+                        fsiv_histogram_bin_values<double>(img, mask, tiles[t], bins, low, high,
+                                                          &local[0], tlo, thi);
+                std::lock_guard<std::mutex> lock(merge_mutex);
+                lo = std::min(lo, tlo);
+                hi = std::max(hi, thi);
+                for (int s = 0; s < 4; ++s)
+                    for (int i = 0; i < bins; ++i)
+                        hist[i] += local[s * bins + i];
+            }, stripes);
+        if (lo > hi)
+            lo = hi = 0.0;
+    }
+
+    if (min_v)
+        *min_v = lo;
+    if (max_v)
+        *max_v = hi;
+    cv::Mat out(bins, 1, CV_32FC1);
+    for (int i = 0; i < bins; ++i)
+        out.at<float>(i) = static_cast<float>(hist[i]);
+    return out;
+}
+
+/**
+ * @brief Compute the histogram of byte values generated row by row.
+ *
+ * The values are never stored as an image: each worker asks row(y, values)
+ * for the cols values of a row into its own row buffer and bins them into
+ * its private sub-histograms, so a value image computed on the fly (i.e.
+ * the luminance of a BGR image) is binned in the same pass. The rows are
+ * split in tiles as in fsiv_parallel_histogram.
+ *
+ * @param rows is the number of rows.
+ * @param cols is the number of values of a row.
+ * @param row writes the values of a row: row(int y, uchar *values). It is
+ *        called once per row, from several threads at the same time.
+ * @return the histogram (256 x 1, CV_32FC1), one bin per value.
+ * @pre rows>=0 && cols>=0
+ */
+template <class RowFn>
+inline cv::Mat
+fsiv_parallel_histogram_rows(int rows, int cols, RowFn row)
+{
+    CV_Assert(rows >= 0 && cols >= 0);
+    const std::vector<cv::Range> tiles = rows > 0
+        ? fsiv_make_row_tiles(rows, cols) : std::vector<cv::Range>();
+    const double stripes = std::max(1, cv::getNumThreads());
+    std::mutex merge_mutex;
+    std::vector<std::int64_t> hist(256, 0);
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())),
+                      [&](const cv::Range &r)
+    {
+        std::vector<std::int64_t> local(4 * 256, 0);
+        std::vector<uchar> values(std::max(1, cols));
+        const cv::Mat values_row(1, cols, CV_8UC1, &values[0]);
+        for (int t = r.start; t < r.end; ++t)
+            for (int y = tiles[t].start; y < tiles[t].end; ++y)
+            {
+                row(y, &values[0]);
+                fsiv_histogram_count_values<uchar>(values_row, cv::Mat(),
+                                                   cv::Range(0, 1), 4, &local[0]);
+            }
+        std::lock_guard<std::mutex> lock(merge_mutex);
+        for (int s = 0; s < 4; ++s)
+            for (int v = 0; v < 256; ++v)
+                hist[v] += local[s * 256 + v];
+    }, stripes);
+
+    cv::Mat out(256, 1, CV_32FC1);
+    for (int v = 0; v < 256; ++v)
+        out.at<float>(v) = static_cast<float>(hist[v]);
+    return out;
+}
+
+/**
+ * @brief Cumulative histogram with O(log bins) percentile queries.
+ *
+ * The counts are kept in a Fenwick (binary indexed) tree built once in
+ * O(bins), so any number of prefix sums and percentile queries can be
+ * answered in O(log bins). The counts can be nudged (add/remove pixels of a
+ * bin) in O(log bins) too, which fits histograms updated frame by frame.
+ *
+ * The counts are accumulated in double, so they are exact for integer
+ * counts up to 2^53.
+ */
+class fsiv_cumulative_histogram
+{
+public:
+    fsiv_cumulative_histogram() : total_(0.0) {}
+
+    /**
+     * @brief Build the cumulative histogram.
+     * @param hist is a histogram (CV_32FC1, n x 1).
+     */
+    explicit fsiv_cumulative_histogram(cv::Mat const &hist) { reset(hist); }
+
+    /**
+     * @brief Build the cumulative histogram in O(bins).
+     * @param hist is a histogram (CV_32FC1, n x 1).
+     * @pre hist.type()==CV_32FC1 && hist.cols==1
+     */
+    void reset(cv::Mat const &hist)
+    {
+        CV_Assert(hist.type() == CV_32FC1 && hist.cols == 1);
+        const int n = hist.rows;
+        counts_.assign(n, 0.0);
+        tree_.assign(n + 1, 0.0);
+        total_ = 0.0;
+        for (int i = 0; i < n; ++i)
+        {
+            counts_[i] = hist.at<float>(i);
+            total_ += counts_[i];
+            tree_[i + 1] += counts_[i];
+            const int parent = (i + 1) + ((i + 1) & -(i + 1));
+            if (parent <= n)
+                tree_[parent] += tree_[i + 1];
+        }
+    }
+
+    /** @brief Number of bins. */
+    int bins() const { return static_cast<int>(counts_.size()); }
+
+    /** @brief Sum of all the bins. */
+    double total() const { return total_; }
+
+    /** @brief Count of a bin. */
+    double count(int idx) const
+    {
+        CV_Assert(idx >= 0 && idx < bins());
+        return counts_[idx];
+    }
+
+    /**
+     * @brief Sum of the bins [0, idx].
+     * @return 0 if idx < 0.
+     */
+    double prefix(int idx) const
+    {
+        CV_Assert(idx < bins());
+        double sum = 0.0;
+        for (int i = idx + 1; i > 0; i -= i & -i)
+            sum += tree_[i];
+        return sum;
+    }
+
+    /**
+     * @brief Add (or remove, if negative) pixels to a bin.
+     * @pre idx >= 0 && idx < bins()
+     * @pre count(idx) + n >= 0
+     */
+    void add(int idx, double n)
+    {
+        CV_Assert(idx >= 0 && idx < bins());
+        CV_Assert(counts_[idx] + n >= 0.0);
+        counts_[idx] += n;
+        total_ += n;
+        for (int i = idx + 1; i <= bins(); i += i & -i)
+            tree_[i] += n;
+    }
+
+    /** @brief Remove pixels from a bin. */
+    void remove(int idx, double n) { add(idx, -n); }
+
+    /**
+     * @brief Find the first bin whose prefix sum satisfies a predicate.
+     * @param pred is a predicate over prefix sums which is monotone (once
+     *        it is true, it is true for any greater sum).
+     * @return the first idx with pred(prefix(idx)), or bins() if none.
+     */
+    template <class Pred>
+    int find_first(Pred pred) const
+    {
+        const int n = bins();
+        int step = 1;
+        while (step * 2 <= n)
+            step *= 2;
+        int pos = 0;
+        double acc = 0.0;
+        for (; step > 0; step /= 2)
+            if (pos + step <= n && !pred(acc + tree_[pos + step]))
+            {
+                pos += step;
+                acc += tree_[pos];
+            }
+        return pos;
+    }
+
+    /**
+     * @brief Find the first bin whose prefix sum is >= p * total().
+     * @param p is the percentile in [0, 1].
+     * @return the bin index.
+     * @pre bins() > 0
+     */
+    int percentile(double p) const
+    {
+        CV_Assert(bins() > 0);
+        CV_Assert(p >= 0.0 && p <= 1.0);
+        const double target = p * total_;
+        return std::min(find_first([target](double c)
+                                   { return c >= target; }),
+                        bins() - 1);
+    }
+
+private:
+    std::vector<double> counts_;
+    std::vector<double> tree_;
+    double total_;
+};
@@ -0,0 +1,31 @@
+/**
+ * @file fsiv_memory.hpp
+ * @brief Memory usage of the process.
+ */
+#pragma once
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+/**
+ * @brief Peak resident set size of the process.
+ * @return the peak RSS in MiB or a negative value if it is not available.
+ */
+inline double
+fsiv_peak_rss_mb()
+{
+    double rss = -1.0;
+#if defined(__unix__) || defined(__APPLE__)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+#if defined(__APPLE__)
+        rss = usage.ru_maxrss / (1024.0 * 1024.0); // bytes.
+#else
+        rss = usage.ru_maxrss / 1024.0; // KiB.
+#endif
+    }
+#endif
+    return rss;
+}
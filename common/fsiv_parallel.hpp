@@ -0,0 +1,457 @@
+/**
+ * @file fsiv_parallel.hpp
+ * @brief Generic parallel engines: row tiled reductions, a bounded lock-free
+ * ring buffer and a capture/process/display pipeline.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+/**
+ * @brief Split the rows of an image in tiles for a parallel reduction.
+ *
+ * The tiling only depends on the image geometry (never on the number of
+ * threads), so a reduction merged in tile order is deterministic.
+ *
+ * @param rows is the number of image rows.
+ * @param row_size is the number of elements (cols*channels) of a row.
+ * @param tile_rows forces the rows per tile. Value 0 means choose it so each
+ *        tile has about 256K elements.
+ * @return the row ranges, in order.
+ * @pre rows>0
+ */
+inline std::vector<cv::Range>
+fsiv_make_row_tiles(int rows, int row_size, int tile_rows = 0)
+{
+    CV_Assert( rows > 0 );
+    if (tile_rows <= 0)
+        tile_rows = std::max(1, (1 << 18) / std::max(1, row_size));
+
+    std::vector<cv::Range> tiles;
+    for (int row = 0; row < rows; row += tile_rows)
+        tiles.push_back(cv::Range(row, std::min(rows, row + tile_rows)));
+
+    CV_Assert( !tiles.empty() );
+    return tiles;
+}
+
+/**
+ * @brief Parallel reduction of an image by row tiles.
+ *
+ * Each tile is reduced into its own partial result with map(tile, row0, partial),
+ * where row0 is the first image row of the tile. Then the partial results are
+ * merged in tile order with merge(acc, partial), so a merge that keeps the
+ * accumulated value on ties preserves the first-occurrence semantics of a
+ * rows/cols scanning.
+ *
+ * @param img is the input image.
+ * @param init is the initial value of every partial result.
+ * @param map reduces a tile.
+ * @param merge merges two partial results.
+ * @param tile_rows see fsiv_make_row_tiles.
+ * @return the merged result.
+ * @pre !img.empty()
+ */
+template <class Partial, class MapFn, class MergeFn>
+inline Partial fsiv_parallel_row_reduce(cv::Mat const& img, Partial const& init,
+    MapFn map, MergeFn merge, int tile_rows = 0)
+{
+    CV_Assert( !img.empty() );
+    const std::vector<cv::Range> tiles = fsiv_make_row_tiles(img.rows,
+        img.cols*img.channels(), tile_rows);
+    std::vector<Partial> partials(tiles.size(), init);
+
+    cv::parallel_for_(cv::Range(0, static_cast<int>(tiles.size())),
+        [&](const cv::Range& r)
+        {
+            for (int t = r.start; t < r.end; ++t)
+                map(img.rowRange(tiles[t]), tiles[t].start, partials[t]);
+        });
+
+    Partial result = partials[0];
+    for (size_t t = 1; t < partials.size(); ++t)
+        merge(result, partials[t]);
+    return result;
+}
+
+/**
+ * @brief Wait a bit in a spin loop: first yield, then sleep.
+ * @param spins is the number of times it was called (it is incremented).
+ */
+inline void fsiv_backoff(int& spins)
+{
+    if (++spins < 64)
+        std::this_thread::yield();
+    else
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+}
+
+/**
+ * @brief Maximum capacity of a ring buffer (slots).
+ */
+const size_t FSIV_RING_BUFFER_MAX_CAPACITY = size_t(1) << 20;
+
+/**
+ * @brief Bounded lock-free ring buffer.
+ *
+ * It is D. Vyukov's bounded MPMC queue: each slot has a sequence number
+ * that says if it is ready to be written or read, so producers and
+ * consumers only synchronize with a CAS on the tail/head counters.
+ * Several producers and consumers may use it at the same time.
+ */
+template <class T>
+class fsiv_ring_buffer
+{
+public:
+    /**
+     * @brief Create the buffer.
+     * @param capacity is the minimum capacity (rounded up to a power of two).
+     * @pre 0<capacity && capacity<=FSIV_RING_BUFFER_MAX_CAPACITY
+     */
+    explicit fsiv_ring_buffer(size_t capacity)
+    {
+        CV_Assert(capacity > 0 && capacity <= FSIV_RING_BUFFER_MAX_CAPACITY);
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mask_ = size - 1;
+        slots_.reset(new Slot[size]);
+        for (size_t i = 0; i < size; ++i)
+            slots_[i].seq.store(i, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    /** @brief Capacity of the buffer. */
+    size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+    /**
+     * @brief Push a value if there is room.
+     * @return false if the buffer is full.
+     */
+    bool try_push(T const& v)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[pos & mask_];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const std::intptr_t dif = static_cast<std::intptr_t>(seq) -
+                                      static_cast<std::intptr_t>(pos);
+            if (dif == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                {
+                    slot.value = v;
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (dif < 0)
+                return false;
+            else
+                pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Pop the oldest value if there is one.
+     * @return false if the buffer is empty.
+     */
+    bool try_pop(T& v)
+    {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Slot& slot = slots_[pos & mask_];
+            const size_t seq = slot.seq.load(std::memory_order_acquire);
+            const std::intptr_t dif = static_cast<std::intptr_t>(seq) -
+                                      static_cast<std::intptr_t>(pos + 1);
+            if (dif == 0)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1,
+                                                std::memory_order_relaxed))
+                {
+                    v = slot.value;
+                    slot.value = T(); // release resources (i.e. cv::Mat data).
+                    slot.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (dif < 0)
+                return false;
+            else
+                pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Push a value waiting for room or dropping the oldest value.
+     * @param v is the value.
+     * @param drop_oldest if true, drop the oldest values instead of waiting.
+     * @param cancel stop waiting when it is set.
+     * @param dropped if not nullptr, it is incremented for each dropped value.
+     * @return false if it was cancelled.
+     */
+    bool push(T const& v, bool drop_oldest, std::atomic<bool> const& cancel,
+              size_t* dropped = nullptr)
+    {
+        int spins = 0;
+        while (!try_push(v))
+        {
+            if (cancel.load())
+                return false;
+            T old;
+            if (drop_oldest && try_pop(old))
+            {
+                if (dropped)
+                    ++*dropped;
+            }
+            else
+                fsiv_backoff(spins);
+        }
+        return true;
+    }
+
+    /**
+     * @brief Pop a value waiting for it.
+     * @param v is the value.
+     * @param done is set by the producers when they have finished.
+     * @return false if the producers have finished and the buffer is empty.
+     */
+    bool pop(T& v, std::atomic<bool> const& done)
+    {
+        int spins = 0;
+        while (!try_pop(v))
+        {
+            if (done.load())
+                return try_pop(v);
+            fsiv_backoff(spins);
+        }
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    char pad0_[64]; // keep head and tail in different cache lines.
+    std::atomic<size_t> head_;
+    char pad1_[64];
+    std::atomic<size_t> tail_;
+};
+
+/**
+ * @brief Options of the capture/process/display pipeline.
+ */
+struct fsiv_pipeline_options
+{
+    size_t queue_size = 4;    // capacity of the ring buffers between stages.
+    bool drop_oldest = false; // when a buffer is full drop the oldest frame, else block.
+};
+
+/**
+ * @brief Timing statistics of a pipeline stage.
+ */
+struct fsiv_stage_stats
+{
+    size_t frames = 0;    // frames processed by the stage.
+    size_t dropped = 0;   // frames dropped when pushing to the next stage.
+    double busy_ms = 0.0; // accumulated time doing the stage work.
+};
+
+/**
+ * @brief Timing statistics of a pipeline run.
+ */
+struct fsiv_pipeline_stats
+{
+    fsiv_stage_stats capture;
+    fsiv_stage_stats process;
+    fsiv_stage_stats display;
+    double latency_ms = 0.0; // accumulated capture to display latency.
+    double wall_ms = 0.0;    // duration of the run.
+};
+
+/**
+ * @brief A frame moving through the pipeline.
+ */
+struct fsiv_pipeline_packet
+{
+    cv::Mat frame;
+    int64 t_captured = 0; // tick count when the frame was captured.
+};
+
+/**
+ * @brief Convert cv::getTickCount() ticks to milliseconds.
+ */
+inline double
+fsiv_ticks_to_ms(int64 ticks)
+{
+    return 1000.0 * static_cast<double>(ticks) / cv::getTickFrequency();
+}
+
+/**
+ * @brief Run a three stages capture/process/display pipeline.
+ *
+ * The capture and the processing stages run on their own threads. The
+ * display stage runs on the caller thread because HighGUI must be used from
+ * the main thread. The stages are joined by bounded lock-free ring buffers.
+ *
+ * @param grab reads the next frame. It returns false at the end of the input.
+ * @param process processes a frame (in place).
+ * @param display shows a frame. It returns false to stop the pipeline.
+ * @param opts are the pipeline options.
+ * @return the timing statistics.
+ * @throw the first exception thrown by a stage (grab, process or display),
+ *        after stopping and joining the others.
+ */
+inline fsiv_pipeline_stats
+fsiv_run_pipeline(std::function<bool(cv::Mat&)> grab,
+    std::function<void(cv::Mat&)> process,
+    std::function<bool(cv::Mat&)> display,
+    fsiv_pipeline_options const& opts = fsiv_pipeline_options())
+{
+    fsiv_pipeline_stats stats;
+    fsiv_ring_buffer<fsiv_pipeline_packet> captured(opts.queue_size);
+    fsiv_ring_buffer<fsiv_pipeline_packet> processed(opts.queue_size);
+    std::atomic<bool> stop(false);
+    std::atomic<bool> capture_done(false);
+    std::atomic<bool> process_done(false);
+    // An exception thrown by a stage stops the others and it is rethrown
+    // by the caller thread once all of them are joined.
+    std::exception_ptr capture_error, process_error, display_error;
+
+    const int64 t_start = cv::getTickCount();
+
+    std::thread capture_thread([&]()
+    {
+        try
+        {
+            for (;;)
+            {
+                fsiv_pipeline_packet p;
+                const int64 t0 = cv::getTickCount();
+                if (stop.load() || !grab(p.frame) || p.frame.empty())
+                    break;
+                p.t_captured = cv::getTickCount();
+                stats.capture.busy_ms += fsiv_ticks_to_ms(p.t_captured - t0);
+                ++stats.capture.frames;
+                if (!captured.push(p, opts.drop_oldest, stop,
+                                   &stats.capture.dropped))
+                    break;
+            }
+        }
+        catch (...)
+        {
+            capture_error = std::current_exception();
+            stop.store(true);
+        }
+        capture_done.store(true);
+    });
+
+    std::thread process_thread([&]()
+    {
+        try
+        {
+            fsiv_pipeline_packet p;
+            while (!stop.load() && captured.pop(p, capture_done))
+            {
+                const int64 t0 = cv::getTickCount();
+                process(p.frame);
+                stats.process.busy_ms += fsiv_ticks_to_ms(cv::getTickCount() - t0);
+                ++stats.process.frames;
+                if (!processed.push(p, opts.drop_oldest, stop,
+                                    &stats.process.dropped))
+                    break;
+            }
+        }
+        catch (...)
+        {
+            process_error = std::current_exception();
+            stop.store(true);
+        }
+        process_done.store(true);
+    });
+
+    try
+    {
+        fsiv_pipeline_packet p;
+        while (!stop.load() && processed.pop(p, process_done))
+        {
+            const int64 t0 = cv::getTickCount();
+            if (!display(p.frame))
+                stop.store(true);
+            const int64 t1 = cv::getTickCount();
+            stats.display.busy_ms += fsiv_ticks_to_ms(t1 - t0);
+            stats.latency_ms += fsiv_ticks_to_ms(t1 - p.t_captured);
+            ++stats.display.frames;
+        }
+    }
+    catch (...)
+    {
+        display_error = std::current_exception();
+    }
+    stop.store(true);
+
+    capture_thread.join();
+    process_thread.join();
+    if (capture_error)
+        std::rethrow_exception(capture_error);
+    if (process_error)
+        std::rethrow_exception(process_error);
+    if (display_error)
+        std::rethrow_exception(display_error);
+    stats.wall_ms = fsiv_ticks_to_ms(cv::getTickCount() - t_start);
+    return stats;
+}
+
+/**
+ * @brief Print the statistics of a pipeline stage.
+ */
+inline void
+fsiv_print_stage_stats(std::ostream& out, const char* name,
+    fsiv_stage_stats const& s, double wall_ms)
+{
+    out << name << ": " << s.frames << " frames, "
+        << (s.frames ? s.busy_ms / s.frames : 0.0) << " ms/frame, "
+        << (wall_ms > 0.0 ? 1000.0 * s.frames / wall_ms : 0.0) << " fps, "
+        << s.dropped << " dropped." << std::endl;
+}
+
+/**
+ * @brief Print the per stage latency and throughput of a pipeline run.
+ * @param out is the output stream.
+ * @param stats are the statistics to print.
+ */
+inline void
+fsiv_print_pipeline_stats(std::ostream& out, fsiv_pipeline_stats const& stats)
+{
+    fsiv_print_stage_stats(out, "Capture", stats.capture, stats.wall_ms);
+    fsiv_print_stage_stats(out, "Process", stats.process, stats.wall_ms);
+    fsiv_print_stage_stats(out, "Display", stats.display, stats.wall_ms);
+    out << "Capture to display latency: "
+        << (stats.display.frames ? stats.latency_ms / stats.display.frames : 0.0)
+        << " ms/frame." << std::endl;
+}
@@ -0,0 +1,269 @@
+/**
+ * @file fsiv_preview.hpp
+ * @brief Debounced background rendering for the interactive tools.
+ *
+ * The trackbar callbacks only post the new parameters with request(). A
+ * background thread renders the latest parameters: first a downscaled proxy
+ * and then the full resolution image. Parameters posted while rendering
+ * supersede the current job, which is cancelled at its next check point and
+ * its result discarded, so a fast slider drag never queues stale work.
+ *
+ * HighGUI must be used from the main thread, so the rendered results are
+ * shown by poll(), which is called from the main loop between waitKey calls.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+/**
+ * @brief Resize a proxy result to the size of the full resolution image.
+ * @param img is the rendered image.
+ * @param size is the full resolution size.
+ * @return img if it already has this size, else a resized copy.
+ */
+inline cv::Mat
+fsiv_preview_fit(cv::Mat const &img, cv::Size const &size)
+{
+    if (img.empty() || img.size() == size)
+        return img;
+    cv::Mat out;
+    cv::resize(img, out, size, 0.0, 0.0, cv::INTER_LINEAR);
+    return out;
+}
+
+/**
+ * @brief Downscale an image to be used as the proxy input.
+ * @param img is the full resolution image.
+ * @param scale is the proxy scale in (0, 1].
+ * @return the downscaled image (img if scale >= 1).
+ */
+inline cv::Mat
+fsiv_preview_proxy(cv::Mat const &img, double scale)
+{
+    if (scale >= 1.0 || img.empty())
+        return img;
+    cv::Mat out;
+    cv::resize(img, out, cv::Size(), scale, scale, cv::INTER_AREA);
+    return out;
+}
+
+/**
+ * @brief Interactive preview engine.
+ *
+ * @tparam Params are the rendering parameters (copied for each job).
+ * @tparam Result is the rendered result.
+ */
+template <class Params, class Result>
+class fsiv_preview
+{
+public:
+    /**
+     * @brief Render the parameters at a scale.
+     * The third argument returns true when the job has been superseded, the
+     * render should check it between its stages and return false if so.
+     * @return false if the job was cancelled.
+     */
+    typedef std::function<bool(Params const &, double,
+                               std::function<bool()> const &, Result &)>
+        Render;
+
+    /**
+     * @brief Show a result. It is called from the thread that calls poll().
+     */
+    typedef std::function<void(Params const &, double, Result const &)> Show;
+
+    /**
+     * @brief Create the engine and start the rendering thread.
+     * @param render is the render function.
+     * @param show is the show function.
+     * @param proxy_scale is the scale of the proxy render. Values >= 1 mean
+     *        don't render a proxy.
+     */
+    fsiv_preview(Render render, Show show, double proxy_scale = 0.25)
+        : render_(render), show_(show), proxy_scale_(proxy_scale),
+          stop_(false), generation_(0), pending_(false), busy_(false),
+          ready_(false), ready_scale_(0.0), proxy_latency_ms_(0.0),
+          latency_ms_(0.0), verbose_(true)
+    {
+        worker_ = std::thread(&fsiv_preview::run, this);
+    }
+
+    ~fsiv_preview()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        cond_.notify_all();
+        worker_.join();
+    }
+
+    /**
+     * @brief Post new parameters. Only the latest posted ones are rendered.
+     */
+    void request(Params const &params)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            params_ = params;
+            pending_ = true;
+            ++generation_;
+            request_time_ = Clock::now();
+        }
+        cond_.notify_all();
+    }
+
+    /**
+     * @brief Show the last rendered result, if any.
+     * @return true if a result was shown.
+     */
+    bool poll()
+    {
+        Params params;
+        Result result;
+        double scale, ms;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!ready_)
+                return false;
+            ready_ = false;
+            params = ready_params_;
+            result = ready_result_;
+            scale = ready_scale_;
+            ms = scale < 1.0 ? proxy_latency_ms_ : latency_ms_;
+        }
+        show_(params, scale, result);
+        if (verbose_)
+            std::cout << "Preview: " << (scale < 1.0 ? "proxy" : "full resolution")
+                      << " in " << ms << " ms." << std::endl;
+        cond_.notify_all();
+        return true;
+    }
+
+    /**
+     * @brief Wait until the last posted parameters are rendered at full
+     * resolution and show the result.
+     */
+    void finish()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this]()
+                   { return !pending_ && !busy_; });
+        lock.unlock();
+        poll();
+    }
+
+    /** @brief Latency (ms) from the request to the last proxy result. */
+    double proxy_latency_ms() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return proxy_latency_ms_;
+    }
+
+    /** @brief Latency (ms) from the request to the last full result. */
+    double latency_ms() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return latency_ms_;
+    }
+
+    /** @brief Print (or not) the latency of each shown result. */
+    void set_verbose(bool verbose) { verbose_ = verbose; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;)
+        {
+            cond_.wait(lock, [this]()
+                       { return stop_ || pending_; });
+            if (stop_)
+                return;
+            const Params params = params_;
+            const size_t generation = generation_;
+            const Clock::time_point t0 = request_time_;
+            pending_ = false;
+            busy_ = true;
+            lock.unlock();
+
+            const std::function<bool()> cancelled = [this, generation]()
+            {
+                std::lock_guard<std::mutex> l(mutex_);
+                return stop_ || generation_ != generation;
+            };
+            if (proxy_scale_ < 1.0)
+                render_and_store(params, proxy_scale_, generation, t0, cancelled);
+            render_and_store(params, 1.0, generation, t0, cancelled);
+
+            lock.lock();
+            busy_ = false;
+            cond_.notify_all();
+        }
+    }
+
+    void render_and_store(Params const &params, double scale, size_t generation,
+                          Clock::time_point t0,
+                          std::function<bool()> const &cancelled)
+    {
+        if (cancelled())
+            return;
+        Result result;
+        try
+        {
+            if (!render_(params, scale, cancelled, result))
+                return;
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << "Preview: render failed: " << e.what() << std::endl;
+            return;
+        }
+        const double ms = std::chrono::duration<double, std::milli>(
+                              Clock::now() - t0).count();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (generation_ != generation)
+            return;
+        ready_ = true;
+        ready_params_ = params;
+        ready_result_ = result;
+        ready_scale_ = scale;
+        if (scale < 1.0)
+            proxy_latency_ms_ = ms;
+        else
+            latency_ms_ = ms;
+    }
+
+    Render render_;
+    Show show_;
+    double proxy_scale_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread worker_;
+    bool stop_;
+    size_t generation_;
+    bool pending_;
+    bool busy_;
+    Params params_;
+    Clock::time_point request_time_;
+
+    bool ready_;
+    Params ready_params_;
+    Result ready_result_;
+    double ready_scale_;
+    double proxy_latency_ms_;
+    double latency_ms_;
+    bool verbose_;
+};
@@ -0,0 +1,348 @@
+/**
+ * @file fsiv_tiles.hpp
+ * @brief Tiled, out-of-core processing of images that do not fit in RAM.
+ *
+ * The input and output images are raw pixel files mapped in memory
+ * (fsiv_mapped_image). fsiv_process_tiles() walks the image by bands of
+ * tiles: each tile is copied with a halo around it (sized to the radius of
+ * the operation, e.g. the USM radius or the Sobel aperture / 2), the
+ * operation is applied to the tile and only its central part is written
+ * back. When a band is done its output pages are flushed and dropped and
+ * the input rows no longer needed are dropped too, so the resident memory
+ * is bounded by a few bands whatever the image size.
+ *
+ * The halo pixels outside the image are generated with the same border
+ * rules as cv::copyMakeBorder applied to the whole image, so for halo >=
+ * radius the tiled result is the same as processing the whole image.
+ *
+ * Only raw storage (optionally after a fixed size header) is supported:
+ * TIFF strips would need libtiff, which the modules do not depend on.
+ * It uses POSIX mmap/madvise.
+ */
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/utility.hpp>
+
+#include "fsiv_memory.hpp"
+
+/**
+ * @brief An image stored as raw pixels in a file mapped in memory.
+ *
+ * The rows are stored contiguously (step == cols * elemSize) after an
+ * optional header of a fixed size.
+ */
+class fsiv_mapped_image
+{
+public:
+    fsiv_mapped_image()
+        : base_(nullptr), length_(0), offset_(0), rows_(0), cols_(0),
+          type_(0), writable_(false) {}
+
+    ~fsiv_mapped_image() { close(); }
+
+    /**
+     * @brief Map an existing raw image file.
+     * @param path is the file.
+     * @param rows, cols, type describe the image.
+     * @param writable maps the file for reading and writing.
+     * @param offset is the size of the header before the pixels.
+     * @return false if the file could not be mapped or it is too short.
+     */
+    bool open(std::string const &path, int rows, int cols, int type,
+              bool writable = false, size_t offset = 0)
+    {
+        CV_Assert(rows > 0 && cols > 0);
+        close();
+        const int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        const size_t needed = offset + size_t(rows) * cols * CV_ELEM_SIZE(type);
+        bool ok = fstat(fd, &st) == 0 && size_t(st.st_size) >= needed;
+        if (ok)
+            ok = map(fd, needed, writable);
+        ::close(fd);
+        if (ok)
+            set_header(rows, cols, type, offset, writable);
+        return ok;
+    }
+
+    /**
+     * @brief Create (or truncate) a raw image file and map it for writing.
+     * @return false if the file could not be created.
+     */
+    bool create(std::string const &path, int rows, int cols, int type)
+    {
+        CV_Assert(rows > 0 && cols > 0);
+        close();
+        const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return false;
+        const size_t needed = size_t(rows) * cols * CV_ELEM_SIZE(type);
+        bool ok = ftruncate(fd, static_cast<off_t>(needed)) == 0 &&
+                  map(fd, needed, true);
+        ::close(fd);
+        if (ok)
+            set_header(rows, cols, type, 0, true);
+        return ok;
+    }
+
+    /** @brief Flush and unmap the file. */
+    void close()
+    {
+        if (!base_)
+            return;
+        if (writable_)
+            msync(base_, length_, MS_SYNC);
+        munmap(base_, length_);
+        base_ = nullptr;
+        length_ = 0;
+    }
+
+    bool is_open() const { return base_ != nullptr; }
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    int type() const { return type_; }
+    cv::Size size() const { return cv::Size(cols_, rows_); }
+
+    /**
+     * @brief A cv::Mat header over the mapped pixels (no copy). The pages
+     * are only read from the file when they are accessed.
+     */
+    cv::Mat mat() const
+    {
+        CV_Assert(is_open());
+        return cv::Mat(rows_, cols_, type_, base_ + offset_, step());
+    }
+
+    /**
+     * @brief Drop the pages of the rows [y0, y1) from the process memory.
+     * In a writable mapping the rows are flushed first, so no data is lost.
+     */
+    void release_rows(int y0, int y1)
+    {
+        y0 = std::max(0, y0);
+        y1 = std::min(rows_, y1);
+        if (!is_open() || y0 >= y1)
+            return;
+        const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        const size_t begin = offset_ + size_t(y0) * step();
+        const size_t end = offset_ + size_t(y1) * step();
+        // Only the whole pages inside the rows, the others are shared with
+        // the neighbour rows.
+        const size_t first = (begin + page - 1) / page * page;
+        const size_t last = end / page * page;
+        if (first >= last)
+            return;
+        if (writable_)
+            msync(base_ + first, last - first, MS_SYNC);
+        madvise(base_ + first, last - first, MADV_DONTNEED);
+    }
+
+private:
+    fsiv_mapped_image(fsiv_mapped_image const &);
+    fsiv_mapped_image &operator=(fsiv_mapped_image const &);
+
+    size_t step() const { return size_t(cols_) * CV_ELEM_SIZE(type_); }
+
+    bool map(int fd, size_t length, bool writable)
+    {
+        void *p = mmap(nullptr, length, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            return false;
+        base_ = static_cast<uchar *>(p);
+        length_ = length;
+        return true;
+    }
+
+    void set_header(int rows, int cols, int type, size_t offset, bool writable)
+    {
+        rows_ = rows;
+        cols_ = cols;
+        type_ = type;
+        offset_ = offset;
+        writable_ = writable;
+    }
+
+    uchar *base_;
+    size_t length_;
+    size_t offset_;
+    int rows_;
+    int cols_;
+    int type_;
+    bool writable_;
+};
+
+/**
+ * @brief Options of the tiled processing.
+ */
+struct fsiv_tile_options
+{
+    cv::Size tile = cv::Size(1024, 1024);   // tile size (without the halo).
+    int halo = 0;                           // halo width around each tile.
+    int border = cv::BORDER_REFLECT_101;    // border type outside the image.
+    cv::Scalar border_value = cv::Scalar(); // value for cv::BORDER_CONSTANT.
+};
+
+/**
+ * @brief Statistics of a tiled processing run.
+ */
+struct fsiv_tile_stats
+{
+    long tiles = 0;           // processed tiles.
+    double seconds = 0.0;     // wall time.
+    double tiles_per_sec = 0.0;
+    double mpixels_per_sec = 0.0;
+    double peak_rss_mb = 0.0; // peak resident memory of the process (MiB).
+};
+
+/**
+ * @brief Operation applied to a tile.
+ * The first argument is the tile with its halo and the output must have
+ * its same size (the type can be different).
+ */
+typedef std::function<void(cv::Mat const &, cv::Mat &)> fsiv_tile_op;
+
+/**
+ * @brief Copy a region of an image extended with a halo.
+ * The pixels outside the image are generated as cv::copyMakeBorder would do
+ * for the whole image.
+ * @param img is the whole image.
+ * @param roi is the region (inside the image).
+ * @param halo is the halo width.
+ * @param border is the border type.
+ * @param value is the border value for cv::BORDER_CONSTANT.
+ * @param out is the output (roi size + 2*halo).
+ */
+inline void
+fsiv_copy_tile(cv::Mat const &img, cv::Rect const &roi, int halo, int border,
+               cv::Scalar const &value, cv::Mat &out)
+{
+    const cv::Rect ext(roi.x - halo, roi.y - halo,
+                       roi.width + 2 * halo, roi.height + 2 * halo);
+    const cv::Rect inside = ext & cv::Rect(0, 0, img.cols, img.rows);
+    if (inside == ext)
+    {
+        img(ext).copyTo(out);
+        return;
+    }
+    if (border != cv::BORDER_WRAP && inside.width > halo && inside.height > halo)
+    {
+        // The missing sides are image edges and the border only needs the
+        // pixels next to them, so the region can be extended by itself.
+        cv::copyMakeBorder(img(inside), out, inside.y - ext.y,
+                           ext.br().y - inside.br().y, inside.x - ext.x,
+                           ext.br().x - inside.br().x,
+                           border | cv::BORDER_ISOLATED, value);
+        return;
+    }
+    // General case (e.g. cv::BORDER_WRAP): map every pixel.
+    out.create(ext.height, ext.width, img.type());
+    const size_t esz = img.elemSize();
+    for (int y = 0; y < ext.height; ++y)
+    {
+        uchar *dst = out.ptr(y);
+        const int sy = cv::borderInterpolate(ext.y + y, img.rows, border);
+        if (sy < 0)
+        {
+            out.row(y).setTo(value);
+            continue;
+        }
+        const uchar *src = img.ptr(sy);
+        for (int x = 0; x < ext.width; ++x)
+        {
+            const int sx = cv::borderInterpolate(ext.x + x, img.cols, border);
+            if (sx < 0)
+                out(cv::Rect(x, y, 1, 1)).setTo(value);
+            else
+                std::copy(src + sx * esz, src + (sx + 1) * esz, dst + x * esz);
+        }
+    }
+}
+
+/**
+ * @brief Apply an operation to an image by tiles with a halo.
+ *
+ * The tiles of a band are processed in parallel. After each band the
+ * written output rows are flushed and dropped and the input rows above the
+ * next band halo are dropped, so the memory used is bounded by about two
+ * bands of input and the tiles buffers.
+ *
+ * @param in is the input image.
+ * @param out is the output image (same size, opened for writing).
+ * @param op is the operation.
+ * @param opts are the tiling options.
+ * @return the run statistics.
+ * @pre in.size()==out.size()
+ * @pre opts.tile.area()>0 && opts.halo>=0
+ */
+inline fsiv_tile_stats
+fsiv_process_tiles(fsiv_mapped_image &in, fsiv_mapped_image &out,
+                   fsiv_tile_op const &op,
+                   fsiv_tile_options const &opts = fsiv_tile_options())
+{
+    CV_Assert(in.is_open() && out.is_open());
+    CV_Assert(in.size() == out.size());
+    CV_Assert(opts.tile.width > 0 && opts.tile.height > 0 && opts.halo >= 0);
+
+    const cv::Mat src = in.mat();
+    cv::Mat dst = out.mat();
+    const int halo = opts.halo;
+    const int n_cols = (src.cols + opts.tile.width - 1) / opts.tile.width;
+    fsiv_tile_stats stats;
+    const int64 t0 = cv::getTickCount();
+
+    for (int y = 0; y < src.rows; y += opts.tile.height)
+    {
+        const int h = std::min(opts.tile.height, src.rows - y);
+        cv::parallel_for_(cv::Range(0, n_cols), [&](const cv::Range &r)
+        {
+            cv::Mat tile, result;
+            for (int c = r.start; c < r.end; ++c)
+            {
+                const int x = c * opts.tile.width;
+                const cv::Rect roi(x, y, std::min(opts.tile.width, src.cols - x), h);
+                fsiv_copy_tile(src, roi, halo, opts.border, opts.border_value, tile);
+                op(tile, result);
+                CV_Assert(result.size() == tile.size() && result.type() == dst.type());
+                result(cv::Rect(halo, halo, roi.width, roi.height)).copyTo(dst(roi));
+            }
+        });
+        stats.tiles += n_cols;
+        out.release_rows(y, y + h);
+        in.release_rows(0, y + h - halo);
+    }
+
+    stats.seconds = (cv::getTickCount() - t0) / cv::getTickFrequency();
+    if (stats.seconds > 0.0)
+    {
+        stats.tiles_per_sec = stats.tiles / stats.seconds;
+        stats.mpixels_per_sec = double(src.total()) / stats.seconds * 1.0e-6;
+    }
+    stats.peak_rss_mb = fsiv_peak_rss_mb();
+    return stats;
+}
+
+/**
+ * @brief Print the statistics of a tiled processing run.
+ */
+inline void
+fsiv_print_tile_stats(std::ostream &out, fsiv_tile_stats const &stats)
+{
+    out << "Tiles: " << stats.tiles << " in " << stats.seconds << " s ("
+        << stats.tiles_per_sec << " tiles/s, " << stats.mpixels_per_sec
+        << " Mpx/s). Peak RSS: " << stats.peak_rss_mb << " MiB."
+        << std::endl;
+}